@@ -0,0 +1,108 @@
+#include "archive.h"
+
+#include <cstdio>
+
+#include <llvm/Object/ObjectFile.h>
+
+// Fixed 60 byte header of an ar member
+static std::string memberHeader(const std::string& name, uint64_t size) {
+	char header[61];
+	std::snprintf(header, sizeof(header), "%-16s%-12s%-6s%-6s%-8s%-10llu`\n",
+		name.c_str(), "0", "0", "0", "644", static_cast<unsigned long long>(size));
+	return std::string(header, 60);
+}
+
+ArchiveWriter::ArchiveWriter(const std::string& p) : path(p), members(p + ".members", std::ios::binary) {
+	if (!members)
+		throw std::runtime_error("[Archive] Can't write " + path + ".members");
+}
+
+ArchiveWriter::~ArchiveWriter() {
+	if (members.is_open())
+		members.close();
+	std::remove((path + ".members").c_str());
+}
+
+void ArchiveWriter::add(const char* data, size_t length) {
+	auto object = llvm::object::ObjectFile::createObjectFile(llvm::MemoryBufferRef(llvm::StringRef(data, length), path));
+	if (!object)
+		throw std::runtime_error("[Archive] " + llvm::toString(object.takeError()));
+
+	for (const auto& symbol : (*object)->symbols()) {
+		auto flags = symbol.getFlags();
+		if (!flags) {
+			llvm::consumeError(flags.takeError());
+			continue;
+		}
+		if (!(*flags & llvm::object::SymbolRef::SF_Global) || (*flags & llvm::object::SymbolRef::SF_Undefined) ||
+			(*flags & llvm::object::SymbolRef::SF_FormatSpecific))
+			continue;
+
+		auto name = symbol.getName();
+		if (!name) {
+			llvm::consumeError(name.takeError());
+			continue;
+		}
+		symbols.emplace_back(name->str(), membersSize);
+	}
+
+	const std::string header = memberHeader("f" + std::to_string(count++) + ".o/", length);
+	members.write(header.data(), header.size());
+	members.write(data, length);
+	membersSize += header.size() + length;
+
+	// members start at even offsets
+	if (length % 2) {
+		members.put('\n');
+		membersSize++;
+	}
+}
+
+void ArchiveWriter::finish() {
+	members.close();
+	if (!members)
+		throw std::runtime_error("[Archive] Writing " + path + ".members failed");
+
+	size_t names = 0;
+	for (const auto& symbol : symbols)
+		names += symbol.first.size() + 1;
+
+	// big endian offsets of 4 bytes, 8 (/SYM64/) when the archive outgrows them
+	size_t width = 4;
+	auto indexStart = [&]() {
+		const uint64_t indexSize = width + symbols.size() * width + names;
+		return 8 + 60 + indexSize + indexSize % 2;
+	};
+	if (indexStart() + membersSize > UINT32_MAX)
+		width = 8;
+	const uint64_t start = indexStart();
+
+	std::string index;
+	auto put = [&](uint64_t value) {
+		for (size_t i = width; i-- > 0;)
+			index += static_cast<char>(value >> (8 * i));
+	};
+	put(symbols.size());
+	for (const auto& symbol : symbols)
+		put(start + symbol.second);
+	for (const auto& symbol : symbols) {
+		index += symbol.first;
+		index += '\0';
+	}
+
+	std::ofstream out(path, std::ios::binary);
+	if (!out)
+		throw std::runtime_error("[Archive] Can't write " + path);
+
+	out << "!<arch>\n" << memberHeader(width == 4 ? "/" : "/SYM64/", index.size()) << index;
+	if (index.size() % 2)
+		out.put('\n');
+
+	std::ifstream in(path + ".members", std::ios::binary);
+	std::vector<char> block(1 << 16);
+	while (in.read(block.data(), block.size()) || in.gcount() > 0)
+		out.write(block.data(), in.gcount());
+
+	if (!out)
+		throw std::runtime_error("[Archive] Writing " + path + " failed");
+}
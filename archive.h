@@ -0,0 +1,23 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+// GNU ar archive written member by member. Members go to "path.members"
+// first, finish() writes the symbol index and copies them behind it.
+class ArchiveWriter {
+    std::string path;
+    std::ofstream members;
+    uint64_t membersSize = 0;
+    std::vector<std::pair<std::string, uint64_t>> symbols;   // name -> member offset in "path.members"
+    size_t count = 0;
+
+public:
+    explicit ArchiveWriter(const std::string& path);
+    ~ArchiveWriter();
+
+    // Object file, its global definitions go to the symbol index
+    void add(const char* data, size_t length);
+    void finish();
+};
@@ -1,13 +1,144 @@
 #include "ast.h"
+#include "debuginfo.h"
+#include "multiversion.h"
+#include "ssa.h"
 
-llvm::LLVMContext Context;
-llvm::IRBuilder<> Builder(Context);
-std::unique_ptr<llvm::Module> g_Module;
-std::map<std::string, llvm::Value*> NamedValues;
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <sstream>
+
+// Code generation state is per thread so several modules can be built in parallel
+thread_local std::unique_ptr<llvm::LLVMContext> g_Context;
+thread_local std::unique_ptr<llvm::IRBuilder<>> g_Builder;
+thread_local std::unique_ptr<llvm::Module> g_Module;
+thread_local std::map<std::string, llvm::Value*> NamedValues;   // name -> alloca, null for SSA variables
+thread_local const PrototypeTable* g_Prototypes = nullptr;
+thread_local const PurityTable* g_Purity = nullptr;
+CodegenOptions g_Options;
+
+void initializeLLVM(const std::string& moduleName) {
+
+	// drop the old module before the context that owns it
+	resetDebugInfo();
+	g_Module.reset();
+	g_Builder.reset();
+
+	g_Context = std::make_unique<llvm::LLVMContext>();
+	g_Builder = std::make_unique<llvm::IRBuilder<>>(*g_Context);
+	g_Module  = std::make_unique<llvm::Module>(moduleName, *g_Context);
+	if (!g_Module)
+		std::cout << "[initializeLLVM] Module is failed!";
+}
+
+// Callee from g_Module, or a declaration made from g_Prototypes
+static llvm::Function* getFunction(const std::string& name) {
+	if (llvm::Function* F = g_Module->getFunction(name))
+		return F;
+
+	if (g_Prototypes) {
+		auto proto = g_Prototypes->find(name);
+		if (proto != g_Prototypes->end())
+			return PrototypeAST(name, proto->second).codegen();
+	}
+
+	return nullptr;
+}
+
+// Spawned calls of the function being generated
+struct SpawnSite {
+	llvm::AllocaInst* future;   // i8*, null when nothing is pending
+	llvm::Value*      target;   // double*, null when the result is dropped
+};
+thread_local std::vector<SpawnSite> SpawnSites;
+
+// Allocas go to the entry block so mem2reg can promote them
+static llvm::AllocaInst* createEntryAlloca(llvm::Function* func, llvm::Type* type, const std::string& name, llvm::Value* init = nullptr) {
+	llvm::IRBuilder<> entry(&func->getEntryBlock(), func->getEntryBlock().begin());
+	llvm::AllocaInst* alloca = entry.CreateAlloca(type, nullptr, name);
+	if (init)
+		entry.CreateStore(init, alloca);
+	return alloca;
+}
+
+// --ssa -> variables of the function being generated live in SSA, except
+// MemoryVariables (spawn targets, dalg_sync writes them through a pointer)
+thread_local SSABuilder SSA;
+thread_local std::set<std::string> MemoryVariables;
+
+static std::set<std::string> spawnTargets(ExprAST* body) {
+	std::set<std::string> targets;
+	std::vector<ExprAST*> work{ body };
+	while (!work.empty()) {
+		ExprAST* node = work.back();
+		work.pop_back();
+
+		if (auto* spawn = dynamic_cast<SpawnExprAST*>(node))
+			if (!spawn->getTarget().empty())
+				targets.insert(spawn->getTarget());
+
+		node->children(work);
+	}
+	return targets;
+}
+
+static llvm::Value* readVariable(const std::string& name) {
+	auto var = NamedValues.find(name);
+	if (var == NamedValues.end())
+		throw std::runtime_error("[VariableExprAST] Unknown variable name: " + name);
+
+	if (!var->second)
+		return SSA.readVariable(name, g_Builder->GetInsertBlock());
+	return g_Builder->CreateLoad(llvm::cast<llvm::AllocaInst>(var->second)->getAllocatedType(), var->second, name);
+}
+
+// Declares the variable on first use, memory variables get a zeroed slot in
+// the entry block so loops don't grow the stack. A vector variable keeps its width.
+static void assignVariable(const std::string& name, llvm::Value* value, const SourceLocation& loc, unsigned argNo = 0) {
+	llvm::Type* type = value->getType()->isVectorTy() ? value->getType() : llvm::Type::getDoubleTy(*g_Context);
+
+	auto var = NamedValues.find(name);
+	if (var == NamedValues.end()) {
+		llvm::AllocaInst* alloca = nullptr;
+		if (!g_Options.frontendSSA || MemoryVariables.count(name)) {
+			alloca = createEntryAlloca(g_Builder->GetInsertBlock()->getParent(), type, name, llvm::Constant::getNullValue(type));
+			emitDeclare(alloca, name, argNo, loc);
+		}
+		var = NamedValues.emplace(name, alloca).first;
+	}
+
+	llvm::Type* old = var->second ? llvm::cast<llvm::AllocaInst>(var->second)->getAllocatedType() : SSA.variableType(name);
+	if (old && old != type && (old->isVectorTy() || type->isVectorTy()))
+		throw std::runtime_error("[AssignmentExprAST] Variable changes between number and vector: " + name);
+
+	if (var->second)
+		g_Builder->CreateStore(value, var->second);
+	else
+		SSA.writeVariable(name, g_Builder->GetInsertBlock(), value);
+}
+
+// dalg_sync(future, target) for one site, then the site is free again
+static void emitSync(const SpawnSite& site) {
+	llvm::Type* i8PtrTy     = llvm::Type::getInt8PtrTy(*g_Context);
+	llvm::Type* doublePtrTy = llvm::Type::getDoublePtrTy(*g_Context);
+
+	llvm::FunctionCallee syncFunc = g_Module->getOrInsertFunction("dalg_sync",
+		llvm::Type::getVoidTy(*g_Context), i8PtrTy, doublePtrTy);
+
+	llvm::Value* future = g_Builder->CreateLoad(i8PtrTy, site.future, "future");
+	llvm::Value* target = site.target ? site.target : llvm::ConstantPointerNull::get(llvm::cast<llvm::PointerType>(doublePtrTy));
+	g_Builder->CreateCall(syncFunc, { future, target });
+	g_Builder->CreateStore(llvm::ConstantPointerNull::get(llvm::cast<llvm::PointerType>(i8PtrTy)), site.future);
+}
+
+static void emitSync() {
+	for (const auto& site : SpawnSites)
+		emitSync(site);
+}
  
 // Numbers
 llvm::Value* NumberExprAST::codegen() {
-	return llvm::ConstantFP::get(Context, llvm::APFloat(val));
+	return llvm::ConstantFP::get(*g_Context, llvm::APFloat(val));
 }
 
 // Strings
@@ -15,84 +146,718 @@ llvm::Value* StringExprAST::codegen() {
 	if (str.empty())
 		throw std::runtime_error("String is empty");
 
-	return Builder.CreateGlobalStringPtr(str, "string");
+	return g_Builder->CreateGlobalStringPtr(str, "string");
 }
 
 // Variables
 llvm::Value* VariableExprAST::codegen() {
-	llvm::Value* V = NamedValues[name];
-	if (!V)
-		throw std::runtime_error("[VariableExprAST] Unknown variable name: " + name);
+	emitLocation(this);
+	return readVariable(name);
+}
+
+// Lanes of a vecN value, 0 for numbers
+static unsigned vectorWidth(llvm::Value* value) {
+	auto* vecTy = llvm::dyn_cast<llvm::FixedVectorType>(value->getType());
+	return vecTy ? vecTy->getNumElements() : 0;
+}
+
+// Number operand of a vector node, comparisons count as 1.0 / 0.0
+static llvm::Value* laneValue(llvm::Value* value, const std::string& node) {
+	if (value->getType()->isIntegerTy(1))
+		return g_Builder->CreateUIToFP(value, llvm::Type::getDoubleTy(*g_Context));
+	if (!value->getType()->isDoubleTy())
+		throw std::runtime_error("[" + node + "] Expected a number");
+	return value;
+}
 
-	if (V->getType()->isPointerTy())
-		return Builder.CreateLoad(llvm::Type::getDoubleTy(Context), V, name);
+// vec4 * 2 -> the number goes to every lane
+static void matchLanes(llvm::Value*& L, llvm::Value*& R) {
+	const unsigned l = vectorWidth(L), r = vectorWidth(R);
+	if (l && r) {
+		if (l != r)
+			throw std::runtime_error("[BinaryExprAST] Vectors of different widths: vec" + std::to_string(l) + ", vec" + std::to_string(r));
+		return;
+	}
+	if (l)
+		R = g_Builder->CreateVectorSplat(l, laneValue(R, "BinaryExprAST"));
 	else
-		return V;
+		L = g_Builder->CreateVectorSplat(r, laneValue(L, "BinaryExprAST"));
 }
 
 // Binary Operands
-llvm::Value* BinaryExprAST::codegen() {
-	llvm::Value* L = lhs->codegen();
-	llvm::Value* R = rhs->codegen();
-
-	if (!L || !R)
-		throw std::runtime_error("[BinaryExprAST] LHS or RHS create is failed!");
+static llvm::Value* binaryOp(const std::string& op, llvm::Value* L, llvm::Value* R) {
+	const bool vector = vectorWidth(L) || vectorWidth(R);
+	if (vector)
+		matchLanes(L, R);
 
 	if (op == "+")
-		return Builder.CreateFAdd(L, R, "addtmp");
+		return g_Builder->CreateFAdd(L, R, "addtmp");
 	if (op == "-")
-		return Builder.CreateFSub(L, R, "subtmp");
+		return g_Builder->CreateFSub(L, R, "subtmp");
 	if (op == "*")
-		return Builder.CreateFMul(L, R, "multmp");
+		return g_Builder->CreateFMul(L, R, "multmp");
 	if (op == "/")
-		return Builder.CreateFDiv(L, R, "divtmp");
+		return g_Builder->CreateFDiv(L, R, "divtmp");
 
+	llvm::Value* cmp = nullptr;
 	if (op == "==")
-		return Builder.CreateFCmpOEQ(L, R, "equal");
-	if (op == "!=")
-		return Builder.CreateFCmpONE(L, R, "notEqual");
-	if (op == "<")
-		return Builder.CreateFCmpOLT(L, R, "less");
-	if (op == ">")
-		return Builder.CreateFCmpOGT(L, R, "greater");
-	if (op == "<=")
-		return Builder.CreateFCmpOLE(L, R, "lessOrEqual");
-	if (op == ">=")
-		return Builder.CreateFCmpOGE(L, R, "greaterOrEqual");
+		cmp = g_Builder->CreateFCmpOEQ(L, R, "equal");
+	else if (op == "!=")
+		cmp = g_Builder->CreateFCmpONE(L, R, "notEqual");
+	else if (op == "<")
+		cmp = g_Builder->CreateFCmpOLT(L, R, "less");
+	else if (op == ">")
+		cmp = g_Builder->CreateFCmpOGT(L, R, "greater");
+	else if (op == "<=")
+		cmp = g_Builder->CreateFCmpOLE(L, R, "lessOrEqual");
+	else if (op == ">=")
+		cmp = g_Builder->CreateFCmpOGE(L, R, "greaterOrEqual");
+	else
+		throw std::runtime_error("[BinaryExprAST] Invalid binary operator: " + op);
+
+	// lanes of a vector comparison are 1.0 or 0.0
+	return vector ? g_Builder->CreateUIToFP(cmp, L->getType(), "mask") : cmp;
+}
+
+static bool isLogical(const std::string& op) {
+	return op == "&&" || op == "||";
+}
+
+// Condition -> i1, a number is true when it isn't 0.0 (NaN is false)
+static llvm::Value* toBool(llvm::Value* value, const std::string& node) {
+	if (value->getType()->isIntegerTy(1))
+		return value;
+	if (!value->getType()->isDoubleTy())
+		throw std::runtime_error("[" + node + "] Expected a number");
+	return g_Builder->CreateFCmpONE(value, llvm::ConstantFP::get(*g_Context, llvm::APFloat(0.0)), "tobool");
+}
+
+// No side effects and a few instructions -> computed on both paths, so
+// and/or/select replace a branch that data dependent conditions mispredict
+static bool isCheap(ExprAST* expr) {
+	int budget = 8;
+	std::vector<ExprAST*> work{ expr };
+	while (!work.empty()) {
+		ExprAST* node = work.back();
+		work.pop_back();
 
-	throw std::runtime_error("[BinaryExprAST] Invalid binary operator: " + op);
+		if (--budget < 0)
+			return false;
+		if (!dynamic_cast<NumberExprAST*>(node) && !dynamic_cast<VariableExprAST*>(node) &&
+			!dynamic_cast<BinaryExprAST*>(node) && !dynamic_cast<NotExprAST*>(node) &&
+			!dynamic_cast<BlockExprAST*>(node) && !dynamic_cast<ifExprAST*>(node))
+			return false;
+
+		node->children(work);
+	}
+	return true;
+}
+
+llvm::Value* BinaryExprAST::codegen() {
+	// && / || with a branch around the rhs -> block where the lhs decided, merge block
+	struct ShortCircuit {
+		llvm::BasicBlock* decided;
+		llvm::BasicBlock* merge;
+	};
+	std::vector<ShortCircuit> pending;
+
+	llvm::Value* result = nullptr;
+	walk(result,
+		[](ExprPtr& operand, llvm::Value*& value) {
+			value = operand->codegen();
+			return true;
+		},
+		[&pending](BinaryExprAST& node, llvm::Value*& L) {
+			if (!isLogical(node.op) || isCheap(node.rhs.get()))
+				return true;
+			if (!L)
+				throw std::runtime_error("[BinaryExprAST] LHS or RHS create is failed!");
+
+			emitLocation(&node);
+			L = toBool(L, "BinaryExprAST");
+
+			llvm::Function* func = g_Builder->GetInsertBlock()->getParent();
+			llvm::BasicBlock* rhsBlock   = llvm::BasicBlock::Create(*g_Context, node.op == "&&" ? "and_rhs" : "or_rhs", func);
+			llvm::BasicBlock* mergeBlock = llvm::BasicBlock::Create(*g_Context, "logic_merge");
+			if (node.op == "&&")
+				g_Builder->CreateCondBr(L, rhsBlock, mergeBlock);
+			else
+				g_Builder->CreateCondBr(L, mergeBlock, rhsBlock);
+
+			pending.push_back({ g_Builder->GetInsertBlock(), mergeBlock });
+			SSA.sealBlock(rhsBlock);
+			g_Builder->SetInsertPoint(rhsBlock);
+			return true;
+		},
+		[&pending](BinaryExprAST& node, llvm::Value* L, llvm::Value* R, llvm::Value*& value) {
+			if (!L || !R)
+				throw std::runtime_error("[BinaryExprAST] LHS or RHS create is failed!");
+
+			emitLocation(&node);
+			if (!isLogical(node.op)) {
+				value = binaryOp(node.op, L, R);
+				return true;
+			}
+
+			R = toBool(R, "BinaryExprAST");
+			if (isCheap(node.rhs.get())) {
+				L = toBool(L, "BinaryExprAST");
+				value = node.op == "&&" ? g_Builder->CreateAnd(L, R, "and") : g_Builder->CreateOr(L, R, "or");
+				return true;
+			}
+
+			const ShortCircuit branch = pending.back();
+			pending.pop_back();
+			g_Builder->CreateBr(branch.merge);
+			llvm::BasicBlock* rhsEnd = g_Builder->GetInsertBlock();
+
+			rhsEnd->getParent()->getBasicBlockList().push_back(branch.merge);
+			SSA.sealBlock(branch.merge);
+			g_Builder->SetInsertPoint(branch.merge);
+
+			llvm::PHINode* phi = g_Builder->CreatePHI(g_Builder->getInt1Ty(), 2, "logic");
+			phi->addIncoming(g_Builder->getInt1(node.op == "||"), branch.decided);
+			phi->addIncoming(R, rhsEnd);
+			value = phi;
+			return true;
+		});
+	return result;
+}
+
+BinaryExprAST::~BinaryExprAST() {
+	std::vector<ExprPtr> pending;
+	pending.push_back(std::move(lhs));
+	pending.push_back(std::move(rhs));
+
+	while (!pending.empty()) {
+		ExprPtr node = std::move(pending.back());
+		pending.pop_back();
+
+		// destroyed at the end of the iteration, without operators below it
+		if (auto* bin = dynamic_cast<BinaryExprAST*>(node.get())) {
+			pending.push_back(std::move(bin->lhs));
+			pending.push_back(std::move(bin->rhs));
+		}
+	}
+}
+
+// !x
+llvm::Value* NotExprAST::codegen() {
+	llvm::Value* value = operand->codegen();
+	if (!value)
+		return nullptr;
+
+	emitLocation(this);
+	return g_Builder->CreateNot(toBool(value, "NotExprAST"), "not");
 }
 
 // Func prototype -> fn test(a,b)
+static llvm::Type* nativeType(NativeType type) {
+	switch (type) {
+	case NativeType::F32:  return llvm::Type::getFloatTy(*g_Context);
+	case NativeType::I64:  return llvm::Type::getInt64Ty(*g_Context);
+	case NativeType::I32:  return llvm::Type::getInt32Ty(*g_Context);
+	case NativeType::Void: return llvm::Type::getVoidTy(*g_Context);
+	default:               return llvm::Type::getDoubleTy(*g_Context);
+	}
+}
+
 llvm::Function* PrototypeAST::codegen() {
-	std::vector<llvm::Type*> doubles(Args.size(), llvm::Type::getDoubleTy(Context));
-	llvm::FunctionType* FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(Context), doubles, false);
-	llvm::Function* F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, name, g_Module.get());
+	// generators return their coroutine handle, declarations of other
+	// modules know them from the purity table
+	auto purity = g_Purity ? g_Purity->find(name) : PurityTable::const_iterator();
+	const bool known = g_Purity && purity != g_Purity->end();
+	const bool gen = generator || (known && purity->second.generator);
+
+	// extern fn -> the C signature, calls convert (CallExprAST)
+	llvm::FunctionType* FT = nullptr;
+	if (native) {
+		std::vector<llvm::Type*> params;
+		for (NativeType type : native->params)
+			params.push_back(nativeType(type));
+		FT = llvm::FunctionType::get(nativeType(native->result), params, false);
+	}
+	else {
+		std::vector<llvm::Type*> doubles(Args.size(), llvm::Type::getDoubleTy(*g_Context));
+		llvm::Type* retTy = gen ? llvm::Type::getInt8PtrTy(*g_Context) : llvm::Type::getDoubleTy(*g_Context);
+		FT = llvm::FunctionType::get(retTy, doubles, false);
+	}
+
+	// reuse an earlier declaration -> fn test(a,b);
+	llvm::Function* F = g_Module->getFunction(name);
+	if (F) {
+		if (F->arg_size() != Args.size())
+			throw std::runtime_error("[PrototypeAST] Conflicting argument count for function: " + name);
+		if (F->getFunctionType() != FT) {
+			if (gen || F->getReturnType()->isPointerTy())
+				throw std::runtime_error("[PrototypeAST] " + name + " is used both as a generator and as a function");
+			throw std::runtime_error("[PrototypeAST] Conflicting C types for extern function: " + name);
+		}
+	}
+	else
+		F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, name, g_Module.get());
 
 	uint64_t idx = 0;
 	for (auto& a : F->args())
 		a.setName(Args[idx++]);
 
+	// pure -> calls can be CSE'd, hoisted out of loops and dropped when unused
+	const bool pure = (known && purity->second.pure) || (native && native->pure);
+	if (pure) {
+		F->addFnAttr(llvm::Attribute::ReadNone);
+		F->addFnAttr(llvm::Attribute::NoUnwind);
+		F->addFnAttr(llvm::Attribute::NoSync);
+		if ((known && purity->second.willReturn) || native)
+			F->addFnAttr(llvm::Attribute::WillReturn);
+	}
+	if (native && native->nounwind)
+		F->addFnAttr(llvm::Attribute::NoUnwind);
+
 	return F;
 }
 
+// Direct call with dalg's doubles, converted to and from the C types of an extern fn
+static llvm::Value* createCall(llvm::IRBuilder<>& builder, llvm::Function* callee, std::vector<llvm::Value*> args) {
+	llvm::FunctionType* FT = callee->getFunctionType();
+	for (unsigned i = 0; i < args.size(); i++) {
+		llvm::Type* param = FT->getParamType(i);
+		if (param->isFloatTy())
+			args[i] = builder.CreateFPTrunc(args[i], param);
+		else if (param->isIntegerTy())
+			args[i] = builder.CreateFPToSI(args[i], param);
+	}
+
+	llvm::Type* doubleTy = llvm::Type::getDoubleTy(builder.getContext());
+	llvm::Type* retTy = FT->getReturnType();
+	if (retTy->isVoidTy()) {
+		builder.CreateCall(callee, args);
+		return llvm::ConstantFP::get(doubleTy, 0.0);
+	}
+
+	llvm::Value* result = builder.CreateCall(callee, args, "calltmp");
+	if (retTy->isFloatTy())
+		return builder.CreateFPExt(result, doubleTy);
+	if (retTy->isIntegerTy())
+		return builder.CreateSIToFP(result, doubleTy);
+	return result;
+}
+
 // Function Call
 llvm::Value* CallExprAST::codegen() {
-	llvm::Function* CalleeFunc = g_Module->getFunction(Callee);
+	llvm::Function* CalleeFunc = getFunction(Callee);
 	if (!CalleeFunc)
 		throw std::runtime_error("[CallExprAST] Unknown function referenced: " + Callee);
 
 	if (CalleeFunc->arg_size() != Args.size())
 		throw std::runtime_error("[CallExprAST] Incorrect number of arguments passed to function: " + Callee);
+	if (CalleeFunc->getReturnType()->isPointerTy())
+		throw std::runtime_error("[CallExprAST] " + Callee + " is a generator, loop over it: for x in " + Callee + "(...)");
 
 	std::vector<llvm::Value*> ArgsV;
 	for (size_t i = 0, e = Args.size(); i != e; i++) {
 		ArgsV.push_back(Args[i]->codegen());
 		if (!ArgsV.back())
 			return nullptr;
+		if (vectorWidth(ArgsV.back()))
+			throw std::runtime_error("[CallExprAST] Vectors can't be passed to functions: " + Callee);
+	}
+
+	emitLocation(this);
+	return createCall(*g_Builder, CalleeFunc, ArgsV);
+}
+
+// @batch fn v(a, b) -> void v_batch(double* a, double* b, double* out, i64 n)
+// out[i] = v(a[i], b[i]) over columns, the call is always inlined so O3 can
+// vectorize the loop. out must not overlap the inputs.
+static llvm::Function* emitBatchWrapper(llvm::Function* func) {
+	const std::string name = func->getName().str() + "_batch";
+	if (g_Module->getFunction(name))
+		throw std::runtime_error("[FunctionAST] Batch wrapper name is already used: " + name);
+
+	llvm::Type* doubleTy    = llvm::Type::getDoubleTy(*g_Context);
+	llvm::Type* doublePtrTy = llvm::Type::getDoublePtrTy(*g_Context);
+	llvm::Type* i64Ty       = llvm::Type::getInt64Ty(*g_Context);
+
+	std::vector<llvm::Type*> params(func->arg_size() + 1, doublePtrTy);
+	params.push_back(i64Ty);
+	llvm::FunctionType* batchTy = llvm::FunctionType::get(llvm::Type::getVoidTy(*g_Context), params, false);
+	llvm::Function* batch = llvm::Function::Create(batchTy, llvm::Function::ExternalLinkage, name, g_Module.get());
+
+	const unsigned outIdx = func->arg_size();
+	for (unsigned i = 0; i < outIdx; i++) {
+		batch->getArg(i)->setName(func->getArg(i)->getName());
+		batch->addParamAttr(i, llvm::Attribute::ReadOnly);
+		batch->addParamAttr(i, llvm::Attribute::NoCapture);
+	}
+	batch->getArg(outIdx)->setName("out");
+	batch->addParamAttr(outIdx, llvm::Attribute::NoAlias);
+	batch->addParamAttr(outIdx, llvm::Attribute::NoCapture);
+	llvm::Value* n = batch->getArg(outIdx + 1);
+	n->setName("n");
+
+	llvm::BasicBlock* entryBlock = llvm::BasicBlock::Create(*g_Context, "entry", batch);
+	llvm::BasicBlock* loopBlock  = llvm::BasicBlock::Create(*g_Context, "loop", batch);
+	llvm::BasicBlock* afterBlock = llvm::BasicBlock::Create(*g_Context, "afterLoop", batch);
+
+	llvm::IRBuilder<> builder(entryBlock);
+	llvm::Value* zero = llvm::ConstantInt::get(i64Ty, 0);
+	builder.CreateCondBr(builder.CreateICmpSGT(n, zero), loopBlock, afterBlock);
+
+	builder.SetInsertPoint(loopBlock);
+	llvm::PHINode* i = builder.CreatePHI(i64Ty, 2, "i");
+	i->addIncoming(zero, entryBlock);
+
+	std::vector<llvm::Value*> args;
+	for (unsigned k = 0; k < outIdx; k++)
+		args.push_back(builder.CreateLoad(doubleTy, builder.CreateInBoundsGEP(doubleTy, batch->getArg(k), i)));
+
+	llvm::CallInst* call = builder.CreateCall(func, args, "row");
+	call->addFnAttr(llvm::Attribute::AlwaysInline);
+	builder.CreateStore(call, builder.CreateInBoundsGEP(doubleTy, batch->getArg(outIdx), i));
+
+	llvm::Value* next = builder.CreateAdd(i, llvm::ConstantInt::get(i64Ty, 1), "nextI");
+	i->addIncoming(next, loopBlock);
+	llvm::BranchInst* latch = builder.CreateCondBr(builder.CreateICmpSLT(next, n), loopBlock, afterBlock);
+
+	// llvm.loop.vectorize.enable
+	llvm::MDNode* vectorize = llvm::MDNode::get(*g_Context, {
+		llvm::MDString::get(*g_Context, "llvm.loop.vectorize.enable"),
+		llvm::ConstantAsMetadata::get(llvm::ConstantInt::getTrue(*g_Context)) });
+	llvm::MDNode* loopID = llvm::MDNode::getDistinct(*g_Context, { nullptr, vectorize });
+	loopID->replaceOperandWith(0, loopID);
+	latch->setMetadata(llvm::LLVMContext::MD_loop, loopID);
+
+	builder.SetInsertPoint(afterBlock);
+	builder.CreateRetVoid();
+
+	llvm::verifyFunction(*batch);
+	return batch;
+}
+
+EffectSummary FunctionAST::summarize() const {
+	EffectSummary summary;
+	if (!body)
+		return summary;   // pure extern fn
+
+	// the table and its lock are global state, so are the profile counters
+	// and the frame of a generator
+	summary.effects = hasAnnotation("memo") || g_Options.instrument || proto->isGenerator();
+	summary.generator = proto->isGenerator();
+	summary.memo = hasAnnotation("memo");
+
+	std::vector<ExprAST*> work{ body.get() };
+	while (!work.empty()) {
+		ExprAST* node = work.back();
+		work.pop_back();
+
+		if (dynamic_cast<PrintExprAST*>(node))
+			summary.effects = summary.prints = true;
+		else if (auto* spawn = dynamic_cast<SpawnExprAST*>(node)) {
+			summary.effects = true;
+			summary.callees.insert(spawn->getCallee());
+		}
+		else if (dynamic_cast<SyncExprAST*>(node) || dynamic_cast<ParForExprAST*>(node))
+			summary.effects = true;
+		else if (dynamic_cast<forExprAST*>(node))
+			summary.loops = true;
+		else if (auto* call = dynamic_cast<CallExprAST*>(node))
+			summary.callees.insert(call->getCallee());
+		else if (auto* loop = dynamic_cast<ForInExprAST*>(node)) {
+			summary.loops = true;
+			summary.callees.insert(loop->getGenerator());
+		}
+
+		node->children(work);
 	}
+	return summary;
+}
+
+// Spin lock on an i32, the table is shared by every thread
+static void emitLock(llvm::IRBuilder<>& builder, llvm::GlobalVariable* lock) {
+	llvm::Function* func = builder.GetInsertBlock()->getParent();
+	llvm::BasicBlock* spinBlock   = llvm::BasicBlock::Create(*g_Context, "memo_spin", func);
+	llvm::BasicBlock* lockedBlock = llvm::BasicBlock::Create(*g_Context, "memo_locked", func);
+
+	builder.CreateBr(spinBlock);
+	builder.SetInsertPoint(spinBlock);
+	llvm::Value* old = builder.CreateAtomicRMW(llvm::AtomicRMWInst::Xchg, lock, builder.getInt32(1),
+		llvm::MaybeAlign(4), llvm::AtomicOrdering::Acquire);
+	builder.CreateCondBr(builder.CreateICmpEQ(old, builder.getInt32(0)), lockedBlock, spinBlock);
+	builder.SetInsertPoint(lockedBlock);
+}
+
+static void emitUnlock(llvm::IRBuilder<>& builder, llvm::GlobalVariable* lock) {
+	llvm::StoreInst* store = builder.CreateAlignedStore(builder.getInt32(0), lock, llvm::MaybeAlign(4));
+	store->setAtomic(llvm::AtomicOrdering::Release);
+}
+
+// @memo(capacity, overwrite|keep) fn f(a, b) -> f looks { bits(a), bits(b) } up in
+// an open-addressing table (4 probes) and only calls the real body, f.memo, on a miss.
+// "overwrite" replaces the home slot when every probed slot is taken, "keep" never evicts.
+static void emitMemoWrapper(llvm::Function* func, llvm::Function* impl, const Annotation& memo) {
+	const uint64_t capacity = memo.args.empty() ? 1024 : static_cast<uint64_t>(std::stod(memo.args[0]));
+	const bool keep = memo.args.size() == 2 && memo.args[1] == "keep";
+	const unsigned nargs  = func->arg_size();
+	const unsigned probes = static_cast<unsigned>(std::min<uint64_t>(4, capacity));
+	const std::string name = func->getName().str();
+
+	llvm::Type* doubleTy = llvm::Type::getDoubleTy(*g_Context);
+	llvm::Type* i64Ty    = llvm::Type::getInt64Ty(*g_Context);
+	llvm::Type* i32Ty    = llvm::Type::getInt32Ty(*g_Context);
+
+	// entry -> { i64 keys[nargs], double value, i64 full }
+	llvm::StructType* entryTy = llvm::StructType::get(*g_Context, { llvm::ArrayType::get(i64Ty, nargs), doubleTy, i64Ty });
+	llvm::ArrayType* tableTy  = llvm::ArrayType::get(entryTy, capacity);
+	auto* table = new llvm::GlobalVariable(*g_Module, tableTy, false, llvm::GlobalValue::InternalLinkage,
+		llvm::ConstantAggregateZero::get(tableTy), name + ".memo_table");
+	auto* lock = new llvm::GlobalVariable(*g_Module, i32Ty, false, llvm::GlobalValue::InternalLinkage,
+		llvm::ConstantInt::get(i32Ty, 0), name + ".memo_lock");
+
+	// { hits, misses }
+	llvm::ArrayType* statsTy = llvm::ArrayType::get(i64Ty, 2);
+	llvm::GlobalVariable* stats = nullptr;
+	if (g_Options.instrument)
+		stats = new llvm::GlobalVariable(*g_Module, statsTy, false, llvm::GlobalValue::InternalLinkage,
+			llvm::ConstantAggregateZero::get(statsTy), name + ".memo_stats");
+
+	llvm::IRBuilder<> builder(llvm::BasicBlock::Create(*g_Context, "entry", func));
+
+	std::vector<llvm::Value*> args, keys;
+	for (auto& arg : func->args()) {
+		args.push_back(&arg);
+		keys.push_back(builder.CreateBitCast(&arg, i64Ty, arg.getName() + ".bits"));
+	}
+
+	// murmur3 fmix64 per key, doubles differ mostly in their high bits
+	llvm::Value* hash = builder.getInt64(0x9E3779B97F4A7C15ULL);
+	for (llvm::Value* key : keys) {
+		hash = builder.CreateXor(hash, key);
+		hash = builder.CreateXor(hash, builder.CreateLShr(hash, 33));
+		hash = builder.CreateMul(hash, builder.getInt64(0xFF51AFD7ED558CCDULL));
+		hash = builder.CreateXor(hash, builder.CreateLShr(hash, 33));
+		hash = builder.CreateMul(hash, builder.getInt64(0xC4CEB9FE1A85EC53ULL));
+		hash = builder.CreateXor(hash, builder.CreateLShr(hash, 33));
+	}
+	llvm::Value* mask = builder.getInt64(capacity - 1);
+	llvm::Value* home = builder.CreateAnd(hash, mask, "home");
+
+	auto entryField = [&](llvm::Value* slot, unsigned field) {
+		return builder.CreateInBoundsGEP(tableTy, table, { builder.getInt64(0), slot, builder.getInt32(field) });
+	};
+
+	emitLock(builder, lock);
+
+	llvm::BasicBlock* hitBlock  = llvm::BasicBlock::Create(*g_Context, "memo_hit", func);
+	llvm::BasicBlock* missBlock = llvm::BasicBlock::Create(*g_Context, "memo_miss", func);
+
+	llvm::IRBuilder<> hitBuilder(hitBlock), missBuilder(missBlock);
+	llvm::PHINode* hitValue = hitBuilder.CreatePHI(doubleTy, probes, "memo_value");
+
+	// slot of the window that is empty or already holds the keys
+	auto slotFor = [&](llvm::IRBuilder<>& b, unsigned p, llvm::Value** isFree, llvm::Value** isSame) {
+		llvm::Value* slot = b.CreateAnd(b.CreateAdd(home, b.getInt64(p)), mask, "slot");
+		llvm::Value* full = b.CreateLoad(i64Ty, b.CreateInBoundsGEP(tableTy, table, { b.getInt64(0), slot, b.getInt32(2) }));
+		llvm::Value* same = b.getTrue();
+		for (unsigned k = 0; k < nargs; k++) {
+			llvm::Value* keyPtr = b.CreateInBoundsGEP(tableTy, table, { b.getInt64(0), slot, b.getInt32(0), b.getInt64(k) });
+			same = b.CreateAnd(same, b.CreateICmpEQ(b.CreateLoad(i64Ty, keyPtr), keys[k]));
+		}
+		*isFree = b.CreateICmpEQ(full, b.getInt64(0));
+		*isSame = b.CreateAnd(b.CreateNot(*isFree), same);
+		return slot;
+	};
+
+	for (unsigned p = 0; p < probes; p++) {
+		llvm::Value *isFree, *isSame;
+		llvm::Value* slot = slotFor(builder, p, &isFree, &isSame);
+		hitValue->addIncoming(builder.CreateLoad(doubleTy, entryField(slot, 1)), builder.GetInsertBlock());
+
+		llvm::BasicBlock* nextBlock = p + 1 < probes ? llvm::BasicBlock::Create(*g_Context, "memo_probe", func, hitBlock) : missBlock;
+		llvm::BasicBlock* testBlock = llvm::BasicBlock::Create(*g_Context, "memo_test", func, hitBlock);
+		builder.CreateCondBr(isSame, hitBlock, testBlock);
+
+		// an empty slot ends the window, the keys can't be further
+		builder.SetInsertPoint(testBlock);
+		builder.CreateCondBr(isFree, missBlock, nextBlock);
+		builder.SetInsertPoint(nextBlock);
+	}
+
+	auto count = [&](llvm::IRBuilder<>& b, unsigned which) -> llvm::Value* {
+		llvm::Value* counter = b.CreateInBoundsGEP(statsTy, stats, { b.getInt64(0), b.getInt64(which) });
+		return b.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter, b.getInt64(1),
+			llvm::MaybeAlign(8), llvm::AtomicOrdering::Monotonic);
+	};
+
+	// hit -> unlock and return the cached value
+	emitUnlock(hitBuilder, lock);
+	if (stats)
+		count(hitBuilder, 0);
+	hitBuilder.CreateRet(hitValue);
+
+	// miss -> run the body unlocked, then store the result
+	emitUnlock(missBuilder, lock);
+	llvm::Value* result = missBuilder.CreateCall(impl, args, "memo_result");
+
+	if (stats) {
+		llvm::Value* misses = count(missBuilder, 1);
+		llvm::BasicBlock* registerBlock = llvm::BasicBlock::Create(*g_Context, "memo_register", func);
+		llvm::BasicBlock* storeBlock    = llvm::BasicBlock::Create(*g_Context, "memo_store", func);
+		missBuilder.CreateCondBr(missBuilder.CreateICmpEQ(misses, missBuilder.getInt64(0)), registerBlock, storeBlock);
+
+		missBuilder.SetInsertPoint(registerBlock);
+		llvm::FunctionCallee registerFunc = g_Module->getOrInsertFunction("dalg_memo_register",
+			llvm::Type::getVoidTy(*g_Context), llvm::Type::getInt8PtrTy(*g_Context), llvm::Type::getInt64PtrTy(*g_Context));
+		missBuilder.CreateCall(registerFunc, { missBuilder.CreateGlobalStringPtr(name, "memo_name"),
+			missBuilder.CreateConstInBoundsGEP2_64(statsTy, stats, 0, 0) });
+		missBuilder.CreateBr(storeBlock);
+		missBuilder.SetInsertPoint(storeBlock);
+	}
+
+	// the body may have filled the window meanwhile, probe again under the lock
+	emitLock(missBuilder, lock);
+	llvm::Value* target = keep ? missBuilder.getInt64(-1) : home;
+	for (unsigned p = probes; p-- > 0;) {
+		llvm::Value *isFree, *isSame;
+		llvm::Value* slot = slotFor(missBuilder, p, &isFree, &isSame);
+		target = missBuilder.CreateSelect(missBuilder.CreateOr(isFree, isSame), slot, target);
+	}
+
+	llvm::BasicBlock* insertBlock = llvm::BasicBlock::Create(*g_Context, "memo_insert", func);
+	llvm::BasicBlock* doneBlock   = llvm::BasicBlock::Create(*g_Context, "memo_done", func);
+	missBuilder.CreateCondBr(missBuilder.CreateICmpEQ(target, missBuilder.getInt64(-1)), doneBlock, insertBlock);
+
+	missBuilder.SetInsertPoint(insertBlock);
+	for (unsigned k = 0; k < nargs; k++)
+		missBuilder.CreateStore(keys[k], missBuilder.CreateInBoundsGEP(tableTy, table,
+			{ missBuilder.getInt64(0), target, missBuilder.getInt32(0), missBuilder.getInt64(k) }));
+	missBuilder.CreateStore(result, missBuilder.CreateInBoundsGEP(tableTy, table, { missBuilder.getInt64(0), target, missBuilder.getInt32(1) }));
+	missBuilder.CreateStore(missBuilder.getInt64(1), missBuilder.CreateInBoundsGEP(tableTy, table, { missBuilder.getInt64(0), target, missBuilder.getInt32(2) }));
+	missBuilder.CreateBr(doneBlock);
+
+	missBuilder.SetInsertPoint(doneBlock);
+	emitUnlock(missBuilder, lock);
+	missBuilder.CreateRet(result);
+
+	llvm::verifyFunction(*func);
+}
+
+// --instrument -> dalg_prof_enter(&name.prof) after the prologue, dalg_prof_exit() before ret
+static void emitProfileEnter(const std::string& name) {
+	llvm::Type* i8PtrTy = llvm::Type::getInt8PtrTy(*g_Context);
+	llvm::Type* i32Ty   = llvm::Type::getInt32Ty(*g_Context);
+
+	// { const char* name, i32 id = -1 } -> dalg_prof_site
+	llvm::StructType* siteTy = llvm::StructType::get(*g_Context, { i8PtrTy, i32Ty });
+	llvm::Constant* siteInit = llvm::ConstantStruct::get(siteTy,
+		{ g_Builder->CreateGlobalStringPtr(name, name + ".prof_name"), llvm::ConstantInt::get(i32Ty, -1) });
+	auto* site = new llvm::GlobalVariable(*g_Module, siteTy, false, llvm::GlobalValue::InternalLinkage, siteInit, name + ".prof");
+
+	llvm::FunctionCallee enterFunc = g_Module->getOrInsertFunction("dalg_prof_enter",
+		llvm::Type::getVoidTy(*g_Context), siteTy->getPointerTo());
+	g_Builder->CreateCall(enterFunc, { site });
+}
+
+static void emitProfileExit() {
+	llvm::FunctionCallee exitFunc = g_Module->getOrInsertFunction("dalg_prof_exit", llvm::Type::getVoidTy(*g_Context));
+	g_Builder->CreateCall(exitFunc);
+}
+
+// The generator being generated. yield stores into the promise and suspends,
+// every suspension returns the handle through "suspend", "cleanup" frees the
+// frame when the loop destroys it.
+struct GeneratorState {
+	llvm::Function*   function = nullptr;
+	llvm::AllocaInst* promise  = nullptr;   // double, read by the loop
+	llvm::Value*      id       = nullptr;   // token of llvm.coro.id
+	llvm::Value*      handle   = nullptr;
+	llvm::BasicBlock* cleanup  = nullptr;
+	llvm::BasicBlock* suspend  = nullptr;
+};
+thread_local GeneratorState CurrentGenerator;
+
+// Switched-resume coroutine, split by CoroSplit (lowerCoroutines without -O).
+// The frame comes from malloc unless CoroElide puts it on the stack of a
+// loop that the generator was inlined into.
+static void beginGenerator(llvm::Function* func) {
+	llvm::Type* doubleTy = llvm::Type::getDoubleTy(*g_Context);
+	llvm::Type* i8PtrTy  = llvm::Type::getInt8PtrTy(*g_Context);
+	llvm::Type* i64Ty    = llvm::Type::getInt64Ty(*g_Context);
+	llvm::Constant* null = llvm::ConstantPointerNull::get(llvm::cast<llvm::PointerType>(i8PtrTy));
+
+	func->addFnAttr("coroutine.presplit", "0");
+	CurrentGenerator = GeneratorState();
+	CurrentGenerator.function = func;
+	CurrentGenerator.promise  = createEntryAlloca(func, doubleTy, "promise");
+
+	llvm::Function* coroId = llvm::Intrinsic::getDeclaration(g_Module.get(), llvm::Intrinsic::coro_id);
+	CurrentGenerator.id = g_Builder->CreateCall(coroId, { g_Builder->getInt32(8),
+		g_Builder->CreateBitCast(CurrentGenerator.promise, i8PtrTy), null, null }, "id");
+
+	llvm::BasicBlock* entryBlock = g_Builder->GetInsertBlock();
+	llvm::BasicBlock* allocBlock = llvm::BasicBlock::Create(*g_Context, "coro.alloc", func);
+	llvm::BasicBlock* beginBlock = llvm::BasicBlock::Create(*g_Context, "coro.begin", func);
+	llvm::Function* coroAlloc = llvm::Intrinsic::getDeclaration(g_Module.get(), llvm::Intrinsic::coro_alloc);
+	g_Builder->CreateCondBr(g_Builder->CreateCall(coroAlloc, { CurrentGenerator.id }, "need.alloc"), allocBlock, beginBlock);
+
+	g_Builder->SetInsertPoint(allocBlock);
+	llvm::Function* coroSize = llvm::Intrinsic::getDeclaration(g_Module.get(), llvm::Intrinsic::coro_size, { i64Ty });
+	llvm::FunctionCallee mallocFunc = g_Module->getOrInsertFunction("malloc", i8PtrTy, i64Ty);
+	llvm::Value* memory = g_Builder->CreateCall(mallocFunc, { g_Builder->CreateCall(coroSize, {}, "size") }, "frame");
+	g_Builder->CreateBr(beginBlock);
+
+	g_Builder->SetInsertPoint(beginBlock);
+	llvm::PHINode* frame = g_Builder->CreatePHI(i8PtrTy, 2, "frame");
+	frame->addIncoming(null, entryBlock);
+	frame->addIncoming(memory, allocBlock);
+	llvm::Function* coroBegin = llvm::Intrinsic::getDeclaration(g_Module.get(), llvm::Intrinsic::coro_begin);
+	CurrentGenerator.handle = g_Builder->CreateCall(coroBegin, { CurrentGenerator.id, frame }, "handle");
+
+	SSA.sealBlock(allocBlock);
+	SSA.sealBlock(beginBlock);
+	CurrentGenerator.cleanup = llvm::BasicBlock::Create(*g_Context, "coro.cleanup");
+	CurrentGenerator.suspend = llvm::BasicBlock::Create(*g_Context, "coro.suspend");
+}
+
+// Suspends at "yield" (final -> after the body, done() is true from then on)
+static void emitSuspend(bool final) {
+	llvm::Function* coroSuspend = llvm::Intrinsic::getDeclaration(g_Module.get(), llvm::Intrinsic::coro_suspend);
+	llvm::Value* state = g_Builder->CreateCall(coroSuspend,
+		{ llvm::ConstantTokenNone::get(*g_Context), g_Builder->getInt1(final) }, "state");
+
+	// 0 -> resumed, 1 -> destroyed, anything else -> suspended
+	llvm::BasicBlock* resumeBlock = llvm::BasicBlock::Create(*g_Context, final ? "coro.final" : "yield.resume", CurrentGenerator.function);
+	llvm::SwitchInst* next = g_Builder->CreateSwitch(state, CurrentGenerator.suspend, 2);
+	next->addCase(g_Builder->getInt8(0), resumeBlock);
+	next->addCase(g_Builder->getInt8(1), CurrentGenerator.cleanup);
 
-	return Builder.CreateCall(CalleeFunc, ArgsV, "calltmp");
+	SSA.sealBlock(resumeBlock);
+	g_Builder->SetInsertPoint(resumeBlock);
+}
+
+static void endGenerator() {
+	llvm::Type* i8PtrTy = llvm::Type::getInt8PtrTy(*g_Context);
+	llvm::Function* func = CurrentGenerator.function;
+
+	// a finished generator is never resumed
+	emitSuspend(true);
+	g_Builder->CreateUnreachable();
+
+	CurrentGenerator.cleanup->insertInto(func);
+	g_Builder->SetInsertPoint(CurrentGenerator.cleanup);
+	llvm::Function* coroFree = llvm::Intrinsic::getDeclaration(g_Module.get(), llvm::Intrinsic::coro_free);
+	llvm::FunctionCallee freeFunc = g_Module->getOrInsertFunction("free", llvm::Type::getVoidTy(*g_Context), i8PtrTy);
+	g_Builder->CreateCall(freeFunc, { g_Builder->CreateCall(coroFree, { CurrentGenerator.id, CurrentGenerator.handle }, "memory") });
+	g_Builder->CreateBr(CurrentGenerator.suspend);
+
+	CurrentGenerator.suspend->insertInto(func);
+	g_Builder->SetInsertPoint(CurrentGenerator.suspend);
+	llvm::Function* coroEnd = llvm::Intrinsic::getDeclaration(g_Module.get(), llvm::Intrinsic::coro_end);
+	g_Builder->CreateCall(coroEnd, { CurrentGenerator.handle, g_Builder->getFalse() });
+	g_Builder->CreateRet(CurrentGenerator.handle);
+
+	SSA.sealBlock(CurrentGenerator.cleanup);
+	SSA.sealBlock(CurrentGenerator.suspend);
+	CurrentGenerator = GeneratorState();
 }
 
 // Functions
@@ -101,23 +866,89 @@ llvm::Function* FunctionAST::codegen() {
 	if (!func)
 		return nullptr;
 
-	llvm::BasicBlock* bb = llvm::BasicBlock::Create(Context, "entry", func);
-	Builder.SetInsertPoint(bb);
+	// declaration only, body lives in another file
+	if (!body)
+		return func;
 
-	NamedValues.clear();
+	if (!func->empty())
+		throw std::runtime_error("[FunctionAST] Redefinition of function: " + proto->getName());
 
-	for (auto& arg : func->args()) {
-		llvm::AllocaInst* alloca = Builder.CreateAlloca(arg.getType(), nullptr, arg.getName());
-		Builder.CreateStore(&arg, alloca);
-		NamedValues[std::string(arg.getName())] = alloca;
+	const bool generator = proto->isGenerator();
+	if (generator && proto->getName() == "main")
+		throw std::runtime_error("[FunctionAST] main can't yield, it is called once and returns a number");
+	if (generator && !annotations.empty())
+		throw std::runtime_error("[FunctionAST] Generators take no annotations: " + proto->getName());
+	if (generator && !spawnTargets(body.get()).empty())
+		throw std::runtime_error("[FunctionAST] Generators can't spawn: " + proto->getName());
+
+	const Annotation* memo = getAnnotation("memo");
+
+	// @memo -> the body goes to "name.memo", "name" becomes the cache lookup
+	llvm::Function* impl = func;
+	if (memo) {
+		impl = llvm::Function::Create(func->getFunctionType(), llvm::Function::InternalLinkage, proto->getName() + ".memo", g_Module.get());
+		auto arg = func->arg_begin();
+		for (auto& implArg : impl->args())
+			implArg.setName((arg++)->getName());
 	}
 
+	llvm::BasicBlock* bb = llvm::BasicBlock::Create(*g_Context, "entry", impl);
+	g_Builder->SetInsertPoint(bb);
+	beginDebugFunction(impl, getLocation());
+
+	NamedValues.clear();
+	SpawnSites.clear();
+	SSA.clear();
+	SSA.sealBlock(bb);
+	MemoryVariables = spawnTargets(body.get());
+
+	if (generator)
+		beginGenerator(impl);
+
+	unsigned argNo = 0;
+	for (auto& arg : impl->args())
+		assignVariable(arg.getName().str(), &arg, proto->getLocation(), ++argNo);
+
+	// a generator returns at every suspension, the counters would never balance
+	const bool instrument = g_Options.instrument && !generator;
+	if (instrument)
+		emitProfileEnter(proto->getName());
+
+	emitLocation(body.get());
 	if (llvm::Value* retVal = body->codegen()) {
-		Builder.CreateRet(retVal);
-		llvm::verifyFunction(*func);
+		if (generator)
+			endGenerator();
+		else {
+			if (vectorWidth(retVal))
+				throw std::runtime_error("[FunctionAST] Function returns a vector, reduce it to a number (hsum, lane): " + proto->getName());
+
+			emitSync(); // implicit sync before returning
+			if (instrument)
+				emitProfileExit();
+			g_Builder->CreateRet(retVal);
+		}
+		endDebugFunction();
+		llvm::verifyFunction(*impl);
+
+		if (memo)
+			emitMemoWrapper(func, impl, *memo);
+
+		llvm::Function* batch = hasAnnotation("batch") ? emitBatchWrapper(func) : nullptr;
+
+		// cloned per ISA level when the module gets its target (multiversion.h)
+		if (hasAnnotation("multiversion")) {
+			impl->addFnAttr(multiversionAttribute);
+			if (batch)
+				batch->addFnAttr(multiversionAttribute);
+		}
+
 		return func;
 	}
 
+	endDebugFunction();
+	CurrentGenerator = GeneratorState();
+	if (impl != func)
+		impl->eraseFromParent();
 	func->eraseFromParent();
 	return nullptr;
 }
@@ -128,15 +959,8 @@ llvm::Value* AssignmentExprAST::codegen() {
 	if (!value)
 		std::cerr << "[AssignmentExprAST] RHS not created.\n";
 
-	llvm::Value* var = NamedValues[name];
-	if (!var) {
-		llvm::AllocaInst* alloca = Builder.CreateAlloca(llvm::Type::getDoubleTy(Context), nullptr, name);
-		Builder.CreateStore(value, alloca);
-		NamedValues[name] = alloca;
-	}
-	else
-		Builder.CreateStore(value, var);
-
+	emitLocation(this);
+	assignVariable(name, value, getLocation());
 	return value;
 }
 
@@ -160,25 +984,59 @@ llvm::Value* PrintExprAST::codegen() {
 	llvm::Function* PrintfFunc = g_Module->getFunction("printf");
 	if (!PrintfFunc) {
 		llvm::FunctionType* printfType = llvm::FunctionType::get(
-			llvm::Type::getInt32Ty(Context),
-			llvm::Type::getInt8PtrTy(Context),
+			llvm::Type::getInt32Ty(*g_Context),
+			llvm::Type::getInt8PtrTy(*g_Context),
 			true
 		);
 
 		PrintfFunc = llvm::Function::Create(printfType, llvm::Function::ExternalLinkage, "printf", g_Module.get());
 	}
 
+	// vecN -> its lanes on one line
+	if (const unsigned lanes = vectorWidth(val)) {
+		std::string format;
+		std::vector<llvm::Value*> args{ nullptr };
+		for (unsigned i = 0; i < lanes; i++) {
+			format += i ? " %f" : "%f";
+			args.push_back(g_Builder->CreateExtractElement(val, i));
+		}
+		args[0] = g_Builder->CreateGlobalStringPtr(format + "\n", "str");
+
+		emitLocation(this);
+		g_Builder->CreateCall(PrintfFunc, args, "printfCall");
+		return llvm::ConstantFP::get(*g_Context, llvm::APFloat(0.0));
+	}
+
 	llvm::Value* formatSTR = nullptr;
 	if (val->getType()->isPointerTy())
-		formatSTR = Builder.CreateGlobalStringPtr("%s\n", "str");
+		formatSTR = g_Builder->CreateGlobalStringPtr("%s\n", "str");
 	else if (val->getType()->isDoubleTy())
-		formatSTR = Builder.CreateGlobalStringPtr("%f\n", "str");
+		formatSTR = g_Builder->CreateGlobalStringPtr("%f\n", "str");
 	else
 		std::cerr << "Unsupported type for printf";
 
-	Builder.CreateCall(PrintfFunc, { formatSTR, val }, "printfCall");
+	emitLocation(this);
+	g_Builder->CreateCall(PrintfFunc, { formatSTR, val }, "printfCall");
+
+	return llvm::ConstantFP::get(*g_Context, llvm::APFloat(0.0));
+}
+
+// if c { a } else { b } -> select, without a branch to mispredict
+llvm::Value* ifExprAST::selectArms(llvm::Value* condV) {
+	llvm::Value* thenVar = Then->codegen();
+	if (!thenVar)
+		throw std::runtime_error("[IfExprAST] Then expression failed.");
+
+	llvm::Type* resultTy = vectorWidth(thenVar) ? thenVar->getType() : llvm::Type::getDoubleTy(*g_Context);
+	llvm::Value* elseVar = Else ? Else->codegen() : nullptr;
+	if (!elseVar)
+		elseVar = llvm::Constant::getNullValue(resultTy);
+
+	if (thenVar->getType() != elseVar->getType())
+		throw std::runtime_error("[IfExprAST] Then and else give different types.");
 
-	return llvm::ConstantFP::get(Context, llvm::APFloat(0.0));
+	emitLocation(this);
+	return g_Builder->CreateSelect(toBool(condV, "IfExprAST"), thenVar, elseVar, "if_tmp");
 }
 
 // If-Else Expresion
@@ -187,10 +1045,16 @@ llvm::Value* ifExprAST::codegen() {
 	if (!condV)
 		throw std::runtime_error("[IfExprAST] Condition expression failed.");
 
+	emitLocation(this);
+
+	// cheap arms without effects -> both computed and a select picks one
+	if (isCheap(Then.get()) && (!Else || isCheap(Else.get())))
+		return selectArms(condV);
+
 	// Convert condition to a boolean by comparing non-equal to 0.0
 	if (condV->getType()->isDoubleTy()) {
 		// Convert floating-point to boolean by comparing to 0.0
-		condV = Builder.CreateFCmpONE(condV, llvm::ConstantFP::get(Context, llvm::APFloat(0.0)), "ifcond");
+		condV = g_Builder->CreateFCmpONE(condV, llvm::ConstantFP::get(*g_Context, llvm::APFloat(0.0)), "ifcond");
 	}
 	else if (condV->getType()->isIntegerTy(1)) {
 		// Already a boolean, no need to convert
@@ -199,50 +1063,168 @@ llvm::Value* ifExprAST::codegen() {
 		throw std::runtime_error("[IfExprAST] Unsupported condition type.");
 
 
-	llvm::Function* function = Builder.GetInsertBlock()->getParent();
+	llvm::Function* function = g_Builder->GetInsertBlock()->getParent();
 
-	llvm::BasicBlock* thenBlock  = llvm::BasicBlock::Create(Context, "then", function);
-	llvm::BasicBlock* elseBlock  = llvm::BasicBlock::Create(Context, "else");
-	llvm::BasicBlock* mergeBlock = llvm::BasicBlock::Create(Context, "merge");
+	llvm::BasicBlock* thenBlock  = llvm::BasicBlock::Create(*g_Context, "then", function);
+	llvm::BasicBlock* elseBlock  = llvm::BasicBlock::Create(*g_Context, "else");
+	llvm::BasicBlock* mergeBlock = llvm::BasicBlock::Create(*g_Context, "merge");
 
-	Builder.CreateCondBr(condV, thenBlock, elseBlock);
+	g_Builder->CreateCondBr(condV, thenBlock, elseBlock);
+	SSA.sealBlock(thenBlock);
+	SSA.sealBlock(elseBlock);
 
 	// Then block
-	Builder.SetInsertPoint(thenBlock);
+	g_Builder->SetInsertPoint(thenBlock);
 	llvm::Value* thenVar = Then->codegen();
 	if (!thenVar)
 		throw std::runtime_error("[IfExprAST] Then expression failed.");
-	Builder.CreateBr(mergeBlock);
-	thenBlock = Builder.GetInsertBlock();
+	g_Builder->CreateBr(mergeBlock);
+	thenBlock = g_Builder->GetInsertBlock();
 
 	// Else block
 	function->getBasicBlockList().push_back(elseBlock);
-	Builder.SetInsertPoint(elseBlock);
+	g_Builder->SetInsertPoint(elseBlock);
 
+	// a missing else is 0.0, in every lane when then is a vector
+	llvm::Type* resultTy = vectorWidth(thenVar) ? thenVar->getType() : llvm::Type::getDoubleTy(*g_Context);
 	llvm::Value* elseVar = nullptr;
 	if (Else) {
 		elseVar = Else->codegen();
 		if (!elseVar)
-			elseVar = llvm::ConstantFP::get(Context, llvm::APFloat(0.0));
+			elseVar = llvm::Constant::getNullValue(resultTy);
 	}
 	else
-		elseVar = llvm::ConstantFP::get(Context, llvm::APFloat(0.0));
+		elseVar = llvm::Constant::getNullValue(resultTy);
+
+	if (vectorWidth(elseVar) != vectorWidth(thenVar))
+		throw std::runtime_error("[IfExprAST] Then and else give different types.");
 
 
-	Builder.CreateBr(mergeBlock);
-	elseBlock = Builder.GetInsertBlock();
+	g_Builder->CreateBr(mergeBlock);
+	elseBlock = g_Builder->GetInsertBlock();
 	function->getBasicBlockList().push_back(mergeBlock);
+	SSA.sealBlock(mergeBlock);
 
-	Builder.SetInsertPoint(mergeBlock);
+	g_Builder->SetInsertPoint(mergeBlock);
 
 	// Merge block
-	llvm::PHINode* phi = Builder.CreatePHI(llvm::Type::getDoubleTy(Context), 2, "if_tmp");
+	llvm::PHINode* phi = g_Builder->CreatePHI(resultTy, 2, "if_tmp");
 	phi->addIncoming(thenVar, thenBlock);
 	phi->addIncoming(elseVar, elseBlock);
 
 	return phi;
 }
 
+// match -> switch on the integer value when every pattern is an integer,
+// so the backend can build a jump table, a balanced comparison tree otherwise
+llvm::Value* MatchExprAST::codegen() {
+	llvm::Value* subject = Subject->codegen();
+	if (!subject)
+		throw std::runtime_error("[MatchExprAST] Match value failed.");
+	subject = laneValue(subject, "MatchExprAST");
+
+	emitLocation(this);
+	llvm::Function* func = g_Builder->GetInsertBlock()->getParent();
+
+	// pattern -> first arm with it, later arms with the same number never run
+	std::map<double, size_t> first;
+	for (size_t i = 0; i < Arms.size(); i++)
+		first.emplace(Arms[i].pattern, i);
+
+	std::vector<llvm::BasicBlock*> armBlocks(Arms.size(), nullptr);
+	for (const auto& pattern : first)
+		armBlocks[pattern.second] = llvm::BasicBlock::Create(*g_Context, "match_arm", func);
+	llvm::BasicBlock* defaultBlock = llvm::BasicBlock::Create(*g_Context, "match_default", func);
+	llvm::BasicBlock* mergeBlock   = llvm::BasicBlock::Create(*g_Context, "match_merge");
+	std::vector<llvm::BasicBlock*> dispatch;
+
+	bool integral = true;
+	for (const auto& pattern : first)
+		integral = integral && pattern.first == std::trunc(pattern.first) && std::fabs(pattern.first) < 9007199254740992.0;
+
+	if (integral) {
+		// x that isn't an exact integer (fractions, NaN, out of range) gets a key of no arm
+		llvm::Type* i64Ty = g_Builder->getInt64Ty();
+		llvm::Value* key = g_Builder->CreateIntrinsic(llvm::Intrinsic::fptosi_sat, { i64Ty, subject->getType() }, { subject }, nullptr, "match_key");
+		llvm::Value* exact = g_Builder->CreateFCmpOEQ(g_Builder->CreateSIToFP(key, subject->getType()), subject, "match_exact");
+
+		int64_t none = std::numeric_limits<int64_t>::min();
+		while (first.count(static_cast<double>(none)))
+			none++;
+		key = g_Builder->CreateSelect(exact, key, g_Builder->getInt64(none));
+
+		llvm::SwitchInst* sw = g_Builder->CreateSwitch(key, defaultBlock, static_cast<unsigned>(first.size()));
+		for (const auto& pattern : first)
+			sw->addCase(g_Builder->getInt64(static_cast<int64_t>(pattern.first)), armBlocks[pattern.second]);
+	}
+	else {
+		// [lo, hi) of the sorted patterns: x < mid goes left, x == mid to its arm, the rest right;
+		// NaN fails every comparison and ends in the default
+		std::vector<std::pair<double, size_t>> sorted(first.begin(), first.end());
+		std::function<llvm::BasicBlock*(size_t, size_t)> tree = [&](size_t lo, size_t hi) {
+			if (lo == hi)
+				return defaultBlock;
+
+			const size_t mid = lo + (hi - lo) / 2;
+			llvm::Value* value = llvm::ConstantFP::get(subject->getType(), sorted[mid].first);
+			llvm::BasicBlock* node  = llvm::BasicBlock::Create(*g_Context, "match_less", func);
+			llvm::BasicBlock* equal = llvm::BasicBlock::Create(*g_Context, "match_equal", func);
+			dispatch.push_back(node);
+			dispatch.push_back(equal);
+
+			llvm::IRBuilder<> builder(node);
+			builder.SetCurrentDebugLocation(g_Builder->getCurrentDebugLocation());
+			builder.CreateCondBr(builder.CreateFCmpOLT(subject, value), tree(lo, mid), equal);
+			builder.SetInsertPoint(equal);
+			builder.CreateCondBr(builder.CreateFCmpOEQ(subject, value), armBlocks[sorted[mid].second], tree(mid + 1, hi));
+			return node;
+		};
+		g_Builder->CreateBr(tree(0, sorted.size()));
+	}
+
+	// every predecessor is known now
+	for (llvm::BasicBlock* block : dispatch)
+		SSA.sealBlock(block);
+	for (llvm::BasicBlock* block : armBlocks)
+		if (block)
+			SSA.sealBlock(block);
+	SSA.sealBlock(defaultBlock);
+
+	// arms in source order, an empty one is 0.0 like a missing else
+	std::vector<std::pair<llvm::Value*, llvm::BasicBlock*>> incoming;
+	auto emitArm = [&](ExprAST* body, llvm::BasicBlock* block) {
+		g_Builder->SetInsertPoint(block);
+		llvm::Value* value = body ? body->codegen() : nullptr;
+		incoming.emplace_back(value, nullptr);
+		g_Builder->CreateBr(mergeBlock);
+		incoming.back().second = g_Builder->GetInsertBlock();
+	};
+	for (size_t i = 0; i < Arms.size(); i++)
+		if (armBlocks[i])
+			emitArm(Arms[i].body.get(), armBlocks[i]);
+	emitArm(Default.get(), defaultBlock);
+
+	llvm::Type* resultTy = llvm::Type::getDoubleTy(*g_Context);
+	for (const auto& in : incoming)
+		if (in.first) {
+			resultTy = in.first->getType();
+			break;
+		}
+
+	func->getBasicBlockList().push_back(mergeBlock);
+	SSA.sealBlock(mergeBlock);
+	g_Builder->SetInsertPoint(mergeBlock);
+
+	llvm::PHINode* phi = g_Builder->CreatePHI(resultTy, static_cast<unsigned>(incoming.size()), "match_tmp");
+	for (const auto& in : incoming) {
+		llvm::Value* value = in.first ? in.first : llvm::Constant::getNullValue(resultTy);
+		if (value->getType() != resultTy)
+			throw std::runtime_error("[MatchExprAST] Arms give different types.");
+		phi->addIncoming(value, in.second);
+	}
+	return phi;
+}
+
 // for expression -> for x=0, x < 10, 1 { Body }  
 llvm::Value* forExprAST::codegen(){
 
@@ -250,21 +1232,26 @@ llvm::Value* forExprAST::codegen(){
 	if (!start)
 		return nullptr;
 
-	BasicBlock* tempBlock = Builder.GetInsertBlock();
-	llvm::Function* func =  Builder.GetInsertBlock()->getParent();
+	emitLocation(this);
+
+	BasicBlock* tempBlock = g_Builder->GetInsertBlock();
+	llvm::Function* func =  g_Builder->GetInsertBlock()->getParent();
 	
-	llvm::BasicBlock* startBlock = BasicBlock::Create(Context, "start", func);  
+	llvm::BasicBlock* startBlock = BasicBlock::Create(*g_Context, "start", func);  
 	
-	Builder.CreateBr(startBlock);
-	Builder.SetInsertPoint(startBlock);
+	g_Builder->CreateBr(startBlock);
+	g_Builder->SetInsertPoint(startBlock);
 
-	PHINode* var_phi = Builder.CreatePHI(Type::getDoubleTy(Context), 2, VarName);
+	PHINode* var_phi = g_Builder->CreatePHI(Type::getDoubleTy(*g_Context), 2, VarName);
 	var_phi->addIncoming(start, tempBlock);
 
-	llvm::AllocaInst* alloca = Builder.CreateAlloca(Type::getDoubleTy(Context), nullptr, VarName);
-	Builder.CreateStore(var_phi, alloca);
-	Value* oldVal = NamedValues[VarName];
-	NamedValues[VarName] = alloca;
+	// the loop variable shadows an outer one until the loop ends
+	auto outer = NamedValues.find(VarName);
+	const bool shadows = outer != NamedValues.end();
+	Value* oldVal = shadows ? outer->second : nullptr;
+	WeakTrackingVH oldSSA = shadows && !oldVal ? SSA.readVariable(VarName, tempBlock) : nullptr;
+	NamedValues.erase(VarName);
+	assignVariable(VarName, var_phi, getLocation());
 
 	if (!Body->codegen())
 		return nullptr;
@@ -277,34 +1264,466 @@ llvm::Value* forExprAST::codegen(){
 			return nullptr;
 	}
 	else
-		stepVal = ConstantFP::get(Context, APFloat(1.0));
+		stepVal = ConstantFP::get(*g_Context, APFloat(1.0));
 
 	// next iter
-	Value* nextVar = Builder.CreateFAdd(var_phi, stepVal, "nextVar");
+	Value* nextVar = g_Builder->CreateFAdd(var_phi, stepVal, "nextVar");
 
 	// end
 	Value* EndCond = End->codegen();
 	if (!EndCond)
 		return nullptr;
 
+	if (vectorWidth(EndCond))
+		throw std::runtime_error("[forExprAST] Loop condition is a vector.");
+
 	Value* tempCond =nullptr;
 	if (EndCond->getType()->isDoubleTy())
-		tempCond = Builder.CreateFCmpONE(EndCond, ConstantFP::get(Context, APFloat(0.0)), "loopcond");
+		tempCond = g_Builder->CreateFCmpONE(EndCond, ConstantFP::get(*g_Context, APFloat(0.0)), "loopcond");
 	else
 		tempCond = EndCond;
 
-	BasicBlock* loopEnd = Builder.GetInsertBlock();
-	BasicBlock* AfterBlock = BasicBlock::Create(Context, "afterLoop", func);
+	BasicBlock* loopEnd = g_Builder->GetInsertBlock();
+	BasicBlock* AfterBlock = BasicBlock::Create(*g_Context, "afterLoop", func);
 
 	var_phi->addIncoming(nextVar, loopEnd);
 
-	Builder.CreateCondBr(tempCond, startBlock, AfterBlock);
-	Builder.SetInsertPoint(AfterBlock);
-	 
-	if (oldVal)
+	g_Builder->CreateCondBr(tempCond, startBlock, AfterBlock);
+	SSA.sealBlock(startBlock);
+	SSA.sealBlock(AfterBlock);
+	g_Builder->SetInsertPoint(AfterBlock);
+
+	if (shadows) {
 		NamedValues[VarName] = oldVal; // update val
+		if (!oldVal)
+			SSA.writeVariable(VarName, AfterBlock, oldSSA);
+	}
 	else
 		NamedValues.erase(VarName);
 
-	return Constant::getNullValue(Type::getDoubleTy(Context));
-}
\ No newline at end of file
+	return Constant::getNullValue(Type::getDoubleTy(*g_Context));
+}
+
+// yield x -> promise = x, then suspend until the loop resumes the generator
+llvm::Value* YieldExprAST::codegen() {
+	if (!CurrentGenerator.function || g_Builder->GetInsertBlock()->getParent() != CurrentGenerator.function)
+		throw std::runtime_error("[YieldExprAST] yield only works in the body of a generator, not in a parfor");
+
+	llvm::Value* value = Value->codegen();
+	if (!value)
+		return nullptr;
+	if (vectorWidth(value))
+		throw std::runtime_error("[YieldExprAST] Generators yield numbers, reduce the vector first (hsum, lane)");
+
+	emitLocation(this);
+	g_Builder->CreateStore(value, CurrentGenerator.promise);
+	emitSuspend(false);
+	return value;
+}
+
+// for x in gen(a) { Body } -> h = gen(a); while !done(h) { x = promise(h); Body; resume(h) }; destroy(h)
+// With -O the generator is inlined here, CoroElide moves its frame to this
+// function's stack and both loops become one.
+llvm::Value* ForInExprAST::codegen() {
+	llvm::Function* gen = getFunction(Generator);
+	if (!gen)
+		throw std::runtime_error("[ForInExprAST] Unknown generator referenced: " + Generator);
+	if (!gen->getReturnType()->isPointerTy())
+		throw std::runtime_error("[ForInExprAST] " + Generator + " has no yield, it isn't a generator");
+	if (gen->arg_size() != Args.size())
+		throw std::runtime_error("[ForInExprAST] Incorrect number of arguments passed to generator: " + Generator);
+
+	std::vector<Value*> args;
+	for (auto& arg : Args) {
+		args.push_back(arg->codegen());
+		if (!args.back())
+			return nullptr;
+		if (vectorWidth(args.back()))
+			throw std::runtime_error("[ForInExprAST] Vectors can't be passed to generators: " + Generator);
+	}
+
+	emitLocation(this);
+	Value* handle = g_Builder->CreateCall(gen, args, "generator");
+
+	BasicBlock* preBlock = g_Builder->GetInsertBlock();
+	llvm::Function* func = preBlock->getParent();
+	BasicBlock* condBlock  = BasicBlock::Create(*g_Context, "forin.cond", func);
+	BasicBlock* bodyBlock  = BasicBlock::Create(*g_Context, "forin.body", func);
+	BasicBlock* afterBlock = BasicBlock::Create(*g_Context, "forin.after", func);
+	g_Builder->CreateBr(condBlock);
+
+	g_Builder->SetInsertPoint(condBlock);
+	llvm::Function* coroDone = llvm::Intrinsic::getDeclaration(g_Module.get(), llvm::Intrinsic::coro_done);
+	g_Builder->CreateCondBr(g_Builder->CreateCall(coroDone, { handle }, "done"), afterBlock, bodyBlock);
+	SSA.sealBlock(bodyBlock);
+	SSA.sealBlock(afterBlock);
+
+	// the loop variable shadows an outer one until the loop ends
+	auto outer = NamedValues.find(VarName);
+	const bool shadows = outer != NamedValues.end();
+	Value* oldVal = shadows ? outer->second : nullptr;
+	WeakTrackingVH oldSSA = shadows && !oldVal ? SSA.readVariable(VarName, preBlock) : nullptr;
+
+	g_Builder->SetInsertPoint(bodyBlock);
+	llvm::Function* coroPromise = llvm::Intrinsic::getDeclaration(g_Module.get(), llvm::Intrinsic::coro_promise);
+	Value* promise = g_Builder->CreateCall(coroPromise, { handle, g_Builder->getInt32(8), g_Builder->getFalse() }, "promise");
+	Value* value = g_Builder->CreateLoad(Type::getDoubleTy(*g_Context),
+		g_Builder->CreateBitCast(promise, Type::getDoublePtrTy(*g_Context)), VarName);
+
+	NamedValues.erase(VarName);
+	assignVariable(VarName, value, getLocation());
+
+	if (!Body->codegen())
+		return nullptr;
+
+	llvm::Function* coroResume = llvm::Intrinsic::getDeclaration(g_Module.get(), llvm::Intrinsic::coro_resume);
+	g_Builder->CreateCall(coroResume, { handle });
+	g_Builder->CreateBr(condBlock);
+	SSA.sealBlock(condBlock);
+
+	g_Builder->SetInsertPoint(afterBlock);
+	llvm::Function* coroDestroy = llvm::Intrinsic::getDeclaration(g_Module.get(), llvm::Intrinsic::coro_destroy);
+	g_Builder->CreateCall(coroDestroy, { handle });
+
+	if (shadows) {
+		NamedValues[VarName] = oldVal;
+		if (!oldVal)
+			SSA.writeVariable(VarName, afterBlock, oldSSA);
+	}
+	else
+		NamedValues.erase(VarName);
+
+	return Constant::getNullValue(Type::getDoubleTy(*g_Context));
+}
+
+// parfor expression -> parfor x = 0, x < 100, 1 reduce(+) { Body }
+// Body becomes "double chunk(i8* env, i64 begin, i64 end)" and dalg_parfor
+// hands iteration ranges of it to the runtime thread pool.
+llvm::Value* ParForExprAST::codegen() {
+	llvm::Type* doubleTy = llvm::Type::getDoubleTy(*g_Context);
+	llvm::Type* i64Ty    = llvm::Type::getInt64Ty(*g_Context);
+	llvm::Type* i32Ty    = llvm::Type::getInt32Ty(*g_Context);
+	llvm::Type* i8PtrTy  = llvm::Type::getInt8PtrTy(*g_Context);
+
+	llvm::Value* start = Start->codegen();
+	llvm::Value* end   = End->codegen();
+	llvm::Value* step  = Step ? Step->codegen() : llvm::ConstantFP::get(*g_Context, llvm::APFloat(1.0));
+	if (!start || !end || !step)
+		return nullptr;
+
+	emitLocation(this);
+
+	// trip count -> ceil((end - start) / step), empty when not positive or the
+	// step isn't a finite number > 0 (the bound is x < end, a step down never
+	// gets there), saturated so a huge span can't give poison
+	llvm::Value* zero  = llvm::ConstantFP::get(*g_Context, llvm::APFloat(0.0));
+	llvm::Value* inf   = llvm::ConstantFP::getInfinity(doubleTy);
+	llvm::Value* span  = g_Builder->CreateFDiv(g_Builder->CreateFSub(end, start), step, "span");
+	llvm::Value* trips = g_Builder->CreateUnaryIntrinsic(llvm::Intrinsic::ceil, span);
+	llvm::Value* valid = g_Builder->CreateAnd(g_Builder->CreateFCmpOGT(trips, zero),
+		g_Builder->CreateFCmpOGT(step, zero), "valid");
+	valid = g_Builder->CreateAnd(valid, g_Builder->CreateFCmpOLT(step, inf));
+	trips = g_Builder->CreateSelect(valid, trips, zero);
+	llvm::Value* count = g_Builder->CreateIntrinsic(llvm::Intrinsic::fptosi_sat, { i64Ty, doubleTy }, { trips }, nullptr, "count");
+
+	// env -> [captured variables..., start, step], vector variables aren't captured
+	std::vector<std::string> captured;
+	std::vector<llvm::Value*> capturedValues;
+	for (const auto& named : NamedValues) {
+		llvm::Value* value = readVariable(named.first);
+		if (vectorWidth(value))
+			continue;
+		captured.push_back(named.first);
+		capturedValues.push_back(value);
+	}
+
+	llvm::Function* parent = g_Builder->GetInsertBlock()->getParent();
+	llvm::IRBuilder<> entryBuilder(&parent->getEntryBlock(), parent->getEntryBlock().begin());
+	llvm::ArrayType* envTy = llvm::ArrayType::get(doubleTy, captured.size() + 2);
+	llvm::AllocaInst* env  = entryBuilder.CreateAlloca(envTy, nullptr, "parfor_env");
+
+	unsigned slot = 0;
+	for (llvm::Value* value : capturedValues)
+		g_Builder->CreateStore(value, g_Builder->CreateConstInBoundsGEP2_32(envTy, env, 0, slot++));
+	g_Builder->CreateStore(start, g_Builder->CreateConstInBoundsGEP2_32(envTy, env, 0, slot++));
+	g_Builder->CreateStore(step,  g_Builder->CreateConstInBoundsGEP2_32(envTy, env, 0, slot++));
+
+	// outlined body
+	llvm::FunctionType* chunkTy = llvm::FunctionType::get(doubleTy, { i8PtrTy, i64Ty, i64Ty }, false);
+	llvm::Function* chunk = llvm::Function::Create(chunkTy, llvm::Function::InternalLinkage,
+		parent->getName() + ".parfor", g_Module.get());
+
+	llvm::Value* envArg   = chunk->getArg(0);
+	llvm::Value* beginArg = chunk->getArg(1);
+	llvm::Value* endArg   = chunk->getArg(2);
+
+	llvm::BasicBlock* savedBlock = g_Builder->GetInsertBlock();
+	auto savedValues = std::move(NamedValues);
+	auto savedSpawns = std::move(SpawnSites);
+	NamedValues.clear();
+	SpawnSites.clear();
+
+	llvm::BasicBlock* entryBlock = llvm::BasicBlock::Create(*g_Context, "entry", chunk);
+	g_Builder->SetInsertPoint(entryBlock);
+	SSA.sealBlock(entryBlock);
+	beginDebugFunction(chunk, getLocation());
+
+	llvm::Value* envPtr = g_Builder->CreateBitCast(envArg, envTy->getPointerTo());
+	slot = 0;
+	for (const auto& name : captured)
+		assignVariable(name, g_Builder->CreateLoad(doubleTy, g_Builder->CreateConstInBoundsGEP2_32(envTy, envPtr, 0, slot++), name), getLocation());
+	llvm::Value* innerStart = g_Builder->CreateLoad(doubleTy, g_Builder->CreateConstInBoundsGEP2_32(envTy, envPtr, 0, slot++), "start");
+	llvm::Value* innerStep  = g_Builder->CreateLoad(doubleTy, g_Builder->CreateConstInBoundsGEP2_32(envTy, envPtr, 0, slot++), "step");
+
+	NamedValues.erase(VarName);
+
+	llvm::Value* identity = nullptr;
+	switch (Op) {
+	case reduce_mul: identity = llvm::ConstantFP::get(doubleTy, 1.0); break;
+	case reduce_min: identity = llvm::ConstantFP::getInfinity(doubleTy, false); break;
+	case reduce_max: identity = llvm::ConstantFP::getInfinity(doubleTy, true); break;
+	default:         identity = zero; break;
+	}
+
+	llvm::BasicBlock* loopBlock  = llvm::BasicBlock::Create(*g_Context, "loop", chunk);
+	llvm::BasicBlock* afterBlock = llvm::BasicBlock::Create(*g_Context, "afterLoop");
+	g_Builder->CreateCondBr(g_Builder->CreateICmpSLT(beginArg, endArg), loopBlock, afterBlock);
+
+	g_Builder->SetInsertPoint(loopBlock);
+	llvm::PHINode* k   = g_Builder->CreatePHI(i64Ty, 2, "k");
+	llvm::PHINode* acc = g_Builder->CreatePHI(doubleTy, 2, "acc");
+	k->addIncoming(beginArg, entryBlock);
+	acc->addIncoming(identity, entryBlock);
+
+	// x = start + k * step
+	emitLocation(this);
+	llvm::Value* x = g_Builder->CreateFAdd(innerStart, g_Builder->CreateFMul(g_Builder->CreateSIToFP(k, doubleTy), innerStep), VarName);
+	assignVariable(VarName, x, getLocation());
+
+	llvm::Value* bodyVal = Body->codegen();
+	if (!bodyVal)
+		throw std::runtime_error("[ParForExprAST] Body expression failed.");
+
+	llvm::Value* next = acc;
+	if (Op != reduce_none) {
+		if (bodyVal->getType()->isIntegerTy(1))
+			bodyVal = g_Builder->CreateUIToFP(bodyVal, doubleTy);
+		else if (!bodyVal->getType()->isDoubleTy())
+			throw std::runtime_error("[ParForExprAST] reduce needs a numeric body.");
+
+		switch (Op) {
+		case reduce_add: next = g_Builder->CreateFAdd(acc, bodyVal, "reduce"); break;
+		case reduce_mul: next = g_Builder->CreateFMul(acc, bodyVal, "reduce"); break;
+		case reduce_min: next = g_Builder->CreateMinNum(acc, bodyVal, "reduce"); break;
+		case reduce_max: next = g_Builder->CreateMaxNum(acc, bodyVal, "reduce"); break;
+		default: break;
+		}
+	}
+
+	llvm::Value* kNext = g_Builder->CreateAdd(k, llvm::ConstantInt::get(i64Ty, 1), "nextK");
+	llvm::BasicBlock* loopEnd = g_Builder->GetInsertBlock();
+	k->addIncoming(kNext, loopEnd);
+	acc->addIncoming(next, loopEnd);
+	g_Builder->CreateCondBr(g_Builder->CreateICmpSLT(kNext, endArg), loopBlock, afterBlock);
+	SSA.sealBlock(loopBlock);
+	SSA.sealBlock(afterBlock);
+
+	chunk->getBasicBlockList().push_back(afterBlock);
+	g_Builder->SetInsertPoint(afterBlock);
+	llvm::PHINode* result = g_Builder->CreatePHI(doubleTy, 2, "result");
+	result->addIncoming(identity, entryBlock);
+	result->addIncoming(next, loopEnd);
+	emitSync();
+	g_Builder->CreateRet(result);
+	endDebugFunction();
+	llvm::verifyFunction(*chunk);
+
+	NamedValues = std::move(savedValues);
+	SpawnSites = std::move(savedSpawns);
+	g_Builder->SetInsertPoint(savedBlock);
+
+	llvm::FunctionCallee parforFunc = g_Module->getOrInsertFunction("dalg_parfor",
+		doubleTy, chunk->getType(), i8PtrTy, i64Ty, i32Ty);
+
+	return g_Builder->CreateCall(parforFunc,
+		{ chunk, g_Builder->CreateBitCast(env, i8PtrTy), count, llvm::ConstantInt::get(i32Ty, Op) }, "parfor");
+}
+
+// spawn expression -> a = spawn fib(n - 1);
+// dalg_spawn queues "double fib.spawn(double* args)" with a copy of the arguments
+llvm::Value* SpawnExprAST::codegen() {
+	llvm::Function* CalleeFunc = getFunction(Callee);
+	if (!CalleeFunc)
+		throw std::runtime_error("[SpawnExprAST] Unknown function referenced: " + Callee);
+
+	if (CalleeFunc->arg_size() != Args.size())
+		throw std::runtime_error("[SpawnExprAST] Incorrect number of arguments passed to function: " + Callee);
+	if (CalleeFunc->getReturnType()->isPointerTy())
+		throw std::runtime_error("[SpawnExprAST] Generators can't be spawned: " + Callee);
+
+	llvm::Type* doubleTy    = llvm::Type::getDoubleTy(*g_Context);
+	llvm::Type* doublePtrTy = llvm::Type::getDoublePtrTy(*g_Context);
+	llvm::Type* i8PtrTy     = llvm::Type::getInt8PtrTy(*g_Context);
+	llvm::Type* i32Ty       = llvm::Type::getInt32Ty(*g_Context);
+
+	// thunk, one per callee
+	llvm::Function* thunk = g_Module->getFunction(Callee + ".spawn");
+	if (!thunk) {
+		llvm::FunctionType* thunkTy = llvm::FunctionType::get(doubleTy, { doublePtrTy }, false);
+		thunk = llvm::Function::Create(thunkTy, llvm::Function::InternalLinkage, Callee + ".spawn", g_Module.get());
+
+		llvm::IRBuilder<> thunkBuilder(llvm::BasicBlock::Create(*g_Context, "entry", thunk));
+		std::vector<llvm::Value*> thunkArgs;
+		for (unsigned i = 0; i < Args.size(); i++)
+			thunkArgs.push_back(thunkBuilder.CreateLoad(doubleTy, thunkBuilder.CreateConstInBoundsGEP1_32(doubleTy, thunk->getArg(0), i)));
+		thunkBuilder.CreateRet(createCall(thunkBuilder, CalleeFunc, thunkArgs));
+	}
+
+	llvm::Function* func = g_Builder->GetInsertBlock()->getParent();
+
+	llvm::ArrayType* argsTy = llvm::ArrayType::get(doubleTy, std::max<size_t>(Args.size(), 1));
+	llvm::AllocaInst* args  = createEntryAlloca(func, argsTy, Callee + ".args");
+	for (unsigned i = 0; i < Args.size(); i++) {
+		llvm::Value* V = Args[i]->codegen();
+		if (!V || !V->getType()->isDoubleTy())
+			throw std::runtime_error("[SpawnExprAST] Invalid argument passed to function: " + Callee);
+		g_Builder->CreateStore(V, g_Builder->CreateConstInBoundsGEP2_32(argsTy, args, 0, i));
+	}
+
+	emitLocation(this);
+
+	SpawnSite site;
+	site.future = createEntryAlloca(func, i8PtrTy, Callee + ".future",
+		llvm::ConstantPointerNull::get(llvm::cast<llvm::PointerType>(i8PtrTy)));
+	site.target = nullptr;
+
+	if (!Target.empty()) {
+		site.target = NamedValues[Target];
+		if (site.target && llvm::cast<llvm::AllocaInst>(site.target)->getAllocatedType()->isVectorTy())
+			throw std::runtime_error("[SpawnExprAST] A vector variable can't take a spawned result: " + Target);
+		if (!site.target) {
+			site.target = createEntryAlloca(func, doubleTy, Target, llvm::ConstantFP::get(doubleTy, 0.0));
+			NamedValues[Target] = site.target;
+		}
+	}
+
+	// a site inside a loop waits for its previous call before spawning again
+	emitSync(site);
+
+	llvm::FunctionCallee spawnFunc = g_Module->getOrInsertFunction("dalg_spawn",
+		i8PtrTy, thunk->getType(), doublePtrTy, i32Ty);
+
+	llvm::Value* future = g_Builder->CreateCall(spawnFunc,
+		{ thunk, g_Builder->CreateConstInBoundsGEP2_32(argsTy, args, 0, 0), llvm::ConstantInt::get(i32Ty, Args.size()) }, "spawn");
+	g_Builder->CreateStore(future, site.future);
+
+	SpawnSites.push_back(site);
+
+	return llvm::ConstantFP::get(*g_Context, llvm::APFloat(0.0));
+}
+
+// sync expression -> sync
+llvm::Value* SyncExprAST::codegen() {
+	emitLocation(this);
+	emitSync();
+	return llvm::ConstantFP::get(*g_Context, llvm::APFloat(0.0));
+}
+
+// vec4(a, b, c, d) -> insertelement chain, constant lanes give a constant vector
+llvm::Value* VectorExprAST::codegen() {
+	std::vector<llvm::Value*> lanes;
+	for (auto& lane : Lanes) {
+		llvm::Value* value = lane->codegen();
+		if (!value)
+			return nullptr;
+		lanes.push_back(laneValue(value, "VectorExprAST"));
+	}
+
+	emitLocation(this);
+	if (lanes.size() == 1)
+		return g_Builder->CreateVectorSplat(Width, lanes[0], "splat");
+
+	llvm::Value* vec = llvm::PoisonValue::get(llvm::FixedVectorType::get(llvm::Type::getDoubleTy(*g_Context), Width));
+	for (unsigned i = 0; i < Width; i++)
+		vec = g_Builder->CreateInsertElement(vec, lanes[i], i, "vec");
+	return vec;
+}
+
+// lane(v, i) -> extractelement
+llvm::Value* LaneExprAST::codegen() {
+	llvm::Value* vec   = Vec->codegen();
+	llvm::Value* index = Index->codegen();
+	if (!vec || !index)
+		return nullptr;
+
+	const unsigned width = vectorWidth(vec);
+	if (!width)
+		throw std::runtime_error("[LaneExprAST] lane needs a vector.");
+
+	emitLocation(this);
+	if (auto* constant = llvm::dyn_cast<llvm::ConstantFP>(index)) {
+		const double i = constant->getValueAPF().convertToDouble();
+		if (i < 0 || i >= width || i != static_cast<unsigned>(i)) {
+			std::ostringstream msg;
+			msg << "[LaneExprAST] Lane index out of range: " << i;
+			throw std::runtime_error(msg.str());
+		}
+		return g_Builder->CreateExtractElement(vec, static_cast<uint64_t>(i), "lane");
+	}
+
+	// the width is a power of two, the mask keeps the index inside the vector
+	llvm::Value* i = g_Builder->CreateFPToSI(laneValue(index, "LaneExprAST"), g_Builder->getInt32Ty());
+	return g_Builder->CreateExtractElement(vec, g_Builder->CreateAnd(i, width - 1), "lane");
+}
+
+// shuffle(a, b, 0, 4, ...) -> shufflevector, one source shuffles with itself
+llvm::Value* ShuffleExprAST::codegen() {
+	std::vector<llvm::Value*> sources;
+	for (auto& source : Sources) {
+		llvm::Value* value = source->codegen();
+		if (!value)
+			return nullptr;
+		sources.push_back(value);
+	}
+
+	const unsigned width = vectorWidth(sources[0]);
+	if (!width || (sources.size() == 2 && vectorWidth(sources[1]) != width))
+		throw std::runtime_error("[ShuffleExprAST] shuffle needs vectors of the same width.");
+
+	for (int i : Indices)
+		if (static_cast<unsigned>(i) >= width * sources.size())
+			throw std::runtime_error("[ShuffleExprAST] Lane index out of range: " + std::to_string(i));
+
+	emitLocation(this);
+	llvm::Value* second = sources.size() == 2 ? sources[1] : sources[0];
+	return g_Builder->CreateShuffleVector(sources[0], second, Indices, "shuffle");
+}
+
+// hsum(v) -> log2(N) steps of low half op high half, the same order on every target
+llvm::Value* HorizontalExprAST::codegen() {
+	llvm::Value* vec = Vec->codegen();
+	if (!vec)
+		return nullptr;
+	if (!vectorWidth(vec))
+		throw std::runtime_error("[HorizontalExprAST] Horizontal reduction needs a vector.");
+
+	emitLocation(this);
+	for (unsigned half = vectorWidth(vec) / 2; half >= 1; half /= 2) {
+		std::vector<int> low, high;
+		for (unsigned i = 0; i < half; i++) {
+			low.push_back(i);
+			high.push_back(i + half);
+		}
+		llvm::Value* L = g_Builder->CreateShuffleVector(vec, vec, low, "low");
+		llvm::Value* R = g_Builder->CreateShuffleVector(vec, vec, high, "high");
+
+		switch (Op) {
+		case reduce_add: vec = g_Builder->CreateFAdd(L, R, "hsum"); break;
+		case reduce_mul: vec = g_Builder->CreateFMul(L, R, "hmul"); break;
+		case reduce_min: vec = g_Builder->CreateMinNum(L, R, "hmin"); break;
+		case reduce_max: vec = g_Builder->CreateMaxNum(L, R, "hmax"); break;
+		default: throw std::runtime_error("[HorizontalExprAST] Invalid reduction.");
+		}
+	}
+	return g_Builder->CreateExtractElement(vec, uint64_t(0), "reduce");
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <map>
+#include <set>
 #include <iostream>
 
 #include <llvm/IR/BasicBlock.h>
@@ -12,22 +13,103 @@
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
 
+#include "purity.h"
+#include "runtime.h"
+
 using namespace llvm;
 
-// Globals
-extern llvm::LLVMContext Context;
-extern llvm::IRBuilder<> Builder;
-extern std::unique_ptr<llvm::Module> g_Module;
-extern std::map<std::string, llvm::Value*> NamedValues;
+// Globals (one set per thread, see initializeLLVM)
+extern thread_local std::unique_ptr<llvm::LLVMContext> g_Context;
+extern thread_local std::unique_ptr<llvm::IRBuilder<>> g_Builder;
+extern thread_local std::unique_ptr<llvm::Module> g_Module;
+extern thread_local std::map<std::string, llvm::Value*> NamedValues;
+
+// C types of extern fn parameters and results, dalg values are doubles
+enum class NativeType : uint8_t { F64, F32, I64, I32, Void };
+
+// extern fn scale(x: f64, n: i32) -> f32 pure nounwind;
+struct ExternSignature {
+    std::vector<NativeType> params;
+    NativeType result = NativeType::F64;
+    bool pure = false;       // reads no memory, no side effects, returns
+    bool nounwind = false;   // never throws
+};
+
+// Functions that live outside g_Module (lazy JIT, streamed compiles): argument
+// names and, for extern fn, the C signature. Calls declare them in g_Module on first use.
+struct PrototypeInfo {
+    std::vector<std::string> args;
+    std::shared_ptr<const ExternSignature> native;
+};
+using PrototypeTable = std::map<std::string, PrototypeInfo>;
+extern thread_local const PrototypeTable* g_Prototypes;
+
+// Purity of the functions being generated, applied as function attributes
+// to their definitions and declarations. Null -> no attributes.
+extern thread_local const PurityTable* g_Purity;
+
+// Compiler switches, set once by the driver and shared by every thread
+struct CodegenOptions {
+    bool instrument = false;   // --instrument -> runtime counters
+    bool debugInfo  = false;   // -g -> DWARF line tables, gdb and perf jitdump in the JIT
+    bool perfMap    = false;   // --jit -> /tmp/perf-PID.map for perf report
+    bool frontendSSA = false;  // --ssa -> variables are SSA values, no allocas at -O0
+    std::string march;         // --march=native|<cpu>, empty -> generic objects, host CPU in the JIT
+};
+extern CodegenOptions g_Options;
+
+// Fresh context, builder and module for the calling thread
+void initializeLLVM(const std::string& moduleName = "TEST");
 
 class ExprAST;
 using ExprPtr = std::unique_ptr<ExprAST>;
 
+// Where a node starts in the source, 0 -> unknown
+struct SourceLocation {
+    int line   = 0;
+    int column = 0;
+};
+
+// Compile time value (consteval.h), comparisons give booleans like the i1 of codegen
+struct ConstValue {
+    double number  = 0.0;
+    bool   boolean = false;
+};
+class ConstEval;
+class BytecodeCompiler;
+
 // All Expressions
 class ExprAST {
+    SourceLocation loc;
 public:
     virtual ~ExprAST() = default;  
     virtual llvm::Value* codegen() = 0;
+
+    const SourceLocation& getLocation() const {
+        return loc;
+    }
+
+    void setLocation(SourceLocation l) {
+        loc = l;
+    }
+
+    // Direct sub-expressions, for analyses that walk the tree
+    virtual void children(std::vector<ExprAST*>&) {}
+
+    // Value without running the program, false when it isn't known
+    virtual bool evaluate(ConstEval&, ConstValue&) {
+        return false;
+    }
+
+    // Folds the sub-expressions, returns a replacement for this node or null
+    virtual ExprPtr fold(ConstEval&) {
+        return nullptr;
+    }
+
+    // Bytecode for the VM (bytecode.h), returns the register holding the value
+    virtual uint16_t emit(BytecodeCompiler&) {
+        throw std::runtime_error("[Bytecode] Unsupported expression");
+    }
 };
 
 // Numbers
@@ -36,7 +118,13 @@ class NumberExprAST : public ExprAST {
 public:
     NumberExprAST(double x) : val(x) {}
 
+    double getValue() const {
+        return val;
+    }
+
     llvm::Value* codegen();
+    bool evaluate(ConstEval& eval, ConstValue& out);
+    uint16_t emit(BytecodeCompiler& bc);
 };
 
 // Strings
@@ -45,7 +133,12 @@ class StringExprAST : public ExprAST {
 public:
     StringExprAST(const std::string& s) : str(s) {}
 
+    const std::string& getString() const {
+        return str;
+    }
+
     llvm::Value* codegen();
+    uint16_t emit(BytecodeCompiler& bc);
 
 };
 
@@ -56,9 +149,12 @@ public:
     VariableExprAST(std::string& x) : name(x) {}
 
     llvm::Value* codegen();
+    bool evaluate(ConstEval& eval, ConstValue& out);
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
 };
 
-// Binary Operands
+// Binary Operands, && and || only evaluate the rhs when the lhs doesn't decide
 class BinaryExprAST : public ExprAST {
     std::string op;
     ExprPtr lhs, rhs;
@@ -67,20 +163,131 @@ public:
         : op(x), lhs(std::move(l)), rhs(std::move(r)) {
     }
 
+    // Operator chains are unlinked one node at a time, generated
+    // expressions can be hundreds of thousands of nodes deep
+    ~BinaryExprAST();
+
     llvm::Value* codegen();
+    bool evaluate(ConstEval& eval, ConstValue& out);
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    // The operator tree under this node on an explicit stack, left to right
+    // like a recursive walk: operand(slot, value) for every operand that
+    // isn't an operator, between(node, lhs) before the rhs of a node and
+    // combine(node, lhs, rhs, value) after it. A callback returning false
+    // stops the walk.
+    template <typename Value, typename Operand, typename Between, typename Combine>
+    bool walk(Value& out, Operand operand, Between between, Combine combine) {
+        struct Item {
+            BinaryExprAST* node;
+            ExprPtr* slot;   // operand, the node is null
+            int stage;       // 0 -> lhs, 1 -> rhs, 2 -> combine
+        };
+        std::vector<Item> work{ { this, nullptr, 0 } };
+        std::vector<Value> values;
+
+        while (!work.empty()) {
+            const Item item = work.back();
+            work.pop_back();
+
+            if (item.slot) {
+                if (auto* bin = dynamic_cast<BinaryExprAST*>(item.slot->get()))
+                    work.push_back({ bin, nullptr, 0 });
+                else {
+                    values.emplace_back();
+                    if (!operand(*item.slot, values.back()))
+                        return false;
+                }
+                continue;
+            }
+
+            BinaryExprAST& node = *item.node;
+            if (item.stage == 0) {
+                work.push_back({ &node, nullptr, 1 });
+                work.push_back({ nullptr, &node.lhs, 0 });
+            }
+            else if (item.stage == 1) {
+                if (!between(node, values.back()))
+                    return false;
+                work.push_back({ &node, nullptr, 2 });
+                work.push_back({ nullptr, &node.rhs, 0 });
+            }
+            else {
+                Value r = std::move(values.back());
+                values.pop_back();
+                Value l = std::move(values.back());
+                values.pop_back();
+                values.emplace_back();
+                if (!combine(node, l, r, values.back()))
+                    return false;
+            }
+        }
+
+        out = std::move(values.back());
+        return true;
+    }
+
+    void children(std::vector<ExprAST*>& out) {
+        out.push_back(lhs.get());
+        out.push_back(rhs.get());
+    }
+};
+
+// !x -> 1 when x is 0 (or NaN), like the conditions of if
+class NotExprAST : public ExprAST {
+    ExprPtr operand;
+public:
+    NotExprAST(ExprPtr x) : operand(std::move(x)) {}
+
+    llvm::Value* codegen();
+    bool evaluate(ConstEval& eval, ConstValue& out);
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        out.push_back(operand.get());
+    }
 };
 
 // Func prototype -> fn test(a,b)
 class PrototypeAST : public ExprAST {
     std::string name;
     std::vector<std::string> Args;
+    bool generator = false;   // the body yields -> returns a coroutine handle (i8*)
+    std::shared_ptr<const ExternSignature> native;   // extern fn, null for dalg functions
 public:
     PrototypeAST(std::string x, std::vector<std::string> a) : name(x), Args(a) {}
+    PrototypeAST(std::string x, const PrototypeInfo& info) : name(x), Args(info.args), native(info.native) {}
 
     const std::string& getName() const {
         return name;
     }
 
+    void setGenerator() {
+        generator = true;
+    }
+
+    bool isGenerator() const {
+        return generator;
+    }
+
+    void setExtern(ExternSignature signature) {
+        native = std::make_shared<const ExternSignature>(std::move(signature));
+    }
+
+    const ExternSignature* getExtern() const {
+        return native.get();
+    }
+
+    PrototypeInfo info() const {
+        return { Args, native };
+    }
+
+    const std::vector<std::string>& getArgs() const {
+        return Args;
+    }
+
     llvm::Function* codegen();
 };
 
@@ -91,18 +298,76 @@ class CallExprAST : public ExprAST {
 public:
     CallExprAST(std::string c, std::vector<ExprPtr> x) : Callee(c), Args(std::move(x)) {}
 
+    const std::string& getCallee() const {
+        return Callee;
+    }
+
     llvm::Value* codegen();
+    bool evaluate(ConstEval& eval, ConstValue& out);
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        for (auto& arg : Args)
+            out.push_back(arg.get());
+    }
+};
+
+// @memo(4096, keep) -> name "memo", args { "4096", "keep" }
+struct Annotation {
+    std::string name;
+    std::vector<std::string> args;
 };
 
 // Function
 class FunctionAST : public ExprAST {
     std::unique_ptr<PrototypeAST> proto;
     ExprPtr body;
+    std::vector<Annotation> annotations;
 public:
     FunctionAST(std::unique_ptr<PrototypeAST> x, ExprPtr y)
         : proto(std::move(x)), body(std::move(y)) {
     }
 
+    const PrototypeAST& getProto() const {
+        return *proto;
+    }
+
+    // fn test(a, b);
+    bool isDeclaration() const {
+        return !body;
+    }
+
+    void addAnnotation(Annotation annotation) {
+        annotations.push_back(std::move(annotation));
+    }
+
+    const Annotation* getAnnotation(const std::string& name) const {
+        for (const auto& a : annotations)
+            if (a.name == name)
+                return &a;
+        return nullptr;
+    }
+
+    bool hasAnnotation(const std::string& name) const {
+        return getAnnotation(name) != nullptr;
+    }
+
+    // input of analyzePurity: bodies and pure extern fn, other declarations have none
+    bool hasSummary() const {
+        return body || (proto->getExtern() && proto->getExtern()->pure);
+    }
+    EffectSummary summarize() const;
+
+    // Calls of pure functions with constant arguments and const bindings -> numbers
+    void foldConstants(ConstEval& eval);
+
+    // Body run by the interpreter, false when the result isn't known
+    bool evaluateCall(ConstEval& eval, const std::vector<double>& args, double& out) const;
+
+    // Body as a VM function, declared in "bc" before
+    void emitBytecode(BytecodeCompiler& bc) const;
+
     llvm::Function* codegen();
 };
 
@@ -110,12 +375,20 @@ public:
 class AssignmentExprAST : public ExprAST {
     std::string name;
     ExprPtr val;
+    bool constant;   // const n = ...
 public:
-    AssignmentExprAST(const std::string& x, ExprPtr y)
-        : name(x), val(std::move(y)) {
+    AssignmentExprAST(const std::string& x, ExprPtr y, bool c = false)
+        : name(x), val(std::move(y)), constant(c) {
     }
 
     llvm::Value* codegen();
+    bool evaluate(ConstEval& eval, ConstValue& out);
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        out.push_back(val.get());
+    }
 };
  
 // Block Expression
@@ -125,6 +398,14 @@ public:
     BlockExprAST(std::vector<ExprPtr> block_vec ) : expr(std::move( block_vec )) {}
 
     llvm::Value* codegen();
+    bool evaluate(ConstEval& eval, ConstValue& out);
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        for (auto& e : expr)
+            out.push_back(e.get());
+    }
 };
 
 // Printf linking  
@@ -134,6 +415,12 @@ public:
     PrintExprAST(ExprPtr x) : expr(std::move(x)) {}
 
     llvm::Value* codegen();
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        out.push_back(expr.get());
+    }
 };
 
 // If-Else Expresion
@@ -144,7 +431,52 @@ public:
         : Cond(std::move(cond)), Then(std::move(thenExpr)), Else(std::move(elseExpr)) {
     }
 
+    llvm::Value* selectArms(llvm::Value* cond);
+
     llvm::Value* codegen();
+    bool evaluate(ConstEval& eval, ConstValue& out);
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        out.push_back(Cond.get());
+        out.push_back(Then.get());
+        if (Else)
+            out.push_back(Else.get());
+    }
+};
+
+// match x { 1 => a, 2 => b, _ => c } -> the first arm equal to x, else _ (0 without it).
+// Integral patterns become a switch, others a balanced tree of comparisons.
+class MatchExprAST : public ExprAST {
+public:
+    struct Arm {
+        double pattern;
+        ExprPtr body;
+    };
+
+private:
+    ExprPtr Subject;
+    std::vector<Arm> Arms;
+    ExprPtr Default;
+
+public:
+    MatchExprAST(ExprPtr subject, std::vector<Arm> arms, ExprPtr otherwise)
+        : Subject(std::move(subject)), Arms(std::move(arms)), Default(std::move(otherwise)) {
+    }
+
+    llvm::Value* codegen();
+    bool evaluate(ConstEval& eval, ConstValue& out);
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        out.push_back(Subject.get());
+        for (auto& arm : Arms)
+            out.push_back(arm.body.get());
+        if (Default)
+            out.push_back(Default.get());
+    }
 };
 
 class forExprAST : public ExprAST {
@@ -160,6 +492,128 @@ public:
           Body(std::move(body)) {}
 
     llvm::Value* codegen();
+    bool evaluate(ConstEval& eval, ConstValue& out);
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        out.push_back(Start.get());
+        out.push_back(End.get());
+        if (Step)
+            out.push_back(Step.get());
+        out.push_back(Body.get());
+    }
+};
+
+// yield x -> hands x to the loop running the generator and suspends until
+// it asks for the next value. Gives x.
+class YieldExprAST : public ExprAST {
+    ExprPtr Value;
+
+public:
+    explicit YieldExprAST(ExprPtr value) : Value(std::move(value)) {}
+
+    llvm::Value* codegen();
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        out.push_back(Value.get());
+    }
+};
+
+// for x in gen(a, b) { Body } -> Body once per value the generator yields.
+// The generator is a coroutine, resumed after every iteration and destroyed
+// when the loop ends.
+class ForInExprAST : public ExprAST {
+    std::string VarName;
+    std::string Generator;
+    std::vector<ExprPtr> Args;
+    ExprPtr Body;
+
+public:
+    ForInExprAST(const std::string& varname, const std::string& generator, std::vector<ExprPtr> args, ExprPtr body)
+        : VarName(varname), Generator(generator), Args(std::move(args)), Body(std::move(body)) {}
+
+    const std::string& getGenerator() const {
+        return Generator;
+    }
+
+    llvm::Value* codegen();
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        for (auto& arg : Args)
+            out.push_back(arg.get());
+        out.push_back(Body.get());
+    }
+};
+
+// Parallel for -> parfor x = 0, x < 100, 1 reduce(+) { Body }
+// Body is outlined and its iterations run on the runtime thread pool,
+// outer variables are captured by value.
+class ParForExprAST : public ExprAST {
+    std::string VarName;
+    ExprPtr Start, End, Step, Body;
+    ReduceOp Op;
+
+public:
+    ParForExprAST(const std::string& varname, ExprPtr start, ExprPtr end, ExprPtr step, ExprPtr body, ReduceOp op) :
+          VarName(varname),
+          Start(std::move(start)),
+          End(std::move(end)),
+          Step(std::move(step)),
+          Body(std::move(body)),
+          Op(op) {}
+
+    llvm::Value* codegen();
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        out.push_back(Start.get());
+        out.push_back(End.get());
+        if (Step)
+            out.push_back(Step.get());
+        out.push_back(Body.get());
+    }
+};
+
+// Spawned call -> a = spawn fib(n - 1);
+// runs on the thread pool, "a" is written at the next sync (or function end)
+class SpawnExprAST : public ExprAST {
+    std::string Target;
+    std::string Callee;
+    std::vector<ExprPtr> Args;
+public:
+    SpawnExprAST(const std::string& target, const std::string& callee, std::vector<ExprPtr> args)
+        : Target(target), Callee(callee), Args(std::move(args)) {}
+
+    const std::string& getCallee() const {
+        return Callee;
+    }
+
+    // Empty when the result is dropped
+    const std::string& getTarget() const {
+        return Target;
+    }
+
+    llvm::Value* codegen();
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        for (auto& arg : Args)
+            out.push_back(arg.get());
+    }
+};
+
+// Sync -> waits for every call spawned so far in the function
+class SyncExprAST : public ExprAST {
+public:
+    llvm::Value* codegen();
+    uint16_t emit(BytecodeCompiler& bc);
 };
 
 class WhileExprAST : public ExprAST {
@@ -168,4 +622,78 @@ public:
     WhileExprAST( ExprPtr cond, ExprPtr body) : Cond(std::move(cond)), Body(std::move(body)) {}
 
     llvm::Value* codegen();
-};
\ No newline at end of file
+
+    void children(std::vector<ExprAST*>& out) {
+        out.push_back(Cond.get());
+        out.push_back(Body.get());
+    }
+};
+
+// SIMD values -> <N x double>, N = 2, 4 or 8. They live inside a function:
+// arguments and results of calls stay numbers.
+
+// vec4(a, b, c, d), vec4(x) puts x in every lane
+class VectorExprAST : public ExprAST {
+    std::vector<ExprPtr> Lanes;
+    unsigned Width;
+public:
+    VectorExprAST(unsigned width, std::vector<ExprPtr> lanes) : Lanes(std::move(lanes)), Width(width) {}
+
+    llvm::Value* codegen();
+    ExprPtr fold(ConstEval& eval);
+    uint16_t emit(BytecodeCompiler& bc);
+
+    void children(std::vector<ExprAST*>& out) {
+        for (auto& lane : Lanes)
+            out.push_back(lane.get());
+    }
+};
+
+// lane(v, 2), a computed index wraps around the width
+class LaneExprAST : public ExprAST {
+    ExprPtr Vec, Index;
+public:
+    LaneExprAST(ExprPtr vec, ExprPtr index) : Vec(std::move(vec)), Index(std::move(index)) {}
+
+    llvm::Value* codegen();
+    ExprPtr fold(ConstEval& eval);
+
+    void children(std::vector<ExprAST*>& out) {
+        out.push_back(Vec.get());
+        out.push_back(Index.get());
+    }
+};
+
+// shuffle(v, 3, 2, 1, 0) | shuffle(a, b, 0, 4, 1, 5) -> one lane per index,
+// the lanes of b follow the lanes of a
+class ShuffleExprAST : public ExprAST {
+    std::vector<ExprPtr> Sources;
+    std::vector<int> Indices;
+public:
+    ShuffleExprAST(std::vector<ExprPtr> sources, std::vector<int> indices)
+        : Sources(std::move(sources)), Indices(std::move(indices)) {}
+
+    llvm::Value* codegen();
+    ExprPtr fold(ConstEval& eval);
+
+    void children(std::vector<ExprAST*>& out) {
+        for (auto& source : Sources)
+            out.push_back(source.get());
+    }
+};
+
+// hsum(v) | hmul(v) | hmin(v) | hmax(v) -> number, the halves of the vector
+// are combined until one lane is left
+class HorizontalExprAST : public ExprAST {
+    ReduceOp Op;
+    ExprPtr Vec;
+public:
+    HorizontalExprAST(ReduceOp op, ExprPtr vec) : Op(op), Vec(std::move(vec)) {}
+
+    llvm::Value* codegen();
+    ExprPtr fold(ConstEval& eval);
+
+    void children(std::vector<ExprAST*>& out) {
+        out.push_back(Vec.get());
+    }
+};
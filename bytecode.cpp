@@ -0,0 +1,646 @@
+#include "bytecode.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+void BytecodeCompiler::declare(const std::string& name, size_t params) {
+	if (module.index.count(name))
+		throw std::runtime_error("[Bytecode] Redefinition of function: " + name);
+	if (module.functions.size() >= noRegister)
+		throw std::runtime_error("[Bytecode] Too many functions");
+
+	BytecodeFunction func;
+	func.name = name;
+	func.params = static_cast<uint16_t>(params);
+	module.index[name] = static_cast<uint16_t>(module.functions.size());
+	module.functions.push_back(std::move(func));
+}
+
+uint16_t BytecodeCompiler::function(const std::string& name, size_t nargs) const {
+	auto found = module.index.find(name);
+	if (found == module.index.end())
+		throw std::runtime_error("[Bytecode] Unknown function referenced: " + name);
+	if (module.functions[found->second].params != nargs)
+		throw std::runtime_error("[Bytecode] Incorrect number of arguments passed to function: " + name);
+	return found->second;
+}
+
+// @memo(capacity, overwrite|keep), checked by the parser
+void BytecodeCompiler::memoize(uint16_t function, const Annotation& memo) {
+	BytecodeFunction& func = module.functions[function];
+	auto table = std::make_shared<MemoTable>();
+	if (!memo.args.empty())
+		table->capacity = static_cast<uint64_t>(std::stod(memo.args[0]));
+	table->keep = memo.args.size() == 2 && memo.args[1] == "keep";
+	table->keys.resize(table->capacity * func.params);
+	table->values.resize(table->capacity);
+	table->full.resize(table->capacity);
+	func.memo = std::move(table);
+}
+
+uint16_t BytecodeCompiler::outline(const std::string& suffix, size_t params, int32_t reduce) {
+	if (module.functions.size() >= noRegister)
+		throw std::runtime_error("[Bytecode] Too many functions");
+
+	BytecodeFunction func;
+	func.name = current().name + suffix;
+	func.params = static_cast<uint16_t>(params);
+	func.reduce = reduce;
+	module.functions.push_back(std::move(func));
+	return static_cast<uint16_t>(module.functions.size() - 1);
+}
+
+BytecodeCompiler::Scope BytecodeCompiler::enter(uint16_t function, const std::vector<std::string>& names) {
+	Scope saved = std::move(scope);
+	scope = Scope();
+	scope.function = function;
+
+	const uint16_t params = current().params;
+	if (params >= noRegister)
+		throw std::runtime_error("[Bytecode] Too many arguments: " + current().name);
+	scope.next = scope.persistent = params;
+	current().registers = params;
+
+	// a repeated name is the later argument, like codegen
+	for (size_t i = 0; i < names.size(); i++)
+		scope.variables[names[i]] = static_cast<uint16_t>(i);
+	return saved;
+}
+
+void BytecodeCompiler::leave(uint16_t result, Scope saved) {
+	number(result, "FunctionAST");
+	// the value is read before the implicit sync, like the ret of codegen
+	result = stable(result);
+	syncAll();
+	emit(Opcode::Ret, result);
+	scope = std::move(saved);
+}
+
+uint16_t BytecodeCompiler::temp() {
+	if (scope.next >= noRegister)
+		throw std::runtime_error("[Bytecode] Too many registers in function: " + current().name);
+
+	const uint16_t reg = static_cast<uint16_t>(scope.next++);
+	current().registers = std::max<uint16_t>(current().registers, static_cast<uint16_t>(scope.next));
+	if (reg < scope.booleans.size())
+		scope.booleans[reg] = false;
+	return reg;
+}
+
+// never used before, still 0.0 from the frame entry like a fresh stack slot
+uint16_t BytecodeCompiler::persistent() {
+	scope.next = current().registers;
+	const uint16_t reg = temp();
+	scope.persistent = scope.next;
+	return reg;
+}
+
+uint16_t BytecodeCompiler::variable(const std::string& name) {
+	const uint16_t reg = persistent();
+	scope.variables[name] = reg;
+	return reg;
+}
+
+bool BytecodeCompiler::lookup(const std::string& name, uint16_t& reg) const {
+	auto found = scope.variables.find(name);
+	if (found == scope.variables.end())
+		return false;
+	reg = found->second;
+	return true;
+}
+
+void BytecodeCompiler::bind(const std::string& name, uint16_t reg) {
+	scope.variables[name] = reg;
+}
+
+void BytecodeCompiler::unbind(const std::string& name) {
+	scope.variables.erase(name);
+}
+
+uint16_t BytecodeCompiler::boolean(uint16_t reg) {
+	if (reg >= scope.booleans.size())
+		scope.booleans.resize(reg + 1u);
+	scope.booleans[reg] = true;
+	return reg;
+}
+
+bool BytecodeCompiler::isBoolean(uint16_t reg) const {
+	return reg < scope.booleans.size() && scope.booleans[reg];
+}
+
+uint16_t BytecodeCompiler::number(uint16_t reg, const std::string& node) const {
+	if (isBoolean(reg))
+		throw std::runtime_error("[" + node + "] Expected a number");
+	return reg;
+}
+
+// temporaries are written once, anything below "persistent" may be a variable
+uint16_t BytecodeCompiler::stable(uint16_t reg) {
+	if (reg >= scope.persistent)
+		return reg;
+	const uint16_t copy = temp();
+	emit(Opcode::Move, copy, reg);
+	return isBoolean(reg) ? boolean(copy) : copy;
+}
+
+void BytecodeCompiler::release(uint32_t mark) {
+	scope.next = std::max(mark, scope.persistent);
+}
+
+// bits, so -0.0 and NaN payloads stay apart
+uint16_t BytecodeCompiler::constant(double value) {
+	uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	auto found = scope.constants.find(bits);
+	if (found != scope.constants.end())
+		return found->second;
+
+	auto& constants = current().constants;
+	if (constants.size() >= noRegister)
+		throw std::runtime_error("[Bytecode] Too many constants in function: " + current().name);
+	constants.push_back(value);
+	const uint16_t index = static_cast<uint16_t>(constants.size() - 1);
+	scope.constants.emplace(bits, index);
+	return index;
+}
+
+uint16_t BytecodeCompiler::string(const std::string& str) {
+	auto found = std::find(module.strings.begin(), module.strings.end(), str);
+	if (found != module.strings.end())
+		return static_cast<uint16_t>(found - module.strings.begin());
+
+	if (module.strings.size() >= noRegister)
+		throw std::runtime_error("[Bytecode] Too many strings");
+	module.strings.push_back(str);
+	return static_cast<uint16_t>(module.strings.size() - 1);
+}
+
+size_t BytecodeCompiler::emit(Opcode op, uint16_t a, uint16_t b, uint16_t c) {
+	auto& code = current().code;
+	if (code.size() >= UINT32_MAX)
+		throw std::runtime_error("[Bytecode] Function too large: " + current().name);
+
+	Instr instr;
+	instr.op = op;
+	instr.a = a;
+	instr.b = b;
+	instr.c = c;
+	code.push_back(instr);
+	return code.size() - 1;
+}
+
+size_t BytecodeCompiler::here() const {
+	return module.functions[scope.function].code.size();
+}
+
+void BytecodeCompiler::patch(size_t jump, size_t target) {
+	Instr& instr = current().code[jump];
+	instr.b = static_cast<uint16_t>(target);
+	instr.c = static_cast<uint16_t>(target >> 16);
+}
+
+void BytecodeCompiler::addSite(uint16_t future, uint16_t target) {
+	scope.sites.push_back(Site{ future, target });
+}
+
+void BytecodeCompiler::syncAll() {
+	for (const auto& site : scope.sites)
+		emit(Opcode::Sync, site.future, site.target);
+}
+
+BytecodeModule compileBytecode(const std::vector<std::unique_ptr<FunctionAST>>& funcs) {
+	BytecodeModule module;
+	BytecodeCompiler bc(module);
+
+	for (const auto& func : funcs) {
+		if (func->getProto().getExtern())
+			throw std::runtime_error("[Bytecode] extern fn needs --jit or a compiled output: " + func->getProto().getName());
+		if (!func->isDeclaration())
+			bc.declare(func->getProto().getName(), func->getProto().getArgs().size());
+	}
+
+	for (const auto& func : funcs)
+		if (!func->isDeclaration())
+			func->emitBytecode(bc);
+
+	return module;
+}
+
+// Nodes
+
+static uint16_t loadConstant(BytecodeCompiler& bc, double value) {
+	const uint16_t reg = bc.temp();
+	bc.emit(Opcode::LoadK, reg, bc.constant(value));
+	return reg;
+}
+
+// no side effects, can't change a register read before it
+static bool isLeaf(const ExprAST* expr) {
+	return dynamic_cast<const NumberExprAST*>(expr) || dynamic_cast<const VariableExprAST*>(expr);
+}
+
+// Arguments in consecutive registers, each one copied as soon as it is known
+static uint16_t emitArgs(BytecodeCompiler& bc, const std::vector<ExprPtr>& args) {
+	if (args.empty())
+		return 0;
+
+	const uint16_t base = bc.temp();
+	for (size_t i = 1; i < args.size(); i++)
+		bc.temp();
+
+	for (size_t i = 0; i < args.size(); i++) {
+		const uint32_t mark = bc.mark();
+		bc.emit(Opcode::Move, static_cast<uint16_t>(base + i), bc.number(args[i]->emit(bc), "CallExprAST"));
+		bc.release(mark);
+	}
+	return base;
+}
+
+void FunctionAST::emitBytecode(BytecodeCompiler& bc) const {
+	const uint16_t function = bc.function(proto->getName(), proto->getArgs().size());
+	if (const Annotation* memo = getAnnotation("memo"))
+		bc.memoize(function, *memo);
+
+	auto saved = bc.enter(function, proto->getArgs());
+	bc.leave(body->emit(bc), std::move(saved));
+}
+
+uint16_t NumberExprAST::emit(BytecodeCompiler& bc) {
+	return loadConstant(bc, val);
+}
+
+uint16_t StringExprAST::emit(BytecodeCompiler&) {
+	throw std::runtime_error("[Bytecode] Strings can only be printed");
+}
+
+uint16_t VariableExprAST::emit(BytecodeCompiler& bc) {
+	uint16_t reg;
+	if (!bc.lookup(name, reg))
+		throw std::runtime_error("[VariableExprAST] Unknown variable name: " + name);
+	return reg;
+}
+
+static Opcode binaryOpcode(const std::string& op) {
+	Opcode code;
+	if (op == "+")
+		code = Opcode::Add;
+	else if (op == "-")
+		code = Opcode::Sub;
+	else if (op == "*")
+		code = Opcode::Mul;
+	else if (op == "/")
+		code = Opcode::Div;
+	else if (op == "==")
+		code = Opcode::Eq;
+	else if (op == "!=")
+		code = Opcode::Ne;
+	else if (op == "<")
+		code = Opcode::Lt;
+	else if (op == ">")
+		code = Opcode::Gt;
+	else if (op == "<=")
+		code = Opcode::Le;
+	else if (op == ">=")
+		code = Opcode::Ge;
+	else
+		throw std::runtime_error("[BinaryExprAST] Invalid binary operator: " + op);
+	return code;
+}
+
+// The result goes to the first temporary of the operands, so a chain of
+// operators needs a few registers however long it is
+uint16_t BinaryExprAST::emit(BytecodeCompiler& bc) {
+	std::vector<uint32_t> marks;
+	std::vector<size_t> skips;   // jumps over the rhs of && / ||
+	uint16_t result = 0;
+	walk(result,
+		[&bc](ExprPtr& operand, uint16_t& reg) {
+			reg = operand->emit(bc);
+			return true;
+		},
+		[&bc, &marks, &skips](BinaryExprAST& node, uint16_t& L) {
+			if (node.op == "&&" || node.op == "||") {
+				// L becomes the result, it is kept until the rhs is known
+				L = bc.stable(L);
+				bc.emit(Opcode::Bool, L, L);
+				skips.push_back(bc.emit(node.op == "&&" ? Opcode::JumpIfFalse : Opcode::JumpIfTrue, L));
+				marks.push_back(bc.mark());
+				return true;
+			}
+
+			if (!isLeaf(node.rhs.get()))
+				L = bc.stable(L);
+			marks.push_back(bc.markFrom(L));
+			return true;
+		},
+		[&bc, &marks, &skips](BinaryExprAST& node, uint16_t L, uint16_t R, uint16_t& dst) {
+			bc.release(marks.back());
+			marks.pop_back();
+
+			if (node.op == "&&" || node.op == "||") {
+				bc.emit(Opcode::Bool, L, R);
+				bc.patch(skips.back(), bc.here());
+				skips.pop_back();
+				dst = bc.boolean(L);
+				return true;
+			}
+
+			bc.number(L, "BinaryExprAST");
+			bc.number(R, "BinaryExprAST");
+			const Opcode code = binaryOpcode(node.op);
+			dst = bc.temp();
+			bc.emit(code, dst, L, R);
+			if (code != Opcode::Add && code != Opcode::Sub && code != Opcode::Mul && code != Opcode::Div)
+				bc.boolean(dst);
+			return true;
+		});
+	return result;
+}
+
+uint16_t NotExprAST::emit(BytecodeCompiler& bc) {
+	const uint16_t value = operand->emit(bc);
+	const uint16_t dst = bc.temp();
+	bc.emit(Opcode::Not, dst, value);
+	return bc.boolean(dst);
+}
+
+uint16_t CallExprAST::emit(BytecodeCompiler& bc) {
+	const uint16_t callee = bc.function(Callee, Args.size());
+	const uint16_t base = emitArgs(bc, Args);
+
+	const uint16_t dst = bc.temp();
+	bc.emit(Opcode::Call, dst, callee, base);
+	return dst;
+}
+
+uint16_t AssignmentExprAST::emit(BytecodeCompiler& bc) {
+	const uint16_t value = bc.number(val->emit(bc), "AssignmentExprAST");
+
+	uint16_t reg;
+	if (!bc.lookup(name, reg))
+		reg = bc.variable(name);
+	if (reg != value)
+		bc.emit(Opcode::Move, reg, value);
+	return reg;
+}
+
+uint16_t BlockExprAST::emit(BytecodeCompiler& bc) {
+	// if without else
+	if (expr.empty())
+		return loadConstant(bc, 0.0);
+
+	uint16_t last = 0;
+	for (size_t i = 0; i < expr.size(); i++) {
+		const uint32_t mark = bc.mark();
+		last = expr[i]->emit(bc);
+		if (i + 1 < expr.size())
+			bc.release(mark);
+	}
+	return last;
+}
+
+uint16_t PrintExprAST::emit(BytecodeCompiler& bc) {
+	const uint16_t dst = bc.temp();
+
+	if (auto* str = dynamic_cast<StringExprAST*>(expr.get())) {
+		if (str->getString().empty())
+			throw std::runtime_error("String is empty");
+		bc.emit(Opcode::PrintStr, dst, bc.string(str->getString()));
+	}
+	else
+		bc.emit(Opcode::PrintNum, dst, bc.number(expr->emit(bc), "PrintExprAST"));
+	return dst;
+}
+
+uint16_t ifExprAST::emit(BytecodeCompiler& bc) {
+	const uint16_t cond = Cond->emit(bc);
+	const uint16_t result = bc.temp();
+	const size_t toElse = bc.emit(Opcode::JumpIfFalse, cond);
+
+	uint32_t mark = bc.mark();
+	const uint16_t thenVal = Then->emit(bc);
+	const bool condition = bc.isBoolean(thenVal);
+	bc.emit(Opcode::Move, result, thenVal);
+	bc.release(mark);
+	const size_t toMerge = bc.emit(Opcode::Jump);
+
+	// both arms conditions or both numbers, a missing else is 0.0
+	bool elseCondition = false;
+	bc.patch(toElse, bc.here());
+	if (Else) {
+		mark = bc.mark();
+		const uint16_t elseVal = Else->emit(bc);
+		elseCondition = bc.isBoolean(elseVal);
+		bc.emit(Opcode::Move, result, elseVal);
+		bc.release(mark);
+	}
+	else
+		bc.emit(Opcode::LoadK, result, bc.constant(0.0));
+
+	if (condition != elseCondition)
+		throw std::runtime_error("[IfExprAST] Then and else give different types.");
+	bc.patch(toMerge, bc.here());
+	return condition ? bc.boolean(result) : result;
+}
+
+// A ladder of Eq + JumpIfTrue in source order, the first equal arm wins like the switch
+uint16_t MatchExprAST::emit(BytecodeCompiler& bc) {
+	const uint16_t subject = bc.number(Subject->emit(bc), "MatchExprAST");
+	const uint16_t result = bc.temp();
+
+	std::vector<size_t> toArm;
+	for (auto& arm : Arms) {
+		const uint32_t mark = bc.mark();
+		const uint16_t pattern = loadConstant(bc, arm.pattern);
+		const uint16_t equal = bc.temp();
+		bc.emit(Opcode::Eq, equal, subject, pattern);
+		toArm.push_back(bc.emit(Opcode::JumpIfTrue, equal));
+		bc.release(mark);
+	}
+
+	// arms give one type, a missing default is 0.0 of it
+	std::vector<size_t> toEnd;
+	int condition = -1;
+	auto emitArm = [&](ExprAST* body) {
+		const uint32_t mark = bc.mark();
+		if (body) {
+			const uint16_t value = body->emit(bc);
+			if (condition >= 0 && condition != bc.isBoolean(value))
+				throw std::runtime_error("[MatchExprAST] Arms give different types.");
+			condition = bc.isBoolean(value);
+			bc.emit(Opcode::Move, result, value);
+		}
+		else
+			bc.emit(Opcode::LoadK, result, bc.constant(0.0));
+		bc.release(mark);
+		toEnd.push_back(bc.emit(Opcode::Jump));
+	};
+
+	emitArm(Default.get());
+	for (size_t i = 0; i < Arms.size(); i++) {
+		bc.patch(toArm[i], bc.here());
+		emitArm(Arms[i].body.get());
+	}
+
+	for (size_t jump : toEnd)
+		bc.patch(jump, bc.here());
+	return condition > 0 ? bc.boolean(result) : result;
+}
+
+// Runs like the generated loop: body, step and end condition, then the next value
+uint16_t forExprAST::emit(BytecodeCompiler& bc) {
+	const uint16_t phi = bc.persistent();
+	bc.emit(Opcode::Move, phi, bc.number(Start->emit(bc), "ForExprAST"));
+
+	// the loop variable shadows an outer one until the loop ends
+	uint16_t outer;
+	const bool shadows = bc.lookup(VarName, outer);
+	const uint16_t var = bc.variable(VarName);
+
+	const size_t loop = bc.here();
+	bc.emit(Opcode::Move, var, phi);
+
+	const uint32_t mark = bc.mark();
+	Body->emit(bc);
+	bc.release(mark);
+
+	const uint16_t step = Step ? bc.number(Step->emit(bc), "ForExprAST") : loadConstant(bc, 1.0);
+	const uint16_t next = bc.temp();
+	bc.emit(Opcode::Add, next, phi, step);
+
+	const size_t exit = bc.emit(Opcode::JumpIfFalse, End->emit(bc));
+	bc.emit(Opcode::Move, phi, next);
+	bc.patch(bc.emit(Opcode::Jump), loop);
+	bc.patch(exit, bc.here());
+	bc.release(mark);
+
+	if (shadows)
+		bc.bind(VarName, outer);
+	else
+		bc.unbind(VarName);
+
+	return loadConstant(bc, 0.0);
+}
+
+// Same chunks as codegen: the body is outlined into a function of
+// [captured variables..., start, step, begin, end] and run by dalg_parfor
+uint16_t ParForExprAST::emit(BytecodeCompiler& bc) {
+	const uint16_t start = bc.stable(bc.number(Start->emit(bc), "ParForExprAST"));
+	const uint16_t end   = bc.stable(bc.number(End->emit(bc), "ParForExprAST"));
+	const uint16_t step  = Step ? bc.number(Step->emit(bc), "ParForExprAST") : loadConstant(bc, 1.0);
+
+	std::vector<std::string> captured;
+	std::vector<uint16_t> values;
+	for (const auto& var : bc.variables()) {
+		captured.push_back(var.first);
+		values.push_back(var.second);
+	}
+
+	// env -> [count, captured variables..., start, step]
+	const uint16_t env = bc.temp();
+	for (size_t i = 0; i < captured.size() + 2; i++)
+		bc.temp();
+
+	// trip count -> ceil((end - start) / step), empty when not positive
+	bc.emit(Opcode::Sub, env, end, start);
+	bc.emit(Opcode::Div, env, env, step);
+	bc.emit(Opcode::Ceil, env, env);
+	bc.emit(Opcode::Positive, env, env);
+
+	uint16_t slot = env + 1;
+	for (uint16_t value : values)
+		bc.emit(Opcode::Move, slot++, value);
+	bc.emit(Opcode::Move, slot++, start);
+	bc.emit(Opcode::Move, slot++, step);
+
+	// outlined body
+	const uint16_t chunk = bc.outline(".parfor", captured.size() + 4, Op);
+	auto saved = bc.enter(chunk, captured);
+
+	const uint16_t innerStart = static_cast<uint16_t>(captured.size());
+	const uint16_t innerStep  = innerStart + 1;
+	const uint16_t beginArg   = innerStart + 2;
+	const uint16_t endArg     = innerStart + 3;
+
+	double identity = 0.0;
+	switch (Op) {
+	case reduce_mul: identity = 1.0; break;
+	case reduce_min: identity = INFINITY; break;
+	case reduce_max: identity = -INFINITY; break;
+	default: break;
+	}
+
+	const uint16_t acc = bc.persistent();
+	bc.emit(Opcode::LoadK, acc, bc.constant(identity));
+	const uint16_t k = bc.persistent();
+	bc.emit(Opcode::Move, k, beginArg);
+	const uint16_t var = bc.variable(VarName);
+
+	const uint16_t more = bc.temp();
+	bc.emit(Opcode::Lt, more, k, endArg);
+	const size_t exit = bc.emit(Opcode::JumpIfFalse, more);
+
+	// x = start + k * step
+	const size_t loop = bc.here();
+	const uint16_t offset = bc.temp();
+	bc.emit(Opcode::Mul, offset, k, innerStep);
+	bc.emit(Opcode::Add, var, innerStart, offset);
+
+	const uint32_t mark = bc.mark();
+	const uint16_t bodyVal = Body->emit(bc);
+	switch (Op) {
+	case reduce_add: bc.emit(Opcode::Add, acc, acc, bodyVal); break;
+	case reduce_mul: bc.emit(Opcode::Mul, acc, acc, bodyVal); break;
+	case reduce_min: bc.emit(Opcode::Min, acc, acc, bodyVal); break;
+	case reduce_max: bc.emit(Opcode::Max, acc, acc, bodyVal); break;
+	default: break;
+	}
+	bc.release(mark);
+
+	bc.emit(Opcode::Add, k, k, loadConstant(bc, 1.0));
+	bc.emit(Opcode::Lt, more, k, endArg);
+	bc.patch(bc.emit(Opcode::JumpIfTrue, more), loop);
+	bc.patch(exit, bc.here());
+
+	bc.leave(acc, std::move(saved));
+
+	const uint16_t dst = bc.temp();
+	bc.emit(Opcode::ParFor, dst, chunk, env);
+	return dst;
+}
+
+uint16_t SpawnExprAST::emit(BytecodeCompiler& bc) {
+	const uint16_t callee = bc.function(Callee, Args.size());
+	const uint16_t base = emitArgs(bc, Args);
+
+	const uint16_t future = bc.persistent();
+	uint16_t target = noRegister;
+	if (!Target.empty() && !bc.lookup(Target, target))
+		target = bc.variable(Target);
+
+	// a site inside a loop waits for its previous call before spawning again
+	bc.emit(Opcode::Sync, future, target);
+	bc.emit(Opcode::Spawn, future, callee, base);
+	bc.addSite(future, target);
+
+	return loadConstant(bc, 0.0);
+}
+
+uint16_t SyncExprAST::emit(BytecodeCompiler& bc) {
+	bc.syncAll();
+	return loadConstant(bc, 0.0);
+}
+
+// every vector starts at a vecN, registers hold one double
+uint16_t VectorExprAST::emit(BytecodeCompiler&) {
+	throw std::runtime_error("[Bytecode] Vector values need --jit or a compiled output");
+}
+
+uint16_t YieldExprAST::emit(BytecodeCompiler&) {
+	throw std::runtime_error("[Bytecode] Generators need --jit or a compiled output");
+}
+
+uint16_t ForInExprAST::emit(BytecodeCompiler&) {
+	throw std::runtime_error("[Bytecode] Generators need --jit or a compiled output");
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#include "ast.h"
+
+// Register based bytecode for the interpreter (vm.h). Every function has a
+// frame of double registers, the arguments first; all of them start at 0.0
+// like the entry block slots of codegen. Futures of spawned calls are kept as
+// pointer bits in a register, 0.0 -> nothing pending.
+
+#define DALG_OPCODES(X) \
+    X(LoadK)        /* a = constants[b] */                                  \
+    X(Move)         /* a = b */                                             \
+    X(Add) X(Sub) X(Mul) X(Div)                                             \
+    X(Lt) X(Gt) X(Le) X(Ge) X(Eq) X(Ne)   /* a = b op c ? 1.0 : 0.0, fcmp o* */ \
+    X(Min) X(Max)   /* minnum / maxnum */                                   \
+    X(Ceil)         /* a = ceil(b) */                                       \
+    X(Positive)     /* a = b > 0 ? b : 0 */                                 \
+    X(Bool)         /* a = b != 0 ? 1.0 : 0.0, fcmp one like conditions */  \
+    X(Not)          /* a = b != 0 ? 0.0 : 1.0 */                            \
+    X(Jump)         /* pc = target */                                       \
+    X(JumpIfFalse)  /* if !(a != 0) pc = target */                          \
+    X(JumpIfTrue)   /* if a != 0 pc = target */                             \
+    X(Call)         /* a = functions[b](c, c + 1, ...) */                   \
+    X(Ret)          /* return a */                                          \
+    X(PrintNum)     /* printf("%f\n", a) */                                 \
+    X(PrintStr)     /* printf("%s\n", strings[b]) */                        \
+    X(Spawn)        /* a = dalg_spawn(functions[b], c, c + 1, ...) */       \
+    X(Sync)         /* dalg_sync(a, b == noRegister ? null : &b), a = 0 */  \
+    X(ParFor)       /* a = dalg_parfor(functions[b], c = [count, env...]) */
+
+enum class Opcode : uint8_t {
+#define DALG_OPCODE_ENUM(name) name,
+    DALG_OPCODES(DALG_OPCODE_ENUM)
+#undef DALG_OPCODE_ENUM
+};
+
+struct Instr {
+    Opcode   op;
+    uint16_t a = 0, b = 0, c = 0;
+};
+
+const uint16_t noRegister = 0xffff;
+
+// Jumps keep their target in b (low half) and c
+inline uint32_t jumpTarget(const Instr& instr) {
+    return instr.b | static_cast<uint32_t>(instr.c) << 16;
+}
+
+// @memo table of a function, probed like the generated wrapper (vm.cpp)
+struct MemoTable {
+    uint64_t capacity = 1024;
+    bool keep = false;
+    std::vector<uint64_t> keys;     // argument bits, capacity * params
+    std::vector<double>   values;
+    std::vector<uint8_t>  full;
+    std::mutex lock;
+};
+
+struct BytecodeFunction {
+    std::string name;
+    uint16_t params = 0;
+    uint16_t registers = 0;
+    int32_t  reduce = 0;   // ReduceOp of an outlined parfor body
+    std::vector<Instr>  code;
+    std::vector<double> constants;
+    std::shared_ptr<MemoTable> memo;   // @memo, shared by every thread
+};
+
+struct BytecodeModule {
+    std::vector<BytecodeFunction> functions;
+    std::vector<std::string> strings;
+    std::map<std::string, uint16_t> index;   // dalg functions by name
+};
+
+// Lowers FunctionASTs to one frame of registers per function, parfor
+// bodies are outlined into functions of their own like in codegen
+class BytecodeCompiler {
+public:
+    // spawned call of the current function, synced in order
+    struct Site {
+        uint16_t future;
+        uint16_t target;
+    };
+
+    // per function state, saved while a parfor body is outlined
+    struct Scope {
+        size_t function = 0;
+        std::map<std::string, uint16_t> variables;
+        std::vector<Site> sites;
+        uint32_t next = 0;         // first free register
+        uint32_t persistent = 0;   // registers below are never reused
+        std::unordered_map<uint64_t, uint16_t> constants;   // bits -> index
+        std::vector<bool> booleans;   // register -> holds a condition
+    };
+
+private:
+    BytecodeModule& module;
+    Scope scope;
+
+    BytecodeFunction& current() {
+        return module.functions[scope.function];
+    }
+
+public:
+    explicit BytecodeCompiler(BytecodeModule& m) : module(m) {}
+
+    // Every function gets its index before any body is compiled
+    void declare(const std::string& name, size_t params);
+    uint16_t function(const std::string& name, size_t nargs) const;
+    void memoize(uint16_t function, const Annotation& memo);
+
+    // New function for a parfor body, returns its index
+    uint16_t outline(const std::string& name, size_t params, int32_t reduce);
+
+    // Body of a function, the first names are its arguments in registers 0..n-1
+    Scope enter(uint16_t function, const std::vector<std::string>& names);
+    void leave(uint16_t result, Scope saved);
+
+    // Registers
+    uint16_t temp();
+    uint16_t persistent();                         // fresh 0.0 register, never reused
+    uint16_t variable(const std::string& name);   // new slot, shadows an older one
+    bool lookup(const std::string& name, uint16_t& reg) const;
+    void bind(const std::string& name, uint16_t reg);
+    void unbind(const std::string& name);
+
+    const std::map<std::string, uint16_t>& variables() const {
+        return scope.variables;
+    }
+
+    // Conditions (comparisons, !, && / ||) are i1 in codegen, they can't be used as numbers
+    uint16_t boolean(uint16_t reg);
+    bool isBoolean(uint16_t reg) const;
+    uint16_t number(uint16_t reg, const std::string& node) const;
+
+    // A copy when "reg" could be reassigned before it is used
+    uint16_t stable(uint16_t reg);
+
+    // Temporaries of a finished statement are reused unless it declared a variable
+    uint32_t mark() const {
+        return scope.next;
+    }
+    void release(uint32_t mark);
+
+    // Mark at "reg" when it is the last temporary, so it can be reused once read
+    uint32_t markFrom(uint16_t reg) const {
+        return reg >= scope.persistent && reg + 1u == scope.next ? reg : scope.next;
+    }
+
+    uint16_t constant(double value);
+    uint16_t string(const std::string& str);
+
+    size_t emit(Opcode op, uint16_t a = 0, uint16_t b = 0, uint16_t c = 0);
+    size_t here() const;
+    void patch(size_t jump, size_t target);   // jump -> target, see jumpTarget
+
+    // Spawn sites, like SpawnSites of codegen
+    void addSite(uint16_t future, uint16_t target);
+    void syncAll();
+};
+
+// Parsed sources -> bytecode, throws on anything the VM can't run
+BytecodeModule compileBytecode(const std::vector<std::unique_ptr<FunctionAST>>& funcs);
@@ -0,0 +1,48 @@
+#include "compiler.h"
+#include "consteval.h"
+#include "debuginfo.h"
+#include "parser.h"
+
+void compileSource(const std::string& code, const std::string& moduleName) {
+	initializeLLVM(moduleName);
+	initializeDebugInfo(moduleName);
+
+	auto tokens = lexer(code);
+
+	Parser parser(tokens);
+
+	// the whole file is parsed first, purity needs every body
+	std::vector<std::unique_ptr<FunctionAST>> funcs;
+	std::map<std::string, EffectSummary> summaries;
+
+	while (parser.getCurrentToken().token_type != tok_eof) {
+		auto func = parser.parseFunction();
+		if (!func)
+			throw std::runtime_error("Function parsing failed!");
+
+		if (func->hasSummary())
+			summaries[func->getProto().getName()] = func->summarize();
+		funcs.push_back(std::move(func));
+	}
+
+	const PurityTable purity = analyzePurity(summaries);
+	checkMemo(summaries, purity);
+	foldConstants(funcs, purity);
+	g_Purity = &purity;
+
+	try {
+		for (auto& func : funcs)
+			func->codegen();
+	}
+	catch (...) {
+		g_Purity = nullptr;
+		throw;
+	}
+	g_Purity = nullptr;
+	finalizeDebugInfo();
+
+	std::string verifyOutput;
+	llvm::raw_string_ostream rso(verifyOutput);
+	if (llvm::verifyModule(*g_Module, &rso))
+		throw std::runtime_error("[MODULE] " + rso.str());
+}
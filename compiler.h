@@ -0,0 +1,6 @@
+#pragma once
+
+#include <string>
+
+// Lexes, parses and generates a whole source into g_Module of the calling thread
+void compileSource(const std::string& code, const std::string& moduleName);
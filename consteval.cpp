@@ -0,0 +1,485 @@
+#include "consteval.h"
+
+#include <cstring>
+
+ConstEval::ConstEval(const std::vector<std::unique_ptr<FunctionAST>>& funcs, const PurityTable& table)
+	: purity(table) {
+	for (const auto& func : funcs)
+		if (!func->isDeclaration())
+			functions.emplace(func->getProto().getName(), func.get());
+}
+
+void ConstEval::beginFunction(const std::vector<std::string>& args) {
+	constants.clear();
+	declared.clear();
+	declared.insert(args.begin(), args.end());
+}
+
+bool ConstEval::evaluateConstant(ExprAST& expr, double& out) {
+	steps = 0;
+	ConstValue value;
+	if (!expr.evaluate(*this, value) || value.boolean)
+		return false;
+	out = value.number;
+	return true;
+}
+
+bool ConstEval::constant(const std::string& name, double& out) const {
+	auto found = constants.find(name);
+	if (found == constants.end())
+		return false;
+	out = found->second;
+	return true;
+}
+
+bool ConstEval::call(const std::string& name, const std::vector<double>& args, double& out) {
+	auto pure = purity.find(name);
+	if (pure == purity.end() || !pure->second.pure || frames.size() >= maxDepth)
+		return false;
+
+	auto found = functions.find(name);
+	const FunctionAST* func = found != functions.end() ? found->second : loader ? loader(name) : nullptr;
+	if (!func)
+		return false;
+
+	// bits, so -0.0 and NaN payloads stay apart
+	CallKey key{ name, {} };
+	for (double arg : args) {
+		uint64_t bits;
+		std::memcpy(&bits, &arg, sizeof(bits));
+		key.second.push_back(bits);
+	}
+
+	auto cached = results.find(key);
+	if (cached != results.end()) {
+		if (!cached->second)
+			return false;
+		out = *cached->second;
+		return true;
+	}
+
+	// a nested call may only have run out of steps, a top level one didn't fold at all
+	const bool outermost = frames.empty();
+	if (!func->evaluateCall(*this, args, out)) {
+		if (outermost)
+			results[key] = nullptr;
+		return false;
+	}
+
+	results[key] = std::make_unique<double>(out);
+	return true;
+}
+
+void ConstEval::declare(const std::string& name) {
+	if (constants.count(name))
+		throw std::runtime_error("[ConstEval] Assignment to const: " + name);
+	declared.insert(name);
+}
+
+void ConstEval::bindConstant(const std::string& name, double value) {
+	if (constants.count(name) || declared.count(name))
+		throw std::runtime_error("[ConstEval] const redefines variable: " + name);
+	constants[name] = value;
+}
+
+void foldConstants(std::vector<std::unique_ptr<FunctionAST>>& funcs, const PurityTable& purity) {
+	ConstEval eval(funcs, purity);
+	for (auto& func : funcs)
+		func->foldConstants(eval);
+}
+
+// Nodes
+
+static void foldInto(ExprPtr& expr, ConstEval& eval) {
+	if (!expr)
+		return;
+	if (ExprPtr folded = expr->fold(eval))
+		expr = std::move(folded);
+}
+
+static ExprPtr number(double value, const ExprAST& from) {
+	auto num = std::make_unique<NumberExprAST>(value);
+	num->setLocation(from.getLocation());
+	return num;
+}
+
+// fcmp one, false for NaN like every other comparison
+static bool isTrue(const ConstValue& value) {
+	return value.boolean ? value.number != 0.0 : (value.number < 0.0 || value.number > 0.0);
+}
+
+void FunctionAST::foldConstants(ConstEval& eval) {
+	eval.beginFunction(proto->getArgs());
+	foldInto(body, eval);
+}
+
+bool FunctionAST::evaluateCall(ConstEval& eval, const std::vector<double>& args, double& out) const {
+	const auto& names = proto->getArgs();
+	if (!body || names.size() != args.size())
+		return false;
+
+	std::map<std::string, double> vars;
+	for (size_t i = 0; i < args.size(); i++)
+		vars[names[i]] = args[i];
+
+	eval.pushFrame(std::move(vars));
+	ConstValue result;
+	const bool known = body->evaluate(eval, result);
+	eval.popFrame();
+
+	// an i1 can't be returned as double
+	if (!known || result.boolean)
+		return false;
+	out = result.number;
+	return true;
+}
+
+bool NumberExprAST::evaluate(ConstEval& eval, ConstValue& out) {
+	out = ConstValue{ val, false };
+	return eval.step();
+}
+
+bool VariableExprAST::evaluate(ConstEval& eval, ConstValue& out) {
+	if (!eval.step())
+		return false;
+
+	out = ConstValue();
+	if (auto* vars = eval.frame()) {
+		auto found = vars->find(name);
+		if (found == vars->end())
+			return false;
+		out.number = found->second;
+		return true;
+	}
+	return eval.constant(name, out.number);
+}
+
+ExprPtr VariableExprAST::fold(ConstEval& eval) {
+	double value;
+	if (eval.constant(name, value))
+		return number(value, *this);
+	return nullptr;
+}
+
+static bool binaryOp(const std::string& op, const ConstValue& l, const ConstValue& r, ConstValue& out) {
+	if (l.boolean || r.boolean)
+		return false;
+
+	const double a = l.number;
+	const double b = r.number;
+	out = ConstValue();
+
+	if (op == "+")
+		out.number = a + b;
+	else if (op == "-")
+		out.number = a - b;
+	else if (op == "*")
+		out.number = a * b;
+	else if (op == "/")
+		out.number = a / b;
+	else {
+		// ordered comparisons like the fcmp of codegen
+		out.boolean = true;
+		if (op == "==")
+			out.number = a == b;
+		else if (op == "!=")
+			out.number = a < b || a > b;
+		else if (op == "<")
+			out.number = a < b;
+		else if (op == ">")
+			out.number = a > b;
+		else if (op == "<=")
+			out.number = a <= b;
+		else if (op == ">=")
+			out.number = a >= b;
+		else
+			return false;
+	}
+	return true;
+}
+
+bool BinaryExprAST::evaluate(ConstEval& eval, ConstValue& out) {
+	// && / || whose lhs decided, its rhs is walked without being evaluated
+	BinaryExprAST* decided = nullptr;
+
+	return walk(out,
+		[&eval, &decided](ExprPtr& operand, ConstValue& value) {
+			return decided || operand->evaluate(eval, value);
+		},
+		[&eval, &decided](BinaryExprAST& node, const ConstValue& l) {
+			if (decided)
+				return true;
+			if ((node.op == "&&" && !isTrue(l)) || (node.op == "||" && isTrue(l)))
+				decided = &node;
+			return eval.step();
+		},
+		[&decided](BinaryExprAST& node, const ConstValue& l, const ConstValue& r, ConstValue& value) {
+			if (decided == &node) {
+				decided = nullptr;
+				value = ConstValue{ node.op == "||" ? 1.0 : 0.0, true };
+				return true;
+			}
+			if (decided)
+				return true;
+			if (node.op == "&&" || node.op == "||") {
+				value = ConstValue{ isTrue(r) ? 1.0 : 0.0, true };
+				return true;
+			}
+			return binaryOp(node.op, l, r, value);
+		});
+}
+
+ExprPtr BinaryExprAST::fold(ConstEval& eval) {
+	// nothing to combine, only the operands are replaced
+	char unused;
+	walk(unused,
+		[&eval](ExprPtr& operand, char&) {
+			foldInto(operand, eval);
+			return true;
+		},
+		[](BinaryExprAST&, char) {
+			return true;
+		},
+		[](BinaryExprAST&, char, char, char&) {
+			return true;
+		});
+	return nullptr;
+}
+
+bool NotExprAST::evaluate(ConstEval& eval, ConstValue& out) {
+	ConstValue value;
+	if (!eval.step() || !operand->evaluate(eval, value))
+		return false;
+	out = ConstValue{ isTrue(value) ? 0.0 : 1.0, true };
+	return true;
+}
+
+ExprPtr NotExprAST::fold(ConstEval& eval) {
+	foldInto(operand, eval);
+	return nullptr;
+}
+
+bool CallExprAST::evaluate(ConstEval& eval, ConstValue& out) {
+	if (!eval.step())
+		return false;
+
+	std::vector<double> args;
+	for (auto& arg : Args) {
+		ConstValue value;
+		if (!arg->evaluate(eval, value) || value.boolean)
+			return false;
+		args.push_back(value.number);
+	}
+
+	out = ConstValue();
+	return eval.call(Callee, args, out.number);
+}
+
+ExprPtr CallExprAST::fold(ConstEval& eval) {
+	for (auto& arg : Args)
+		foldInto(arg, eval);
+
+	double value;
+	if (eval.evaluateConstant(*this, value))
+		return number(value, *this);
+	return nullptr;
+}
+
+bool AssignmentExprAST::evaluate(ConstEval& eval, ConstValue& out) {
+	if (!eval.step() || !eval.frame() || !val->evaluate(eval, out) || out.boolean)
+		return false;
+
+	(*eval.frame())[name] = out.number;
+	return true;
+}
+
+ExprPtr AssignmentExprAST::fold(ConstEval& eval) {
+	foldInto(val, eval);
+
+	if (!constant) {
+		eval.declare(name);
+		return nullptr;
+	}
+
+	double value;
+	if (!eval.evaluateConstant(*val, value))
+		throw std::runtime_error("[ConstEval] const is not known at compile time: " + name);
+	eval.bindConstant(name, value);
+	val = number(value, *val);
+	return nullptr;
+}
+
+bool BlockExprAST::evaluate(ConstEval& eval, ConstValue& out) {
+	if (!eval.step() || expr.empty())
+		return false;
+
+	for (auto& e : expr)
+		if (!e->evaluate(eval, out))
+			return false;
+	return true;
+}
+
+ExprPtr BlockExprAST::fold(ConstEval& eval) {
+	for (auto& e : expr)
+		foldInto(e, eval);
+	return nullptr;
+}
+
+ExprPtr PrintExprAST::fold(ConstEval& eval) {
+	foldInto(expr, eval);
+	return nullptr;
+}
+
+bool ifExprAST::evaluate(ConstEval& eval, ConstValue& out) {
+	ConstValue cond;
+	if (!eval.step() || !Cond->evaluate(eval, cond))
+		return false;
+
+	if (isTrue(cond)) {
+		if (!Then->evaluate(eval, out))
+			return false;
+	}
+	else if (Else) {
+		if (!Else->evaluate(eval, out))
+			return false;
+	}
+	else
+		out = ConstValue();
+
+	// the merge phi is a double
+	return !out.boolean;
+}
+
+ExprPtr ifExprAST::fold(ConstEval& eval) {
+	foldInto(Cond, eval);
+	foldInto(Then, eval);
+	foldInto(Else, eval);
+	return nullptr;
+}
+
+// The first arm equal to the subject, the default or 0.0 otherwise
+bool MatchExprAST::evaluate(ConstEval& eval, ConstValue& out) {
+	ConstValue subject;
+	if (!eval.step() || !Subject->evaluate(eval, subject))
+		return false;
+
+	for (auto& arm : Arms)
+		if (arm.pattern == subject.number)
+			return arm.body->evaluate(eval, out);
+
+	if (Default)
+		return Default->evaluate(eval, out);
+	out = ConstValue();
+	return true;
+}
+
+ExprPtr MatchExprAST::fold(ConstEval& eval) {
+	foldInto(Subject, eval);
+	for (auto& arm : Arms)
+		foldInto(arm.body, eval);
+	foldInto(Default, eval);
+	return nullptr;
+}
+
+// Runs like the generated loop: body, step and end condition, then the next value
+bool forExprAST::evaluate(ConstEval& eval, ConstValue& out) {
+	ConstValue start;
+	if (!eval.step() || !eval.frame() || !Start->evaluate(eval, start) || start.boolean)
+		return false;
+
+	// the loop variable shadows an outer one until the loop ends
+	auto outer = eval.frame()->find(VarName);
+	const bool shadows = outer != eval.frame()->end();
+	const double saved = shadows ? outer->second : 0.0;
+
+	bool known = true;
+	double var = start.number;
+	while (known) {
+		(*eval.frame())[VarName] = var;
+
+		ConstValue body, step, end;
+		step.number = 1.0;
+		if (!eval.step() || !Body->evaluate(eval, body) ||
+			(Step && (!Step->evaluate(eval, step) || step.boolean)) ||
+			!End->evaluate(eval, end)) {
+			known = false;
+			break;
+		}
+
+		if (!isTrue(end))
+			break;
+		var = var + step.number;
+	}
+
+	if (shadows)
+		(*eval.frame())[VarName] = saved;
+	else
+		eval.frame()->erase(VarName);
+
+	out = ConstValue();
+	return known;
+}
+
+ExprPtr forExprAST::fold(ConstEval& eval) {
+	foldInto(Start, eval);
+	foldInto(End, eval);
+	foldInto(Step, eval);
+	eval.declare(VarName);
+	foldInto(Body, eval);
+	return nullptr;
+}
+
+ExprPtr ParForExprAST::fold(ConstEval& eval) {
+	foldInto(Start, eval);
+	foldInto(End, eval);
+	foldInto(Step, eval);
+	eval.declare(VarName);
+	foldInto(Body, eval);
+	return nullptr;
+}
+
+// generator bodies and their loops aren't evaluated, only folded
+ExprPtr YieldExprAST::fold(ConstEval& eval) {
+	foldInto(Value, eval);
+	return nullptr;
+}
+
+ExprPtr ForInExprAST::fold(ConstEval& eval) {
+	for (auto& arg : Args)
+		foldInto(arg, eval);
+	eval.declare(VarName);
+	foldInto(Body, eval);
+	return nullptr;
+}
+
+ExprPtr SpawnExprAST::fold(ConstEval& eval) {
+	for (auto& arg : Args)
+		foldInto(arg, eval);
+	if (!Target.empty())
+		eval.declare(Target);
+	return nullptr;
+}
+
+// vectors aren't evaluated, only their lanes and indices are folded
+ExprPtr VectorExprAST::fold(ConstEval& eval) {
+	for (auto& lane : Lanes)
+		foldInto(lane, eval);
+	return nullptr;
+}
+
+ExprPtr LaneExprAST::fold(ConstEval& eval) {
+	foldInto(Vec, eval);
+	foldInto(Index, eval);
+	return nullptr;
+}
+
+ExprPtr ShuffleExprAST::fold(ConstEval& eval) {
+	for (auto& source : Sources)
+		foldInto(source, eval);
+	return nullptr;
+}
+
+ExprPtr HorizontalExprAST::fold(ConstEval& eval) {
+	foldInto(Vec, eval);
+	return nullptr;
+}
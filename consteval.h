@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+#include "ast.h"
+
+// Frontend interpreter. Calls of pure functions with constant arguments and
+// "const" bindings are evaluated before codegen and replaced with numbers,
+// using the same IEEE double operations the generated code would run.
+// Anything it can't prove (side effects, unknown variables, too many steps
+// or calls too deep) is left to the generated code.
+class ConstEval {
+public:
+    // Bodies that aren't kept in memory (stream.h), null -> no body
+    using FunctionLoader = std::function<const FunctionAST*(const std::string& name)>;
+
+private:
+    std::map<std::string, const FunctionAST*> functions;
+    FunctionLoader loader;
+    const PurityTable& purity;
+
+    std::vector<std::map<std::string, double>> frames;   // calls being evaluated
+    std::map<std::string, double> constants;             // const bindings of the function being folded
+    std::set<std::string> declared;                      // its other variables so far
+
+    // pure calls by their bit exact arguments, null -> not constant
+    using CallKey = std::pair<std::string, std::vector<uint64_t>>;
+    std::map<CallKey, std::unique_ptr<double>> results;
+    long long steps = 0;
+
+public:
+    static const size_t    maxDepth = 256;       // nested calls
+    static const long long maxSteps = 1000000;   // nodes per folded expression
+
+    ConstEval(const std::vector<std::unique_ptr<FunctionAST>>& funcs, const PurityTable& table);
+    ConstEval(FunctionLoader load, const PurityTable& table) : loader(std::move(load)), purity(table) {}
+
+    // Before folding a function body
+    void beginFunction(const std::vector<std::string>& args);
+
+    // Value of a folded expression, no variables but const bindings
+    bool evaluateConstant(ExprAST& expr, double& out);
+
+    bool step() {
+        return ++steps <= maxSteps;
+    }
+
+    // Innermost call, null while folding. Nested calls move the frames,
+    // so don't keep the pointer across an evaluate.
+    std::map<std::string, double>* frame() {
+        return frames.empty() ? nullptr : &frames.back();
+    }
+
+    void pushFrame(std::map<std::string, double> vars) {
+        frames.push_back(std::move(vars));
+    }
+
+    void popFrame() {
+        frames.pop_back();
+    }
+
+    bool constant(const std::string& name, double& out) const;
+
+    // Pure function with a body, within the limits
+    bool call(const std::string& name, const std::vector<double>& args, double& out);
+
+    // Names seen while folding, const bindings can't be assigned or shadowed
+    void declare(const std::string& name);
+    void bindConstant(const std::string& name, double value);
+};
+
+// Runs after analyzePurity, before codegen
+void foldConstants(std::vector<std::unique_ptr<FunctionAST>>& funcs, const PurityTable& purity);
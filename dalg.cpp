@@ -0,0 +1,158 @@
+#include "dalg.h"
+
+#include <mutex>
+#include <vector>
+
+#include <llvm/Support/xxhash.h>
+
+#include "compiler.h"
+#include "jit.h"
+#include "lrucache.h"
+#include "utility.h"
+
+namespace {
+
+	// One compiled source, shared by every session that compiled the same text
+	struct CompiledUnit {
+		std::string source;
+		DalgJIT     jit;
+		std::map<std::string, std::pair<void*, size_t>> functions;   // name -> address, argument count
+	};
+
+	// Host CPU and features, so O3 can vectorize @batch loops
+	std::unique_ptr<llvm::TargetMachine> createHostMachine() {
+		auto builder = llvm::orc::JITTargetMachineBuilder::detectHost();
+		if (!builder)
+			throw std::runtime_error("[dalg] " + llvm::toString(builder.takeError()));
+		auto tm = builder->createTargetMachine();
+		if (!tm)
+			throw std::runtime_error("[dalg] " + llvm::toString(tm.takeError()));
+		return std::move(*tm);
+	}
+
+	// A TargetMachine isn't thread safe, every compile borrows one of its own
+	std::mutex machineLock;
+	std::vector<std::unique_ptr<llvm::TargetMachine>> machines;
+
+	class HostMachine {
+		std::unique_ptr<llvm::TargetMachine> machine;
+
+	public:
+		HostMachine() {
+			{
+				std::lock_guard<std::mutex> guard(machineLock);
+				if (!machines.empty()) {
+					machine = std::move(machines.back());
+					machines.pop_back();
+				}
+			}
+			if (!machine)
+				machine = createHostMachine();
+		}
+
+		~HostMachine() {
+			std::lock_guard<std::mutex> guard(machineLock);
+			machines.push_back(std::move(machine));
+		}
+
+		llvm::TargetMachine* get() const {
+			return machine.get();
+		}
+	};
+
+	// the least recently used unit goes when a new one doesn't fit, sessions
+	// that compiled it keep their reference
+	const size_t cacheCapacity = 64;
+	std::mutex cacheLock;
+	LruCache<std::shared_ptr<CompiledUnit>> cache(cacheCapacity);
+
+	std::shared_ptr<CompiledUnit> compileUnit(const std::string& source) {
+		const uint64_t key = llvm::xxHash64(source);
+		{
+			std::lock_guard<std::mutex> guard(cacheLock);
+			std::shared_ptr<CompiledUnit>* cached = cache.find(key);
+			if (cached && (*cached)->source == source)
+				return *cached;
+		}
+
+		// codegen state is thread_local, so sessions compile in parallel
+		auto unit = std::make_shared<CompiledUnit>();
+		unit->source = source;
+
+		compileSource(source, "libdalg");
+		g_Module->setDataLayout(unit->jit.getDataLayout());
+		HostMachine machine;
+		optimize(machine.get());
+
+		std::map<std::string, size_t> exported;
+		for (const auto& F : g_Module->functions())
+			if (!F.isDeclaration() && F.hasExternalLinkage())
+				exported[F.getName().str()] = F.arg_size();
+
+		unit->jit.addModule();
+
+		// resolve everything now, lookups are plain map reads afterwards
+		for (const auto& F : exported)
+			unit->functions[F.first] = { unit->jit.lookup(F.first), F.second };
+
+		std::lock_guard<std::mutex> guard(cacheLock);
+		cache.insert(key, unit);
+		return unit;
+	}
+
+}
+
+struct dalg_session {
+	std::mutex lock;
+	std::vector<std::shared_ptr<CompiledUnit>> units;
+	std::string error;
+};
+
+dalg_session* dalg_session_create(void) {
+	return new dalg_session;
+}
+
+void dalg_session_destroy(dalg_session* session) {
+	delete session;
+}
+
+int dalg_compile(dalg_session* session, const char* source) {
+	try {
+		auto unit = compileUnit(source);
+
+		std::lock_guard<std::mutex> guard(session->lock);
+		session->units.push_back(std::move(unit));
+		session->error.clear();
+		return 0;
+	}
+	catch (const std::exception& err) {
+		std::lock_guard<std::mutex> guard(session->lock);
+		session->error = err.what();
+		return 1;
+	}
+}
+
+const char* dalg_error(dalg_session* session) {
+	std::lock_guard<std::mutex> guard(session->lock);
+	return session->error.c_str();
+}
+
+void* dalg_lookup(dalg_session* session, const char* name, int nargs) {
+	std::lock_guard<std::mutex> guard(session->lock);
+
+	for (auto unit = session->units.rbegin(); unit != session->units.rend(); ++unit) {
+		auto found = (*unit)->functions.find(name);
+		if (found != (*unit)->functions.end())
+			return found->second.second == static_cast<size_t>(nargs) ? found->second.first : nullptr;
+	}
+	return nullptr;
+}
+
+void* dalg_lookup_batch(dalg_session* session, const char* name, int nargs) {
+	return dalg_lookup(session, (std::string(name) + "_batch").c_str(), nargs + 2);
+}
+
+void dalg_cache_clear(void) {
+	std::lock_guard<std::mutex> guard(cacheLock);
+	cache.clear();
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+// libdalg -> dalg as an embedded expression engine
+//
+// A session compiles sources into native code and hands out plain function
+// pointers, calling one costs the same as any indirect call. Sessions are
+// independent and can be used from many threads at once. Compiled sources
+// are cached process-wide by their text, so compiling the same source again
+// (in any session) doesn't run LLVM.
+//
+//   dalg::Session session;
+//   session.compile("fn v(a, b, c) { a * b / c + 4 }");
+//   auto v = session.lookup<double(double, double, double)>("v");
+//   double r = v(1, 2, 3);
+
+#ifdef __cplusplus
+#include <stdexcept>
+#include <cstddef>
+#include <string>
+#include <type_traits>
+
+extern "C" {
+#endif
+
+    typedef struct dalg_session dalg_session;
+
+    dalg_session* dalg_session_create(void);
+    void          dalg_session_destroy(dalg_session* session);
+
+    // 0 on success, otherwise dalg_error has the message
+    int           dalg_compile(dalg_session* session, const char* source);
+    const char*   dalg_error(dalg_session* session);
+
+    // Function compiled in this session with "nargs" arguments, null when missing.
+    // Later sources shadow earlier ones with the same function name.
+    void*         dalg_lookup(dalg_session* session, const char* name, int nargs);
+
+    // Columnar wrapper of an @batch function:
+    // void name_batch(const double* a, const double* b, ..., double* out, size_t n)
+    void*         dalg_lookup_batch(dalg_session* session, const char* name, int nargs);
+
+    // Drops every cached source not used by a live session
+    void          dalg_cache_clear(void);
+
+#ifdef __cplusplus
+}
+
+namespace dalg {
+
+    template <typename Fn>
+    struct batch_of;
+
+    // double(double, double) -> void(const double*, const double*, double*, size_t)
+    template <typename... Args>
+    struct batch_of<double(Args...)> {
+        using type = void(typename std::conditional<true, const double*, Args>::type..., double*, size_t);
+    };
+
+    class Session {
+        dalg_session* session;
+
+    public:
+        Session() : session(dalg_session_create()) {}
+        ~Session() { dalg_session_destroy(session); }
+
+        Session(const Session&) = delete;
+        Session& operator=(const Session&) = delete;
+
+        void compile(const std::string& source) {
+            if (dalg_compile(session, source.c_str()) != 0)
+                throw std::runtime_error(dalg_error(session));
+        }
+
+        // session.lookup<double(double, double)>("add")
+        template <typename Fn>
+        Fn* lookup(const std::string& name) {
+            void* address = dalg_lookup(session, name.c_str(), arity(static_cast<Fn*>(nullptr)));
+            if (!address)
+                throw std::runtime_error("[dalg] Unknown function: " + name);
+            return reinterpret_cast<Fn*>(address);
+        }
+
+        // session.lookupBatch<double(double, double)>("add") for "@batch fn add(a, b)"
+        template <typename Fn>
+        typename batch_of<Fn>::type* lookupBatch(const std::string& name) {
+            void* address = dalg_lookup_batch(session, name.c_str(), arity(static_cast<Fn*>(nullptr)));
+            if (!address)
+                throw std::runtime_error("[dalg] Unknown batch function: " + name);
+            return reinterpret_cast<typename batch_of<Fn>::type*>(address);
+        }
+
+    private:
+        template <typename... Args>
+        static int arity(double (*)(Args...)) {
+            static_assert(std::is_same<double (*)(Args...), double (*)(typename std::conditional<true, double, Args>::type...)>::value,
+                "dalg functions only take doubles");
+            return sizeof...(Args);
+        }
+    };
+
+}
+#endif
@@ -0,0 +1,115 @@
+#include "debuginfo.h"
+
+#include <llvm/IR/DIBuilder.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+
+namespace {
+
+	struct DebugScope {
+		llvm::DISubprogram* subprogram;
+		llvm::DebugLoc      saved;   // builder location of the enclosing function
+	};
+
+	struct DebugInfo {
+		std::unique_ptr<llvm::DIBuilder> builder;
+		llvm::DICompileUnit* unit = nullptr;
+		llvm::DIFile*        file = nullptr;
+		llvm::DIType*        doubleTy = nullptr;
+		std::vector<DebugScope> scopes;
+	};
+
+	thread_local DebugInfo debug;
+
+}
+
+void initializeDebugInfo(const std::string& filename) {
+	resetDebugInfo();
+	if (!g_Options.debugInfo)
+		return;
+
+	g_Module->addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
+	g_Module->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
+
+	llvm::SmallString<128> path(filename);
+	llvm::sys::fs::make_absolute(path);
+
+	debug.builder  = std::make_unique<llvm::DIBuilder>(*g_Module);
+	debug.file     = debug.builder->createFile(llvm::sys::path::filename(path), llvm::sys::path::parent_path(path));
+	debug.unit     = debug.builder->createCompileUnit(llvm::dwarf::DW_LANG_C, debug.file, "dalg", false, "", 0);
+	debug.doubleTy = debug.builder->createBasicType("double", 64, llvm::dwarf::DW_ATE_float);
+}
+
+void resetDebugInfo() {
+	debug = DebugInfo();
+}
+
+void finalizeDebugInfo() {
+	if (debug.builder)
+		debug.builder->finalize();
+}
+
+void beginDebugFunction(llvm::Function* func, const SourceLocation& loc) {
+	if (!debug.builder)
+		return;
+
+	// double f(double, ...), outlined bodies only show their return type
+	llvm::SmallVector<llvm::Metadata*, 8> types{ debug.doubleTy };
+	for (const auto& arg : func->args())
+		if (arg.getType()->isDoubleTy())
+			types.push_back(debug.doubleTy);
+
+	auto flags = llvm::DISubprogram::SPFlagDefinition;
+	if (func->hasLocalLinkage())
+		flags |= llvm::DISubprogram::SPFlagLocalToUnit;
+
+	llvm::DISubprogram* sp = debug.builder->createFunction(debug.file, func->getName(), llvm::StringRef(), debug.file,
+		loc.line, debug.builder->createSubroutineType(debug.builder->getOrCreateTypeArray(types)), loc.line,
+		llvm::DINode::FlagPrototyped, flags);
+	func->setSubprogram(sp);
+
+	debug.scopes.push_back({ sp, g_Builder->getCurrentDebugLocation() });
+
+	// prologue has no location
+	g_Builder->SetCurrentDebugLocation(llvm::DebugLoc());
+}
+
+void endDebugFunction() {
+	if (!debug.builder || debug.scopes.empty())
+		return;
+
+	g_Builder->SetCurrentDebugLocation(debug.scopes.back().saved);
+	debug.scopes.pop_back();
+}
+
+void emitLocation(const ExprAST* expr) {
+	if (!debug.builder || debug.scopes.empty())
+		return;
+
+	const SourceLocation& loc = expr->getLocation();
+	if (loc.line == 0)
+		return;
+
+	g_Builder->SetCurrentDebugLocation(llvm::DILocation::get(*g_Context, loc.line, loc.column, debug.scopes.back().subprogram));
+}
+
+void emitDeclare(llvm::AllocaInst* alloca, const std::string& name, unsigned argNo, const SourceLocation& loc) {
+	if (!debug.builder || debug.scopes.empty())
+		return;
+
+	// vecN -> vector type of N doubles for the debugger
+	llvm::DIType* type = debug.doubleTy;
+	if (auto* vecTy = llvm::dyn_cast<llvm::FixedVectorType>(alloca->getAllocatedType())) {
+		const unsigned lanes = vecTy->getNumElements();
+		type = debug.builder->createVectorType(lanes * 64, 64 * lanes, debug.doubleTy,
+			debug.builder->getOrCreateArray({ debug.builder->getOrCreateSubrange(0, lanes) }));
+	}
+
+	llvm::DISubprogram* sp = debug.scopes.back().subprogram;
+	llvm::DILocalVariable* var = argNo
+		? debug.builder->createParameterVariable(sp, name, argNo, debug.file, loc.line, type, true)
+		: debug.builder->createAutoVariable(sp, name, debug.file, loc.line, type, true);
+
+	debug.builder->insertDeclare(alloca, var, debug.builder->createExpression(),
+		llvm::DILocation::get(*g_Context, loc.line, loc.column, sp), alloca->getParent());
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "ast.h"
+
+// -g -> DWARF line tables for g_Module of the calling thread, one compile
+// unit per module. Every function is a no-op while debug info is off.
+
+// After initializeLLVM, starts the compile unit of "filename"
+void initializeDebugInfo(const std::string& filename);
+
+// Drops the compile unit, initializeLLVM calls it for the old module
+void resetDebugInfo();
+
+// Before the module is verified or written
+void finalizeDebugInfo();
+
+// Subprogram of a function whose body is generated next (outlined parfor
+// bodies too), end restores the location of the enclosing function
+void beginDebugFunction(llvm::Function* func, const SourceLocation& loc);
+void endDebugFunction();
+
+// Builder location <- the node, nodes without a location keep the last one
+void emitLocation(const ExprAST* expr);
+
+// Local variable (argNo 0) or argument (argNo > 0) stored in "alloca"
+void emitDeclare(llvm::AllocaInst* alloca, const std::string& name, unsigned argNo, const SourceLocation& loc);
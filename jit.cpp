@@ -0,0 +1,500 @@
+#include "jit.h"
+
+#include <chrono>
+#include <mutex>
+
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+
+#include "debuginfo.h"
+#include "utility.h"
+
+namespace {
+
+	void check(llvm::Error err) {
+		if (err)
+			throw std::runtime_error("[DalgJIT] " + llvm::toString(std::move(err)));
+	}
+
+	template <typename T>
+	T check(llvm::Expected<T> val) {
+		if (!val)
+			throw std::runtime_error("[DalgJIT] " + llvm::toString(val.takeError()));
+		return std::move(*val);
+	}
+
+	template <typename T>
+	T& check(llvm::Expected<T&> val) {
+		if (!val)
+			throw std::runtime_error("[DalgJIT] " + llvm::toString(val.takeError()));
+		return *val;
+	}
+
+	// A stub was called but its body failed to compile
+	void lazyCallError() {
+		llvm::errs() << "[DalgJIT] Lazy compilation failed, aborting.\n";
+		std::exit(1);
+	}
+
+	// /tmp/perf-PID.map -> "start size name" per function, read by perf report
+	class PerfMapListener : public llvm::JITEventListener {
+		std::mutex lock;
+		FILE* file = nullptr;
+
+	public:
+		~PerfMapListener() override {
+			if (file)
+				std::fclose(file);
+		}
+
+		void notifyObjectLoaded(ObjectKey, const llvm::object::ObjectFile& obj, const llvm::RuntimeDyld::LoadedObjectInfo& info) override {
+			// the debug object has the load addresses
+			auto loaded = info.getObjectForDebug(obj);
+			const llvm::object::ObjectFile& debugObj = loaded.getBinary() ? *loaded.getBinary() : obj;
+
+			std::lock_guard<std::mutex> guard(lock);
+			if (!file) {
+				const std::string path = "/tmp/perf-" + std::to_string(llvm::sys::Process::getProcessId()) + ".map";
+				file = std::fopen(path.c_str(), "w");
+				if (!file)
+					return;
+			}
+
+			for (const auto& sym : llvm::object::computeSymbolSizes(debugObj)) {
+				auto type = sym.first.getType();
+				if (!type || *type != llvm::object::SymbolRef::ST_Function) {
+					if (!type)
+						llvm::consumeError(type.takeError());
+					continue;
+				}
+
+				auto name = sym.first.getName();
+				auto address = sym.first.getAddress();
+				if (!name || !address) {
+					if (!name)
+						llvm::consumeError(name.takeError());
+					if (!address)
+						llvm::consumeError(address.takeError());
+					continue;
+				}
+
+				std::fprintf(file, "%llx %llx %s\n", static_cast<unsigned long long>(*address),
+					static_cast<unsigned long long>(sym.second), name->str().c_str());
+			}
+			std::fflush(file);
+		}
+	};
+
+	// Host CPU and features, or the --march CPU without the host features
+	llvm::Expected<llvm::orc::JITTargetMachineBuilder> targetMachineBuilder() {
+		auto builder = llvm::orc::JITTargetMachineBuilder::detectHost();
+		if (builder && !g_Options.march.empty() && g_Options.march != "native") {
+			builder->setCPU(g_Options.march);
+			builder->getFeatures() = llvm::SubtargetFeatures();
+		}
+		return builder;
+	}
+
+	// Module flag "dalg.tier": 0 -> baseline, 1 -> tier-up, none -> eager module
+	llvm::CodeGenOpt::Level codegenLevel(const llvm::Module& M) {
+		auto* tier = llvm::mdconst::extract_or_null<llvm::ConstantInt>(M.getModuleFlag("dalg.tier"));
+		if (!tier)
+			return llvm::CodeGenOpt::Default;
+		return tier->isZero() ? llvm::CodeGenOpt::None : llvm::CodeGenOpt::Aggressive;
+	}
+
+	// A target machine per module, so lazy compiles on pool threads and the
+	// tier-up thread never share one
+	class TieredCompiler : public llvm::orc::IRCompileLayer::IRCompiler {
+		llvm::orc::JITTargetMachineBuilder builder;
+
+	public:
+		explicit TieredCompiler(llvm::orc::JITTargetMachineBuilder b)
+			: IRCompiler(llvm::orc::irManglingOptionsFromTargetOptions(b.getOptions())), builder(std::move(b)) {}
+
+		llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> operator()(llvm::Module& M) override {
+			llvm::orc::JITTargetMachineBuilder moduleBuilder = builder;
+			moduleBuilder.setCodeGenOptLevel(codegenLevel(M));
+
+			auto machine = moduleBuilder.createTargetMachine();
+			if (!machine)
+				return machine.takeError();
+			return llvm::orc::SimpleCompiler(**machine)(M);
+		}
+	};
+
+	// dalg_jit_tier_up(jit, name), called once per baseline function
+	void tierUpHook(DalgJIT* jit, const char* name) {
+		jit->requestTierUp(name);
+	}
+
+	// entry -> count the call, the threshold-th one asks for the optimized version
+	void insertEntryCounter(llvm::Function* F, DalgJIT* jit, uint64_t threshold) {
+		llvm::Module& M = *F->getParent();
+		llvm::Type* i64Ty   = llvm::Type::getInt64Ty(M.getContext());
+		llvm::Type* i8PtrTy = llvm::Type::getInt8PtrTy(M.getContext());
+
+		auto* calls = new llvm::GlobalVariable(M, i64Ty, false, llvm::GlobalValue::InternalLinkage,
+			llvm::ConstantInt::get(i64Ty, 0), F->getName() + ".calls");
+
+		// after the entry block slots
+		llvm::BasicBlock& entry = F->getEntryBlock();
+		auto split = entry.begin();
+		while (llvm::isa<llvm::AllocaInst>(*split))
+			++split;
+
+		llvm::IRBuilder<> builder(&*split);
+		llvm::Value* count = builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, calls, builder.getInt64(1),
+			llvm::MaybeAlign(8), llvm::AtomicOrdering::Monotonic);
+		llvm::Value* hot = builder.CreateICmpEQ(count, builder.getInt64(threshold - 1), "hot");
+
+		llvm::MDNode* unlikely = llvm::MDBuilder(M.getContext()).createBranchWeights(1, 1 << 20);
+		builder.SetInsertPoint(llvm::SplitBlockAndInsertIfThen(hot, &*split, false, unlikely));
+
+		llvm::FunctionCallee hook = M.getOrInsertFunction("dalg_jit_tier_up", builder.getVoidTy(), i8PtrTy, i8PtrTy);
+		builder.CreateCall(hook, { builder.CreateIntToPtr(builder.getInt64(reinterpret_cast<uintptr_t>(jit)), i8PtrTy),
+			builder.CreateGlobalStringPtr(F->getName(), "tier_name") });
+	}
+
+	// Recursive calls of a baseline function go through its stub, so they reach the new code too
+	void callThroughStub(llvm::Function* F, llvm::JITTargetAddress stub) {
+		llvm::Constant* target = llvm::ConstantExpr::getIntToPtr(
+			llvm::ConstantInt::get(llvm::Type::getInt64Ty(F->getContext()), stub), F->getType());
+
+		for (llvm::Use& use : llvm::make_early_inc_range(F->uses()))
+			if (auto* call = llvm::dyn_cast<llvm::CallInst>(use.getUser()))
+				if (call->getFunction() == F && call->isCallee(&use))
+					call->setCalledOperand(target);
+	}
+
+	// One dalg function, kept as AST until something calls it
+	class FunctionUnit : public llvm::orc::MaterializationUnit {
+		DalgJIT& jit;
+		std::unique_ptr<FunctionAST> func;
+		std::string file;
+
+	public:
+		FunctionUnit(DalgJIT& j, std::unique_ptr<FunctionAST> f, const std::string& source, llvm::orc::SymbolFlagsMap symbols)
+			: MaterializationUnit(Interface(std::move(symbols), nullptr)),
+			  jit(j), func(std::move(f)), file(source) {}
+
+		llvm::StringRef getName() const override {
+			return "dalg.FunctionUnit";
+		}
+
+		void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> R) override {
+			jit.emit(std::move(R), std::move(func), file);
+		}
+
+		void discard(const llvm::orc::JITDylib&, const llvm::orc::SymbolStringPtr&) override {
+			func.reset();
+		}
+	};
+
+}
+
+DalgJIT::DalgJIT(uint64_t threshold) : tierThreshold(threshold) {
+	static std::once_flag initTarget;
+	std::call_once(initTarget, []() {
+		llvm::InitializeNativeTarget();
+		llvm::InitializeNativeTargetAsmPrinter();
+		llvm::InitializeNativeTargetAsmParser();
+	});
+
+	// perf report names JIT functions through the map, with -g gdb and perf
+	// annotate see the generated code too (a perf enabled LLVM for the latter)
+	llvm::orc::LLJITBuilder builder;
+	builder.setJITTargetMachineBuilder(check(targetMachineBuilder()));
+	builder.setObjectLinkingLayerCreator([](llvm::orc::ExecutionSession& ES, const llvm::Triple&) {
+		auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(ES,
+			[]() { return std::make_unique<llvm::SectionMemoryManager>(); });
+
+		if (g_Options.perfMap) {
+			static PerfMapListener perfMap;
+			layer->registerJITEventListener(perfMap);
+		}
+		if (g_Options.debugInfo) {
+			layer->registerJITEventListener(*llvm::JITEventListener::createGDBRegistrationListener());
+			if (llvm::JITEventListener* perf = llvm::JITEventListener::createPerfJITEventListener())
+				layer->registerJITEventListener(*perf);
+		}
+		return layer;
+	});
+	builder.setCompileFunctionCreator([](llvm::orc::JITTargetMachineBuilder machineBuilder)
+		-> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+		return std::make_unique<TieredCompiler>(std::move(machineBuilder));
+	});
+	jit = check(builder.create());
+
+	auto& ES = jit->getExecutionSession();
+	const auto& triple = jit->getTargetTriple();
+
+	callThrough = check(llvm::orc::createLocalLazyCallThroughManager(triple, ES,
+		llvm::pointerToJITTargetAddress(&lazyCallError)));
+	stubs = llvm::orc::createLocalIndirectStubsManagerBuilder(triple)();
+
+	// printf and friends from the host process, the runtime from this binary
+	auto& main = jit->getMainJITDylib();
+	main.addGenerator(check(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+		jit->getDataLayout().getGlobalPrefix())));
+
+	const auto flags = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+	llvm::orc::SymbolMap runtime;
+	runtime[jit->mangleAndIntern("dalg_parfor")] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&dalg_parfor), flags);
+	runtime[jit->mangleAndIntern("dalg_spawn")]  = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&dalg_spawn), flags);
+	runtime[jit->mangleAndIntern("dalg_sync")]   = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&dalg_sync), flags);
+	runtime[jit->mangleAndIntern("dalg_memo_register")] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&dalg_memo_register), flags);
+	runtime[jit->mangleAndIntern("dalg_prof_enter")] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&dalg_prof_enter), flags);
+	runtime[jit->mangleAndIntern("dalg_prof_exit")]  = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&dalg_prof_exit), flags);
+	runtime[jit->mangleAndIntern("dalg_jit_tier_up")] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&tierUpHook), flags);
+	check(main.define(llvm::orc::absoluteSymbols(std::move(runtime))));
+
+	// bodies call each other through the stubs in main, never directly
+	impl = &check(jit->createJITDylib("dalg.impl"));
+	impl->setLinkOrder({ { &main, llvm::orc::JITDylibLookupFlags::MatchAllSymbols } }, false);
+}
+
+DalgJIT::~DalgJIT() {
+	{
+		std::lock_guard<std::mutex> guard(tierLock);
+		tierStop = true;
+	}
+	tierWake.notify_all();
+	if (tierThread.joinable())
+		tierThread.join();
+}
+
+void DalgJIT::addFunction(std::unique_ptr<FunctionAST> func, const std::string& file) {
+	const auto& proto = func->getProto();
+	const std::string name = proto.getName();
+
+	auto known = prototypes.find(name);
+	if (known != prototypes.end() && known->second.args.size() != proto.getArgs().size())
+		throw std::runtime_error("[DalgJIT] Conflicting argument count for function: " + name);
+	prototypes[name] = proto.info();
+
+	// extern fn resolve against the process, pure ones keep their callers pure
+	if (func->isDeclaration()) {
+		if (func->hasSummary()) {
+			std::lock_guard<std::mutex> guard(purityLock);
+			summaries[name] = func->summarize();
+			purity.reset();
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(purityLock);
+		summaries[name] = func->summarize();
+		purity.reset();
+	}
+
+	// the function and its @batch wrapper come from the same module
+	const auto flags = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+	llvm::orc::SymbolFlagsMap symbols;
+	llvm::orc::SymbolAliasMap aliases;
+
+	std::vector<std::string> names{ name };
+	if (func->hasAnnotation("batch"))
+		names.push_back(name + "_batch");
+
+	for (const auto& n : names) {
+		auto symbol = jit->mangleAndIntern(n);
+		symbols[symbol] = flags;
+		aliases[symbol] = llvm::orc::SymbolAliasMapEntry(symbol, flags);
+	}
+
+	check(impl->define(std::make_unique<FunctionUnit>(*this, std::move(func), file, std::move(symbols))));
+	check(jit->getMainJITDylib().define(llvm::orc::lazyReexports(*callThrough, *stubs, *impl, std::move(aliases))));
+}
+
+void DalgJIT::addModule() {
+	if (g_Module->getDataLayout().isDefault())
+		g_Module->setDataLayout(jit->getDataLayout());
+
+	g_Builder.reset();
+	check(jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(g_Module), llvm::orc::ThreadSafeContext(std::move(g_Context)))));
+}
+
+void* DalgJIT::lookup(const std::string& name) {
+	auto symbol = check(jit->lookup(name));
+	return llvm::jitTargetAddressToPointer<void*>(symbol.getAddress());
+}
+
+// Runs on the thread that made the first call, so the thread_local
+// codegen state is free to use
+void DalgJIT::emit(std::unique_ptr<llvm::orc::MaterializationResponsibility> R, std::unique_ptr<FunctionAST> func, const std::string& file) {
+	const std::string name = func->getProto().getName();
+	std::shared_ptr<const PurityTable> table = currentPurity();
+
+	// a @memo table lives in the module of its wrapper, so those stay baseline
+	const bool tiered = tierThreshold > 0 && !func->hasAnnotation("memo");
+
+	try {
+		initializeLLVM(name);
+		initializeDebugInfo(file);
+		g_Module->setDataLayout(jit->getDataLayout());
+
+		g_Prototypes = &prototypes;
+		g_Purity = table.get();
+		llvm::Function* F = func->codegen();
+		g_Prototypes = nullptr;
+		g_Purity = nullptr;
+		if (!F)
+			throw std::runtime_error("[DalgJIT] Codegen failed: " + name);
+		if (tiered) {
+			insertEntryCounter(F, this, tierThreshold);
+			if (auto stub = stubs->findStub(*jit->mangleAndIntern(name), true))
+				callThroughStub(F, stub.getAddress());
+			g_Module->addModuleFlag(llvm::Module::Warning, "dalg.tier", 0u);
+		}
+		finalizeDebugInfo();
+
+		std::string verifyOutput;
+		llvm::raw_string_ostream rso(verifyOutput);
+		if (llvm::verifyModule(*g_Module, &rso))
+			throw std::runtime_error("[DalgJIT] " + name + " -> " + rso.str());
+		lowerCoroutines();
+	}
+	catch (const std::exception& err) {
+		g_Prototypes = nullptr;
+		g_Purity = nullptr;
+		jit->getExecutionSession().reportError(llvm::make_error<llvm::StringError>(err.what(), llvm::inconvertibleErrorCode()));
+		R->failMaterialization();
+		return;
+	}
+
+	if (tiered) {
+		std::lock_guard<std::mutex> guard(tierLock);
+		bodies[name] = TierBody{ std::move(func), file };
+	}
+
+	g_Builder.reset();
+	llvm::orc::ThreadSafeModule module(std::move(g_Module), llvm::orc::ThreadSafeContext(std::move(g_Context)));
+	jit->getIRTransformLayer().emit(std::move(R), std::move(module));
+}
+
+std::shared_ptr<const PurityTable> DalgJIT::currentPurity() {
+	std::lock_guard<std::mutex> guard(purityLock);
+	if (!purity)
+		purity = std::make_shared<const PurityTable>(analyzePurity(summaries));
+	return purity;
+}
+
+// Runs on a thread executing baseline code, the work is left to the tier-up thread
+void DalgJIT::requestTierUp(const std::string& name) {
+	std::lock_guard<std::mutex> guard(tierLock);
+	if (tierStop)
+		return;
+	tierQueue.push_back(name);
+	if (!tierThread.joinable())
+		tierThread = std::thread(&DalgJIT::tierLoop, this);
+	tierWake.notify_one();
+}
+
+void DalgJIT::tierLoop() {
+	// host CPU and features (or --march), so O3 can vectorize
+	std::unique_ptr<llvm::TargetMachine> machine;
+	auto machineBuilder = targetMachineBuilder();
+	if (machineBuilder) {
+		machineBuilder->setCodeGenOptLevel(llvm::CodeGenOpt::Aggressive);
+		if (auto created = machineBuilder->createTargetMachine())
+			machine = std::move(*created);
+		else
+			llvm::consumeError(created.takeError());
+	}
+	else
+		llvm::consumeError(machineBuilder.takeError());
+
+	std::unique_lock<std::mutex> guard(tierLock);
+	while (true) {
+		tierWake.wait(guard, [this]() { return tierStop || !tierQueue.empty(); });
+		if (tierStop)
+			return;
+
+		const std::string name = std::move(tierQueue.front());
+		tierQueue.pop_front();
+		guard.unlock();
+
+		// the baseline version keeps running when this fails
+		try {
+			tierUp(name, machine.get());
+		}
+		catch (const std::exception& err) {
+			std::cerr << "[DalgJIT] Tier-up of " << name << " failed: " << err.what() << "\n";
+		}
+		guard.lock();
+	}
+}
+
+// The body again at O3 in a JITDylib of its own, then the stubs in main
+// (the function and its @batch wrapper) are pointed at the new code
+void DalgJIT::tierUp(const std::string& name, llvm::TargetMachine* machine) {
+	const auto start = std::chrono::steady_clock::now();
+
+	FunctionAST* func = nullptr;
+	std::string file;
+	{
+		std::lock_guard<std::mutex> guard(tierLock);
+		auto body = bodies.find(name);
+		if (body == bodies.end())
+			return;
+		func = body->second.func.get();
+		file = body->second.file;
+	}
+
+	std::shared_ptr<const PurityTable> table = currentPurity();
+	std::vector<std::string> names;
+
+	try {
+		initializeLLVM(name + ".tier1");
+		initializeDebugInfo(file);
+		g_Module->setDataLayout(jit->getDataLayout());
+
+		g_Prototypes = &prototypes;
+		g_Purity = table.get();
+		llvm::Function* F = func->codegen();
+		g_Prototypes = nullptr;
+		g_Purity = nullptr;
+		if (!F)
+			throw std::runtime_error("Codegen failed");
+		finalizeDebugInfo();
+
+		g_Module->addModuleFlag(llvm::Module::Warning, "dalg.tier", 1u);
+		optimize(machine);
+
+		for (const auto& n : { name, name + "_batch" })
+			if (llvm::Function* defined = g_Module->getFunction(n))
+				if (!defined->isDeclaration())
+					names.push_back(n);
+	}
+	catch (...) {
+		g_Prototypes = nullptr;
+		g_Purity = nullptr;
+		throw;
+	}
+
+	// bodies call each other through the stubs in main, like the baseline
+	auto& dylib = check(jit->createJITDylib("dalg.tier1." + name));
+	dylib.setLinkOrder({ { &jit->getMainJITDylib(), llvm::orc::JITDylibLookupFlags::MatchAllSymbols } }, false);
+
+	g_Builder.reset();
+	check(jit->addIRModule(dylib, llvm::orc::ThreadSafeModule(std::move(g_Module), llvm::orc::ThreadSafeContext(std::move(g_Context)))));
+
+	for (const auto& n : names) {
+		auto symbol = check(jit->lookup(dylib, n));
+		check(stubs->updatePointer(*jit->mangleAndIntern(n), symbol.getAddress()));
+	}
+
+	const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	if (g_Options.instrument)
+		dalg_prof_tier(name.c_str(), static_cast<int64_t>(tierThreshold), ms);
+}
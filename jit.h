@@ -0,0 +1,76 @@
+#pragma once
+
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/LazyReexports.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "ast.h"
+
+// ORC based JIT. Functions are added as ASTs; a function is lowered to IR
+// and compiled only when it is called the first time, through a lazy
+// reexport stub in the main JITDylib.
+//
+// With a tier-up threshold that first version is a fast baseline (no IR
+// passes, no codegen optimizations) counting its calls. The call that reaches
+// the threshold queues the function, a background thread compiles it again
+// at O3 and points its stub at the new code.
+class DalgJIT {
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    std::unique_ptr<llvm::orc::LazyCallThroughManager> callThrough;
+    std::unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+    llvm::orc::JITDylib* impl = nullptr;   // function bodies, looked up by the stubs
+
+    PrototypeTable prototypes;
+
+    // recomputed on the first emit after new functions were added
+    std::mutex purityLock;
+    std::map<std::string, EffectSummary> summaries;
+    std::shared_ptr<const PurityTable> purity;
+
+    // tier-up, 0 -> off
+    uint64_t tierThreshold;
+    struct TierBody {
+        std::unique_ptr<FunctionAST> func;
+        std::string file;
+    };
+    std::mutex tierLock;
+    std::condition_variable tierWake;
+    std::map<std::string, TierBody> bodies;   // baseline functions, kept for recompiling
+    std::deque<std::string> tierQueue;
+    bool tierStop = false;
+    std::thread tierThread;
+
+    std::shared_ptr<const PurityTable> currentPurity();
+    void tierLoop();
+    void tierUp(const std::string& name, llvm::TargetMachine* machine);
+
+public:
+    explicit DalgJIT(uint64_t tierThreshold = 0);
+    ~DalgJIT();
+
+    // Nothing is compiled here, declarations only extend the prototype table.
+    // "file" names the source in the debug info (-g).
+    void addFunction(std::unique_ptr<FunctionAST> func, const std::string& file = "dalg");
+
+    // Takes g_Module (and its context) of the calling thread and compiles it
+    // eagerly, lookup then returns the real function addresses
+    void addModule();
+
+    // Address of the function (or its stub), calling a stub compiles the body
+    void* lookup(const std::string& name);
+
+    const llvm::DataLayout& getDataLayout() const {
+        return jit->getDataLayout();
+    }
+
+    // Called by baseline code when a function reached the threshold
+    void requestTierUp(const std::string& name);
+
+    // Called by the materialization unit on the first call of a function
+    void emit(std::unique_ptr<llvm::orc::MaterializationResponsibility> R, std::unique_ptr<FunctionAST> func, const std::string& file);
+};
@@ -1,10 +1,10 @@
 #include "lexer.h"
   
-std::vector<TokenStore> lexer(const std::string& source) {
+std::vector<TokenStore> lexer(const std::string& source, int line) {
 
     std::vector<TokenStore> tokenz;
     size_t i = 0;
-    int line = 1, column = 1;
+    int column = 1;
 
     while (i < source.length()) {
         char c = source[i];
@@ -31,10 +31,10 @@ std::vector<TokenStore> lexer(const std::string& source) {
             continue;
         }
                  
-        // keywords
-        if (isalpha(c)) {
+        // keywords and identifiers, digits after the first letter -> vec4, _ alone -> match default
+        if (isalpha(c) || c == '_') {
             std::string identifier;
-            while (i < source.length() && (isalpha(source[i]) || source[i] == '_')) {
+            while (i < source.length() && (isalnum(source[i]) || source[i] == '_')) {
                 identifier += source[i];
                 i++;
                 column++;
@@ -94,6 +94,12 @@ std::vector<TokenStore> lexer(const std::string& source) {
                 column += 2;
                 continue;
             }
+            else if (i + 1 < source.length() && source[i + 1] == '>') {
+                tokenz.push_back({ "=>", tok_arrow, column, line });
+                i += 2;
+                column += 2;
+                continue;
+            }
             else {
                 tokenz.push_back({ "=", tok_equals, column, line });
                 i++;
@@ -110,14 +116,24 @@ std::vector<TokenStore> lexer(const std::string& source) {
                 continue;
             }
             else {
-                std::string unknown(1, source[i]);
-                tokenz.push_back({ unknown, tok_unk, column, line });
+                tokenz.push_back({ "!", tok_not, column, line });
                 i++;
                 column++;
                 continue;
             }
         }
 
+        // Logical Operators
+        if ((c == '&' || c == '|') && i + 1 < source.length() && source[i + 1] == c) {
+            if (c == '&')
+                tokenz.push_back({ "&&", tok_and, column, line });
+            else
+                tokenz.push_back({ "||", tok_or, column, line });
+            i += 2;
+            column += 2;
+            continue;
+        }
+
         if (c == '<') {
             if (i + 1 < source.length() && source[i + 1] == '=') {
                 tokenz.push_back({ "<=", tok_le, column, line });
@@ -148,6 +164,20 @@ std::vector<TokenStore> lexer(const std::string& source) {
             }
         }
 
+        // Annotations -> @batch
+        if (c == '@') {
+            std::string annotation;
+            i++;
+            column++;
+            while (i < source.length() && (isalpha(source[i]) || source[i] == '_')) {
+                annotation += source[i];
+                i++;
+                column++;
+            }
+            tokenz.push_back({ annotation, tok_annotation, column, line });
+            continue;
+        }
+
         // Special characters
         switch (c) {
         case '{':
@@ -176,6 +206,12 @@ std::vector<TokenStore> lexer(const std::string& source) {
             column++;
             continue;
         case '-':
+            if (i + 1 < source.length() && source[i + 1] == '>') {
+                tokenz.push_back({ "->", tok_thin_arrow, column, line });
+                i += 2;
+                column += 2;
+                continue;
+            }
             tokenz.push_back({ "-", tok_minus, column, line });
             i++;
             column++;
@@ -200,6 +236,11 @@ std::vector<TokenStore> lexer(const std::string& source) {
             i++;
             column++;
             continue;
+        case ':':
+            tokenz.push_back({ ":", tok_colon, column, line });
+            i++;
+            column++;
+            continue;
         }
 
         // unknowns
@@ -34,12 +34,25 @@ enum Token : uint8_t {
     tok_gt,            // >
     tok_le,            // <=
     tok_ge,            // >=
-    // bitwise Operators
-    tok_or,            // || // wip
-    tok_and,           // && // wip
-    tok_not,           // && // wip
+    // Logical Operators
+    tok_or,            // ||
+    tok_and,           // &&
+    tok_not,           // !
     tok_for,           //wip
     tok_while,         //wip  
+    tok_parfor,
+    tok_reduce,
+    tok_spawn,
+    tok_sync,
+    tok_annotation,    // @batch
+    tok_const,
+    tok_match,
+    tok_arrow,         // =>
+    tok_yield,
+    tok_in,
+    tok_extern,
+    tok_colon,         // :
+    tok_thin_arrow,    // ->
     tok_comment_debug
 };
 
@@ -59,6 +72,16 @@ const std::unordered_map<std::string, Token> keywords{
     {"else",   tok_else},
     {"for",    tok_for},
     {"while",  tok_while},
+    {"parfor", tok_parfor},
+    {"reduce", tok_reduce},
+    {"spawn",  tok_spawn},
+    {"sync",   tok_sync},
+    {"const",  tok_const},
+    {"match",  tok_match},
+    {"yield",  tok_yield},
+    {"in",     tok_in},
+    {"extern", tok_extern},
 };
 
-std::vector<TokenStore> lexer(const std::string& source);
\ No newline at end of file
+// "line" -> line number of the first character, for sources read in pieces
+std::vector<TokenStore> lexer(const std::string& source, int line = 1);
\ No newline at end of file
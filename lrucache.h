@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+// Hash -> value with a fixed number of entries, inserting into a full cache
+// drops the least recently used one. Not thread safe, callers hold a lock.
+template <typename Value>
+class LruCache {
+    using Entry = std::pair<uint64_t, Value>;
+
+    size_t capacity;
+    std::list<Entry> entries;   // most recently used first
+    std::unordered_map<uint64_t, typename std::list<Entry>::iterator> index;
+
+public:
+    explicit LruCache(size_t capacity) : capacity(capacity) {}
+
+    // Null when missing, a hit becomes the most recently used entry
+    Value* find(uint64_t key) {
+        auto found = index.find(key);
+        if (found == index.end())
+            return nullptr;
+        entries.splice(entries.begin(), entries, found->second);
+        return &found->second->second;
+    }
+
+    void insert(uint64_t key, Value value) {
+        auto found = index.find(key);
+        if (found != index.end()) {
+            found->second->second = std::move(value);
+            entries.splice(entries.begin(), entries, found->second);
+            return;
+        }
+
+        entries.emplace_front(key, std::move(value));
+        index[key] = entries.begin();
+        while (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+
+    void clear() {
+        index.clear();
+        entries.clear();
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+};
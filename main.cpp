@@ -1,43 +1,231 @@
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/Path.h>
+
+#include "compiler.h"
+#include "consteval.h"
 #include "parser.h"
 #include "utility.h"
+#include "jit.h"
+#include "server.h"
+#include "staticlib.h"
+#include "stream.h"
+#include "vm.h"
+
+void compile_Run(const std::string& filename) {
+	compileSource(readFile(filename), filename);
+}
+
+// Compiles one file on the calling thread, returns the module as bitcode
+std::string compileToBitcode(const std::string& filename) {
+	compile_Run(filename);
 
-void initializeLLVM() {
+	std::string buffer;
+	llvm::raw_string_ostream os(buffer);
+	llvm::WriteBitcodeToFile(*g_Module, os);
+	os.flush();
 
-	g_Module = std::make_unique<llvm::Module>("TEST", Context);
-	if (!g_Module)
-		std::cout << "[initializeLLVM] Module is failed!";
+	g_Module.reset();
+	return buffer;
 }
 
+// Every file is compiled into its own module on a pool of "jobs" threads,
+// then the modules are linked into g_Module of the calling thread.
+void compileAndLink(const std::vector<std::string>& inputs, unsigned jobs) {
 
-void compile_Run(const std::string& filename) {
-	initializeLLVM();
+	std::vector<std::string> bitcode(inputs.size());
+	std::vector<std::string> errors(inputs.size());
+	std::atomic<size_t> next{ 0 };
+
+	auto worker = [&]() {
+		for (size_t i = next++; i < inputs.size(); i = next++) {
+			try {
+				bitcode[i] = compileToBitcode(inputs[i]);
+			}
+			catch (const std::exception& err) {
+				errors[i] = inputs[i] + ": " + err.what();
+			}
+		}
+	};
+
+	jobs = std::max(1u, std::min<unsigned>(jobs, inputs.size()));
+	std::vector<std::thread> pool;
+	for (unsigned j = 1; j < jobs; j++)
+		pool.emplace_back(worker);
+	worker();
+	for (auto& t : pool)
+		t.join();
 
-	const auto code = readFile(filename);
-	auto tokens = lexer(code);
+	for (const auto& err : errors)
+		if (!err.empty())
+			throw std::runtime_error(err);
 
-	Parser parser(tokens);
+	initializeLLVM("dalg");
+	llvm::Linker linker(*g_Module);
 
-	while (parser.getCurrentToken().token_type != tok_eof) {
-		auto func = parser.parseFunction();
-		if (!func)
-			throw std::runtime_error("Function parsing failed!");
+	for (size_t i = 0; i < inputs.size(); i++) {
+		auto mod = llvm::parseBitcodeFile(llvm::MemoryBufferRef(bitcode[i], inputs[i]), *g_Context);
+		if (!mod)
+			throw std::runtime_error("[Linker] " + inputs[i] + ": " + llvm::toString(mod.takeError()));
 
-		func->codegen();
+		if (linker.linkInModule(std::move(*mod)))
+			throw std::runtime_error("[Linker] Linking failed: " + inputs[i]);
 
+		bitcode[i].clear();
 	}
 
 	std::string verifyOutput;
 	llvm::raw_string_ostream rso(verifyOutput);
 	if (llvm::verifyModule(*g_Module, &rso))
 		std::cerr << "[MODULE] ->" << verifyOutput << "\n";
+}
+
+// Parses every file, constant folding calls across files
+void parseProgram(const std::vector<std::string>& inputs, std::vector<std::unique_ptr<FunctionAST>>& funcs, std::vector<std::string>& files) {
+	std::map<std::string, EffectSummary> summaries;
 
+	for (const auto& filename : inputs) {
+		const auto code = readFile(filename);
+		auto tokens = lexer(code);
+
+		Parser parser(tokens);
+
+		while (parser.getCurrentToken().token_type != tok_eof) {
+			auto func = parser.parseFunction();
+			if (!func)
+				throw std::runtime_error("Function parsing failed!");
+
+			if (func->hasSummary())
+				summaries[func->getProto().getName()] = func->summarize();
+			funcs.push_back(std::move(func));
+			files.push_back(filename);
+		}
+	}
+
+	const PurityTable purity = analyzePurity(summaries);
+	checkMemo(summaries, purity);
+	foldConstants(funcs, purity);
+}
+
+// Parses every file and runs main(), bodies are compiled on their first call
+// and again at O3 after "tierThreshold" calls (0 -> never). extern fn resolve
+// against the process, "libraries" are loaded into it first.
+int runJIT(const std::vector<std::string>& inputs, uint64_t tierThreshold, const std::vector<std::string>& libraries) {
+	for (const auto& library : libraries) {
+		std::string error;
+		if (llvm::sys::DynamicLibrary::LoadLibraryPermanently(library.c_str(), &error))
+			throw std::runtime_error("--load " + library + ": " + error);
+	}
+
+	DalgJIT jit(tierThreshold);
+
+	std::vector<std::unique_ptr<FunctionAST>> funcs;
+	std::vector<std::string> files;
+	parseProgram(inputs, funcs, files);
+
+	for (size_t i = 0; i < funcs.size(); i++)
+		jit.addFunction(std::move(funcs[i]), files[i]);
+
+	auto mainFunc = reinterpret_cast<double (*)()>(jit.lookup("main"));
+	const int result = static_cast<int>(mainFunc());
+
+	// the counters live in JIT memory
+	std::fflush(stdout);
+	dalg_memo_report();
+	return result;
+}
+
+// Runs main() on the bytecode interpreter, nothing is compiled by LLVM
+int runVM(const std::vector<std::string>& inputs) {
+	std::vector<std::unique_ptr<FunctionAST>> funcs;
+	std::vector<std::string> files;
+	parseProgram(inputs, funcs, files);
+
+	const BytecodeModule module = compileBytecode(funcs);
+	auto mainFunc = module.index.find("main");
+	if (mainFunc == module.index.end())
+		throw std::runtime_error("[VM] No main function");
+
+	const int result = static_cast<int>(runBytecode(module, mainFunc->second, nullptr));
+	std::fflush(stdout);
+	return result;
+}
+
+// --client -> the same job sent to a --serve process, every input is one source
+int runClient(const std::string& path, const std::vector<std::string>& inputs, const std::string& output, bool opt, bool jit) {
+	std::string source;
+	for (const auto& filename : inputs)
+		source += readFile(filename);
+
+	ServerReply reply;
+	if (jit)
+		reply = serverRequest(path, "run " + std::to_string(source.size()), source);
+	else if (!output.empty()) {
+		const std::string kind = hasExtension(output, ".o") || hasExtension(output, ".obj") ? "o"
+			: hasExtension(output, ".bc") ? "bc" : "ll";
+		reply = serverRequest(path, "compile " + kind + (opt ? " 1 " : " 0 ") + std::to_string(source.size()), source);
+
+		std::ofstream file(output, std::ios::binary);
+		if (!file)
+			throw std::runtime_error("Can't write " + output);
+		file << reply.payload;
+	}
+	else {
+		reply = serverRequest(path, "stats");
+		std::cout << reply.payload;
+	}
+
+	std::cerr << "[Server] " << reply.micros << " us\n";
+	return jit ? static_cast<int>(std::stod(reply.payload)) : 0;
+}
+
+// Manifest -> one source path per line, '#' comments, relative to the manifest
+std::vector<std::string> readManifest(const std::string& filename) {
+	std::vector<std::string> inputs;
+	std::istringstream lines(readFile(filename));
+	const std::string dir = llvm::sys::path::parent_path(filename).str();
+
+	std::string line;
+	while (std::getline(lines, line)) {
+		const auto first = line.find_first_not_of(" \t\r");
+		if (first == std::string::npos || line[first] == '#')
+			continue;
+		const auto last = line.find_last_not_of(" \t\r");
+		std::string path = line.substr(first, last - first + 1);
+
+		if (!dir.empty() && llvm::sys::path::is_relative(path)) {
+			llvm::SmallString<128> full(dir);
+			llvm::sys::path::append(full, path);
+			path = full.str().str();
+		}
+		inputs.push_back(path);
+	}
+	return inputs;
 }
 
 void usage() {
 
 	std::cout << "\n****** LLVM based dalg language by d06i ***********\n" <<
 		"For LLVM IR code : dalg.exe input.dlag output.ll \n" <<
-		"For executable file: clang output.ll -o output.exe\n";
+		"For many files   : dalg.exe [-jN] [-O] a.dalg b.dalg @files.txt -o output.ll|.bc|.o\n" <<
+		"For huge sources  : dalg.exe --stream [-O] a.dalg b.dalg -o output.a (one function in memory at a time)\n" <<
+		"For parallel codegen: dalg.exe -O --codegen-threads=N a.dalg -o output.a (N partitions)\n" <<
+		"For C/C++ programs : dalg.exe --emit=staticlib [-O] a.dalg b.dalg -o libk.a (and libk.h)\n" <<
+		"For executable file: clang output.ll -o output.exe\n" <<
+		"For running directly: dalg.exe --jit a.dalg b.dalg\n" <<
+		"For extern fn of a shared library in the JIT: add --load=libkernels.so\n" <<
+		"For the JIT tier-up threshold: add --tier N (calls, default 1000, 0 -> off)\n" <<
+		"For instant start on the interpreter: dalg.exe --vm a.dalg b.dalg\n" <<
+		"For @memo hit rates: add --instrument, printed on exit\n" <<
+		"For perf and gdb: add -g (DWARF line tables), --jit always writes /tmp/perf-PID.map\n" <<
+		"For register based IR without -O: add --ssa\n" <<
+		"For a target CPU: add --march=native or --march=<cpu> (generic by default, the host with --jit)\n" <<
+		"For a compile server: dalg.exe --serve /tmp/dalg.sock, then add --client /tmp/dalg.sock\n";
 
 }
 
@@ -45,17 +233,129 @@ int main(int argc, const char* argv[]) {
 
 	try {
 
-		if (argc == 2) {
-			const auto src = readFile(argv[1]);
+		std::vector<std::string> inputs;
+		std::vector<std::string> libraries;
+		std::string output;
+		std::string emit;
+		std::string servePath, clientPath;
+		unsigned jobs = 1;
+		unsigned codegenThreads = 1;
+		bool stream = false;
+		uint64_t tierThreshold = 1000;
+		bool opt = false;
+		bool jit = false;
+		bool vm = false;
+
+		for (int i = 1; i < argc; i++) {
+			const std::string arg = argv[i];
+
+			if (arg == "-o" && i + 1 < argc)
+				output = argv[++i];
+			else if (arg == "-O")
+				opt = true;
+			else if (arg == "--jit") {
+				jit = true;
+				g_Options.perfMap = true;
+			}
+			else if (arg == "--tier" && i + 1 < argc)
+				tierThreshold = std::stoull(argv[++i]);
+			else if (arg == "--vm")
+				vm = true;
+			else if (arg == "--instrument")
+				g_Options.instrument = true;
+			else if (arg == "-g")
+				g_Options.debugInfo = true;
+			else if (arg == "--ssa")
+				g_Options.frontendSSA = true;
+			else if (arg.rfind("--march=", 0) == 0)
+				g_Options.march = arg.substr(8);
+			else if (arg.rfind("--emit=", 0) == 0)
+				emit = arg.substr(7);
+			else if (arg.rfind("--load=", 0) == 0)
+				libraries.push_back(arg.substr(7));
+			else if (arg == "--serve" && i + 1 < argc)
+				servePath = argv[++i];
+			else if (arg == "--client" && i + 1 < argc)
+				clientPath = argv[++i];
+			else if (arg.rfind("--codegen-threads=", 0) == 0)
+				codegenThreads = std::max(1, std::stoi(arg.substr(18)));
+			else if (arg == "--stream")
+				stream = true;
+			else if (arg == "-j")
+				jobs = std::max(1u, std::thread::hardware_concurrency());
+			else if (arg.rfind("-j", 0) == 0)
+				jobs = std::max(1, std::stoi(arg.substr(2)));
+			else if (arg[0] == '@') {
+				auto listed = readManifest(arg.substr(1));
+				inputs.insert(inputs.end(), listed.begin(), listed.end());
+			}
+			else
+				inputs.push_back(arg);
+		}
+
+		if (!emit.empty() && emit != "staticlib")
+			throw std::runtime_error("Unknown --emit=" + emit + ", expected --emit=staticlib");
+		if (!emit.empty() && (jit || vm || stream || !clientPath.empty()))
+			throw std::runtime_error("--emit=staticlib compiles one module, it doesn't mix with --jit, --vm, --stream or --client");
+
+		// an unknown CPU fails here instead of in a JIT thread
+		if (!g_Options.march.empty())
+			createObjectMachine();
+
+		if (!servePath.empty()) {
+			serve(servePath);
+			return 0;
+		}
+
+		if (!clientPath.empty())
+			return runClient(clientPath, inputs, output, opt, jit);
+
+		if (vm) {
+			if (inputs.empty())
+				throw std::runtime_error("No input file for --vm");
+			return runVM(inputs);
+		}
+
+		if (jit) {
+			if (inputs.empty())
+				throw std::runtime_error("No input file for --jit");
+			return runJIT(inputs, tierThreshold, libraries);
+		}
+
+		// old style -> dalg input.dalg output.ll
+		if (output.empty() && inputs.size() == 2 && !hasExtension(inputs[1], ".dalg")) {
+			output = inputs.back();
+			inputs.pop_back();
+		}
+		if (!emit.empty() && output.empty())
+			throw std::runtime_error("--emit=staticlib writes an archive, use -o output.a");
+
+		if (output.empty() && inputs.size() == 1) {
+			const auto src = readFile(inputs[0]);
 			auto token = lexer(src);
 			write(token);
 		}
-
-		if (argc == 3) {
+		else if (stream && !inputs.empty()) {
+			if (!hasExtension(output, ".a"))
+				throw std::runtime_error("--stream writes an archive, use -o output.a");
+			std::cout << "Compiling...\n";
+			compileStreaming(inputs, output, opt);
+			std::cout << "Archive writed!\n";
+		}
+		else if (!output.empty() && !inputs.empty()) {
 			std::cout << "Compiling...\n";
-			compile_Run(argv[1]);
-			write2File(argv[2]);
-			std::cout << "LLVM IR writed!\n";
+			if (inputs.size() == 1)
+				compile_Run(inputs[0]);
+			else
+				compileAndLink(inputs, jobs);
+			if (emit == "staticlib") {
+				writeStaticLibrary(output, opt, codegenThreads);
+				std::cout << "Library writed!\n";
+			}
+			else {
+				write2File(output, opt, codegenThreads);
+				std::cout << (hasExtension(output, ".a") ? "Archive writed!\n" : "LLVM IR writed!\n");
+			}
 		}
 		else
 			std::cerr << "Write failed!\n";
@@ -0,0 +1,127 @@
+#include "multiversion.h"
+
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
+
+#include "ast.h"
+
+namespace {
+
+	// Versions of every marked function, in the order of the table selects
+	struct IsaVersion {
+		const char* suffix;
+		const char* cpu;   // null -> the module's CPU
+		int32_t level;     // lowest dalg_cpu_level() that runs it
+	};
+
+	const IsaVersion versions[] = {
+		{ ".default",   nullptr,     1 },
+		{ ".x86-64-v3", "x86-64-v3", 3 },
+		{ ".x86-64-v4", "x86-64-v4", 4 },
+	};
+	const size_t versionCount = sizeof(versions) / sizeof(versions[0]);
+
+	struct Dispatch {
+		llvm::GlobalVariable* table;
+		llvm::Function* versions[versionCount];
+	};
+
+	// Calls between marked functions stay in the same version, recursion included
+	void redirectCalls(llvm::Function* clone, const std::map<llvm::Function*, llvm::Function*>& sameVersion) {
+		for (auto& block : *clone)
+			for (auto& inst : block)
+				if (auto* call = llvm::dyn_cast<llvm::CallInst>(&inst)) {
+					auto target = sameVersion.find(call->getCalledFunction());
+					if (target != sameVersion.end())
+						call->setCalledFunction(target->second);
+				}
+	}
+
+	// "func" -> tail call of its table entry. It keeps its purity attributes,
+	// the entry only changes between versions that compute the same thing.
+	void emitDispatcher(llvm::Function* func, llvm::GlobalVariable* table) {
+		const auto linkage = func->getLinkage();
+		func->deleteBody();
+		func->setLinkage(linkage);
+
+		llvm::IRBuilder<> builder(llvm::BasicBlock::Create(func->getContext(), "entry", func));
+		llvm::LoadInst* target = builder.CreateLoad(table->getValueType(), table, "version");
+		target->setAtomic(llvm::AtomicOrdering::Unordered);
+
+		std::vector<llvm::Value*> args;
+		for (auto& arg : func->args())
+			args.push_back(&arg);
+		llvm::CallInst* call = builder.CreateCall(func->getFunctionType(), target, args);
+		call->setAttributes(func->getAttributes());
+		call->setTailCall();
+
+		if (func->getReturnType()->isVoidTy())
+			builder.CreateRetVoid();
+		else
+			builder.CreateRet(call);
+	}
+
+	// Module constructor -> every table gets the best version the CPU runs
+	void emitSelector(const std::vector<Dispatch>& dispatches) {
+		llvm::LLVMContext& context = g_Module->getContext();
+		llvm::Function* init = llvm::Function::Create(llvm::FunctionType::get(llvm::Type::getVoidTy(context), false),
+			llvm::Function::InternalLinkage, "dalg.multiversion", g_Module.get());
+
+		llvm::IRBuilder<> builder(llvm::BasicBlock::Create(context, "entry", init));
+		llvm::FunctionCallee levelFunc = g_Module->getOrInsertFunction("dalg_cpu_level", builder.getInt32Ty());
+		llvm::Value* level = builder.CreateCall(levelFunc, {}, "level");
+
+		for (const auto& dispatch : dispatches) {
+			llvm::Value* best = dispatch.versions[0];
+			for (size_t v = 1; v < versionCount; v++)
+				best = builder.CreateSelect(builder.CreateICmpSGE(level, builder.getInt32(versions[v].level)),
+					dispatch.versions[v], best);
+			builder.CreateStore(best, dispatch.table)->setAtomic(llvm::AtomicOrdering::Unordered);
+		}
+		builder.CreateRetVoid();
+
+		// before the constructors of C++ code linked with it
+		llvm::appendToGlobalCtors(*g_Module, init, 101);
+	}
+}
+
+void emitMultiversions(const llvm::Triple& triple) {
+	std::vector<llvm::Function*> marked;
+	for (auto& func : *g_Module)
+		if (func.hasFnAttribute(multiversionAttribute)) {
+			func.removeFnAttr(multiversionAttribute);
+			marked.push_back(&func);
+		}
+
+	// the versions are x86-64 levels
+	if (marked.empty() || triple.getArch() != llvm::Triple::x86_64)
+		return;
+
+	std::vector<Dispatch> dispatches(marked.size());
+	std::map<llvm::Function*, llvm::Function*> clones[versionCount];
+	for (size_t v = 0; v < versionCount; v++) {
+		for (size_t i = 0; i < marked.size(); i++) {
+			llvm::ValueToValueMapTy map;
+			llvm::Function* clone = llvm::CloneFunction(marked[i], map);
+			clone->setName(marked[i]->getName() + versions[v].suffix);
+			clone->setLinkage(llvm::GlobalValue::InternalLinkage);
+			if (versions[v].cpu) {
+				clone->addFnAttr("target-cpu", versions[v].cpu);
+				clone->removeFnAttr("target-features");
+			}
+
+			clones[v][marked[i]] = clone;
+			dispatches[i].versions[v] = clone;
+		}
+		for (const auto& clone : clones[v])
+			redirectCalls(clone.second, clones[v]);
+	}
+
+	for (size_t i = 0; i < marked.size(); i++) {
+		dispatches[i].table = new llvm::GlobalVariable(*g_Module, marked[i]->getType(), false,
+			llvm::GlobalValue::InternalLinkage, dispatches[i].versions[0], marked[i]->getName() + ".versions");
+		emitDispatcher(marked[i], dispatches[i].table);
+	}
+
+	emitSelector(dispatches);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <llvm/ADT/Triple.h>
+
+// Function multiversioning. @multiversion functions (and their @batch
+// wrappers) are compiled once per x86-64 level: the module's own CPU, v3
+// (AVX2, FMA) and v4 (AVX-512). The original name becomes a dispatcher that
+// calls through a table, a module constructor fills the table with the best
+// version for the running CPU (dalg_cpu_level of the runtime). Until then the
+// table holds the module's version, so early calls are still correct.
+
+// Marks a definition for emitMultiversions
+constexpr const char* multiversionAttribute = "dalg-multiversion";
+
+// Clones and dispatchers for the marked functions of g_Module. Other targets
+// keep the plain functions. Runs before optimization, each clone is optimized
+// for its own CPU.
+void emitMultiversions(const llvm::Triple& triple);
@@ -18,7 +18,8 @@ TokenStore& Parser::getNextToken() {
 
 bool Parser::isOperator(Token tok) {
 	return tok == tok_plus || tok == tok_minus || tok == tok_multiply || tok == tok_divide ||
-		tok == tok_eq || tok == tok_ne || tok == tok_lt || tok == tok_gt || tok == tok_le || tok == tok_ge;
+		tok == tok_eq || tok == tok_ne || tok == tok_lt || tok == tok_gt || tok == tok_le || tok == tok_ge ||
+		tok == tok_and || tok == tok_or;
 }
 
 void Parser::parserError(const std::string& msg) {
@@ -28,33 +29,40 @@ void Parser::parserError(const std::string& msg) {
 	throw std::runtime_error(error);
 }
 
+SourceLocation Parser::location() {
+	const auto& token = getCurrentToken();
+	return { token.line, token.column };
+}
+
 // https://en.cppreference.com/w/cpp/language/operator_precedence.html
 int Parser::op_precedence(const std::string& op) {
-	std::map<std::string, int> op_pre;
-	op_pre["*"] = 10;
-	op_pre["/"] = 10;
-	op_pre["%"] = 10;
-	op_pre["+"] = 8;
-	op_pre["-"] = 8;
-	op_pre["<"] = 7;
-	op_pre[">"] = 7;
-
-	return op_pre[op] > 0 ? op_pre[op] : -1;
+	static const std::map<std::string, int> op_pre = {
+		{ "*", 10 }, { "/", 10 }, { "%", 10 },
+		{ "+", 8 },  { "-", 8 },
+		{ "<", 7 },  { ">", 7 },  { "<=", 7 }, { ">=", 7 },
+		{ "==", 6 }, { "!=", 6 },
+		{ "&&", 4 },
+		{ "||", 3 },
+	};
+
+	auto found = op_pre.find(op);
+	return found != op_pre.end() ? found->second : -1;
 }
 
 ExprPtr Parser::parseNumber() {
-	auto res = std::make_unique<NumberExprAST>(std::stod(getCurrentToken().name));
+	auto res = located<NumberExprAST>(location(), std::stod(getCurrentToken().name));
 	getNextToken();
 	return res;
 }
 
 ExprPtr Parser::parseString() {
-	auto res = std::make_unique<StringExprAST>(getCurrentToken().name);
+	auto res = located<StringExprAST>(location(), getCurrentToken().name);
 	getNextToken();
 	return res;
 }
 
 ExprPtr Parser::parsePrint() {
+	const SourceLocation loc = location();
 	getNextToken(); // skip "print"
 	if (getCurrentToken().token_type != tok_left_paren)
 		parserError("Expected '(' after 'print'");
@@ -68,7 +76,7 @@ ExprPtr Parser::parsePrint() {
 		parserError("Expected ')' after print expression.");
 	getNextToken(); // skip ')'
 
-	return std::make_unique<PrintExprAST>(std::move(expr));
+	return located<PrintExprAST>(loc, std::move(expr));
 }
 
 ExprPtr Parser::parsePrimary() {
@@ -78,12 +86,94 @@ ExprPtr Parser::parsePrimary() {
 	case tok_string:     return parseString();
 	case tok_print:      return parsePrint();
 	case tok_if:         return parseIfElse();
+	case tok_parfor:     return parseParFor();
+	case tok_spawn:      return parseSpawn("");
+	case tok_sync:       return parseSync();
+	case tok_const:      return parseConst();
+	case tok_not:        return parseNot();
+	case tok_match:      return parseMatch();
+	case tok_yield:      return parseYield();
 	default:
 		parserError("Unknown token at position: " + std::to_string(currentToken) + " -> " + getCurrentToken().name);
+		return nullptr;
 	}
 }
 
-ExprPtr Parser::parseFunctionCall(const std::string& callee) {
+// !x -> binds tighter than every binary operator
+ExprPtr Parser::parseNot() {
+	const SourceLocation loc = location();
+	getNextToken(); // skip '!'
+	return located<NotExprAST>(loc, parsePrimary());
+}
+
+// match x { 1 => a, -2 => { b; c }, 0.5 => d, _ => e }
+ExprPtr Parser::parseMatch() {
+	const SourceLocation loc = location();
+	getNextToken(); // skip 'match'
+
+	auto subject = parseExpression();
+	if (getCurrentToken().token_type != tok_left_brace)
+		parserError("Expected '{' after match value.");
+	getNextToken(); // skip '{'
+
+	std::vector<MatchExprAST::Arm> arms;
+	ExprPtr otherwise;
+	while (getCurrentToken().token_type != tok_right_brace) {
+		if (otherwise)
+			parserError("Arms after '_' never match.");
+
+		const bool isDefault = getCurrentToken().token_type == tok_identifier && getCurrentToken().name == "_";
+		double pattern = 0.0;
+		if (isDefault)
+			getNextToken(); // skip '_'
+		else {
+			const bool negative = getCurrentToken().token_type == tok_minus;
+			if (negative)
+				getNextToken(); // skip '-'
+			if (getCurrentToken().token_type != tok_number)
+				parserError("Expected a number or '_' as match pattern.");
+			pattern = std::stod(getCurrentToken().name);
+			if (negative)
+				pattern = -pattern;
+			getNextToken(); // skip number
+		}
+
+		if (getCurrentToken().token_type != tok_arrow)
+			parserError("Expected '=>' after match pattern.");
+		getNextToken(); // skip '=>'
+
+		ExprPtr body;
+		if (getCurrentToken().token_type == tok_left_brace) {
+			getNextToken(); // skip '{'
+			body = parseBlock();
+			if (getCurrentToken().token_type != tok_right_brace)
+				parserError("Expected '}' to end match arm.");
+			getNextToken(); // skip '}'
+		}
+		else
+			body = parseExpression();
+
+		if (isDefault)
+			otherwise = std::move(body);
+		else
+			arms.push_back({ pattern, std::move(body) });
+
+		if (getCurrentToken().token_type == tok_comma)
+			getNextToken();
+		else if (getCurrentToken().token_type != tok_right_brace)
+			parserError("Expected ',' or '}' after match arm.");
+	}
+	getNextToken(); // skip '}'
+
+	return located<MatchExprAST>(loc, std::move(subject), std::move(arms), std::move(otherwise));
+}
+
+ExprPtr Parser::parseFunctionCall(const std::string& callee, const SourceLocation& loc) {
+	return located<CallExprAST>(loc, callee, parseCallArgs());
+}
+
+// -> ( a, b + 1, c )
+std::vector<ExprPtr> Parser::parseCallArgs() {
 	getNextToken(); // skip '('
 	std::vector<ExprPtr> args;
 
@@ -98,39 +188,123 @@ ExprPtr Parser::parseFunctionCall(const std::string& callee) {
 
 	getNextToken(); // skip ')'
 
-	return std::make_unique<CallExprAST>(callee, std::move(args));
+	return args;
 }
 
 ExprPtr Parser::parseIdentifier() {
+	const SourceLocation loc = location();
 	std::string id = getCurrentToken().name;
 	getNextToken();
 
-	if (getCurrentToken().token_type == tok_left_paren)
-		return parseFunctionCall(id);
+	if (getCurrentToken().token_type == tok_left_paren) {
+		if (isVectorBuiltin(id))
+			return parseVectorBuiltin(id, loc);
+		return parseFunctionCall(id, loc);
+	}
 
-	return std::make_unique<VariableExprAST>(id);
+	return located<VariableExprAST>(loc, id);
+}
+
+// Names of the SIMD builtins, no function can take them
+static const std::map<std::string, int> vector_builtins = {
+	{ "vec2", 2 }, { "vec4", 4 }, { "vec8", 8 },
+	{ "lane", 0 }, { "shuffle", 0 },
+	{ "hsum", reduce_add }, { "hmul", reduce_mul }, { "hmin", reduce_min }, { "hmax", reduce_max },
+};
+
+bool Parser::isVectorBuiltin(const std::string& name) {
+	return vector_builtins.count(name) != 0;
+}
+
+// vec4(a, b, c, d) | vec4(x) | lane(v, i) | shuffle(a, [b,] 3, 2, 1, 0) | hsum(v)
+ExprPtr Parser::parseVectorBuiltin(const std::string& name, const SourceLocation& loc) {
+	auto args = parseCallArgs();
+	const int value = vector_builtins.at(name);
+
+	if (name.compare(0, 3, "vec") == 0) {
+		if (args.size() != 1 && args.size() != static_cast<size_t>(value))
+			parserError(name + " takes 1 or " + std::to_string(value) + " lanes.");
+		return located<VectorExprAST>(loc, static_cast<unsigned>(value), std::move(args));
+	}
+
+	if (name == "lane") {
+		if (args.size() != 2)
+			parserError("lane takes a vector and an index.");
+		return located<LaneExprAST>(loc, std::move(args[0]), std::move(args[1]));
+	}
+
+	if (name == "shuffle") {
+		// the indices are the trailing numbers
+		std::vector<int> indices;
+		while (!args.empty()) {
+			auto* num = dynamic_cast<NumberExprAST*>(args.back().get());
+			if (!num)
+				break;
+			if (num->getValue() < 0 || num->getValue() != static_cast<int>(num->getValue()))
+				parserError("shuffle indices are lane numbers.");
+			indices.insert(indices.begin(), static_cast<int>(num->getValue()));
+			args.pop_back();
+		}
+		if (args.empty() || args.size() > 2)
+			parserError("shuffle takes one or two vectors before the indices.");
+		if (indices.size() != 2 && indices.size() != 4 && indices.size() != 8)
+			parserError("shuffle makes a vec2, vec4 or vec8.");
+		return located<ShuffleExprAST>(loc, std::move(args), std::move(indices));
+	}
+
+	if (args.size() != 1)
+		parserError(name + " takes one vector.");
+	return located<HorizontalExprAST>(loc, static_cast<ReduceOp>(value), std::move(args[0]));
 }
 
 // a = 3 + 4 * 5  || b = 3 * 4 + 11
+// Operands and operators on explicit stacks, an operator first combines the
+// ones before it that bind at least as tight -> left associative
 ExprPtr Parser::parseBinaryOp(int min_prec) {
+	struct PendingOp {
+		std::string op;
+		int precedence;
+		SourceLocation loc;
+	};
+	std::vector<ExprPtr> operands;
+	std::vector<PendingOp> operators;
+
+	auto reduce = [&]() {
+		auto rhs = std::move(operands.back());
+		operands.pop_back();
+		auto lhs = std::move(operands.back());
+		operands.pop_back();
+		operands.push_back(located<BinaryExprAST>(operators.back().loc, operators.back().op, std::move(lhs), std::move(rhs)));
+		operators.pop_back();
+	};
+
 	auto lhs = parsePrimary();
 	if (!lhs) return nullptr;
+	operands.push_back(std::move(lhs));
 
 	while (isOperator(getCurrentToken().token_type)) {
+		const SourceLocation loc = location();
 		std::string op = getCurrentToken().name;
 		int precedence = op_precedence(op);
 
 		if (precedence < min_prec)
 			break;
 
+		while (!operators.empty() && operators.back().precedence >= precedence)
+			reduce();
+
 		getNextToken(); // skip binOperator
 
-		auto rhs = parseBinaryOp(precedence + 1); // recursive op_prec 
+		auto rhs = parsePrimary();
 		if (!rhs) return nullptr;
-		lhs = std::make_unique<BinaryExprAST>(op, std::move(lhs), std::move(rhs));
+		operators.push_back({ std::move(op), precedence, loc });
+		operands.push_back(std::move(rhs));
 	}
 
-	return lhs;
+	while (!operators.empty())
+		reduce();
+
+	return std::move(operands.back());
 }
 
 ExprPtr Parser::parseExpression() {
@@ -143,6 +317,7 @@ ExprPtr Parser::parseExpression() {
 }
 
 ExprPtr Parser::parseBlock() {
+	const SourceLocation loc = location();
 	std::vector<ExprPtr> expr;
 
 	while (getCurrentToken().token_type != tok_right_brace && getCurrentToken().token_type != tok_eof) {
@@ -163,16 +338,22 @@ ExprPtr Parser::parseBlock() {
 			continue;
 		}
 
+		if (getCurrentToken().token_type == tok_parfor) {
+			expr.push_back(parseParFor());
+			continue;
+		}
+
 		auto temp = parseExpression();
 		if (temp)
 			expr.push_back(std::move(temp));
 	}
 
-	return std::make_unique<BlockExprAST>(std::move(expr));
+	return located<BlockExprAST>(loc, std::move(expr));
 }
 
 // Assign Parsing -> "a = 3*b;"
 ExprPtr Parser::parseAssignment() {
+	const SourceLocation loc = location();
 	std::string n = getCurrentToken().name; // get identifier name
 	getNextToken(); // skip identifier
 
@@ -182,7 +363,10 @@ ExprPtr Parser::parseAssignment() {
 
 	getNextToken(); // skip "="
 
-	auto val = parseExpression();
+	// "a = spawn f(x);" writes "a" itself at sync
+	const bool spawned = getCurrentToken().token_type == tok_spawn;
+
+	auto val = spawned ? parseSpawn(n) : parseExpression();
 	if (!val)
 		return nullptr;
 
@@ -190,7 +374,10 @@ ExprPtr Parser::parseAssignment() {
 		parserError("Expected ';' after assignment.");
 	getNextToken(); // skip ";" 
 
-	return std::make_unique<AssignmentExprAST>(n, std::move(val));
+	if (spawned)
+		return val;
+
+	return located<AssignmentExprAST>(loc, n, std::move(val));
 }
 
 // Prototype -> fn test( a , b )
@@ -198,7 +385,10 @@ std::unique_ptr<PrototypeAST> Parser::parsePrototype() {
 	if (getCurrentToken().token_type != tok_identifier)
 		parserError("Expected function name not available!");
 
+	const SourceLocation loc = location();
 	std::string FuncName = getCurrentToken().name;
+	if (isVectorBuiltin(FuncName))
+		parserError("Function name is a builtin: " + FuncName);
 	getNextToken(); // skip function name
 
 	if (getCurrentToken().token_type != tok_left_paren)
@@ -221,34 +411,193 @@ std::unique_ptr<PrototypeAST> Parser::parsePrototype() {
 
 	getNextToken(); // skip ')'
 
-	return std::make_unique<PrototypeAST>(FuncName, std::move(args));
+	return located<PrototypeAST>(loc, FuncName, std::move(args));
 }
 
 std::unique_ptr<FunctionAST> Parser::parseFunction() {
+	// -> @batch @memo(4096, keep) fn test(a, b) { ... }
+	std::vector<Annotation> annotations;
+	while (getCurrentToken().token_type == tok_annotation)
+		annotations.push_back(parseAnnotation());
+
+	if (getCurrentToken().token_type == tok_extern) {
+		if (!annotations.empty())
+			parserError("extern fn takes no annotations");
+		return parseExtern();
+	}
+
+	auto func = parseFunctionBody();
+	for (auto& a : annotations)
+		func->addAnnotation(std::move(a));
+
+	return func;
+}
+
+// @batch | @multiversion | @memo | @memo(capacity) | @memo(capacity, overwrite|keep)
+Annotation Parser::parseAnnotation() {
+	Annotation a;
+	a.name = getCurrentToken().name;
+	getNextToken(); // skip annotation
+
+	if (getCurrentToken().token_type == tok_left_paren) {
+		getNextToken(); // skip '('
+		while (getCurrentToken().token_type != tok_right_paren) {
+			if (getCurrentToken().token_type != tok_number && getCurrentToken().token_type != tok_identifier)
+				parserError("Expected number or name in @" + a.name + " arguments");
+			a.args.push_back(getCurrentToken().name);
+			getNextToken();
+
+			if (getCurrentToken().token_type == tok_comma)
+				getNextToken();
+			else if (getCurrentToken().token_type != tok_right_paren)
+				parserError("Expected ',' or ')' in @" + a.name + " arguments");
+		}
+		getNextToken(); // skip ')'
+	}
+
+	if (a.name == "batch" || a.name == "multiversion") {
+		if (!a.args.empty())
+			parserError("@" + a.name + " takes no arguments");
+	}
+	else if (a.name == "memo") {
+		if (a.args.size() > 2)
+			parserError("@memo takes (capacity, overwrite|keep)");
+		if (!a.args.empty()) {
+			const double capacity = std::stod(a.args[0]);
+			const auto n = static_cast<uint64_t>(capacity);
+			if (capacity < 1 || capacity != static_cast<double>(n) || (n & (n - 1)) != 0)
+				parserError("@memo capacity must be a power of two");
+		}
+		if (a.args.size() == 2 && a.args[1] != "overwrite" && a.args[1] != "keep")
+			parserError("@memo eviction must be 'overwrite' or 'keep'");
+	}
+	else
+		parserError("Unknown annotation @" + a.name);
+
+	return a;
+}
+
+// extern fn name(a: i32, b) -> f32 pure nounwind; -> untyped is f64
+std::unique_ptr<FunctionAST> Parser::parseExtern() {
+	const SourceLocation loc = location();
+	getNextToken(); // skip 'extern'
+
+	if (getCurrentToken().token_type != tok_fn)
+		parserError("Expected 'fn' after 'extern'");
+	getNextToken(); // skip 'fn'
+
+	const SourceLocation protoLoc = location();
+	if (getCurrentToken().token_type != tok_identifier)
+		parserError("Expected function name not available!");
+	std::string FuncName = getCurrentToken().name;
+	if (isVectorBuiltin(FuncName))
+		parserError("Function name is a builtin: " + FuncName);
+	getNextToken(); // skip function name
+
+	if (getCurrentToken().token_type != tok_left_paren)
+		parserError("Expected '(' after function name.");
+	getNextToken(); // skip '('
+
+	std::vector<std::string> args;
+	ExternSignature signature;
+	while (getCurrentToken().token_type != tok_right_paren) {
+		if (getCurrentToken().token_type != tok_identifier)
+			parserError("Expected identifier in function arguments.");
+		args.push_back(getCurrentToken().name);
+		getNextToken();
+
+		NativeType type = NativeType::F64;
+		if (getCurrentToken().token_type == tok_colon) {
+			getNextToken(); // skip ':'
+			type = parseNativeType();
+			if (type == NativeType::Void)
+				parserError("void is only a return type: " + args.back());
+		}
+		signature.params.push_back(type);
+
+		if (getCurrentToken().token_type == tok_comma)
+			getNextToken();
+		else if (getCurrentToken().token_type != tok_right_paren)
+			parserError("Expected ',' or ')' in function arguments.");
+	}
+	getNextToken(); // skip ')'
+
+	if (getCurrentToken().token_type == tok_thin_arrow) {
+		getNextToken(); // skip '->'
+		signature.result = parseNativeType();
+	}
+
+	while (getCurrentToken().token_type == tok_identifier) {
+		const std::string& attr = getCurrentToken().name;
+		if (attr == "pure")
+			signature.pure = true;
+		else if (attr == "nounwind")
+			signature.nounwind = true;
+		else
+			parserError("Unknown extern attribute, expected pure or nounwind: " + attr);
+		getNextToken();
+	}
+
+	if (getCurrentToken().token_type != tok_semicolon)
+		parserError("Expected ';' after extern fn " + FuncName);
+	getNextToken(); // skip ';'
+
+	auto proto = located<PrototypeAST>(protoLoc, FuncName, std::move(args));
+	proto->setExtern(std::move(signature));
+	return located<FunctionAST>(loc, std::move(proto), nullptr);
+}
+
+// f64 | f32 | i64 | i32 | void
+NativeType Parser::parseNativeType() {
+	static const std::map<std::string, NativeType> types{
+		{ "f64", NativeType::F64 }, { "f32", NativeType::F32 },
+		{ "i64", NativeType::I64 }, { "i32", NativeType::I32 },
+		{ "void", NativeType::Void },
+	};
+
+	auto type = types.find(getCurrentToken().name);
+	if (getCurrentToken().token_type != tok_identifier || type == types.end())
+		parserError("Expected a C type (f64, f32, i64, i32, void): " + getCurrentToken().name);
+	getNextToken(); // skip type
+	return type->second;
+}
+
+std::unique_ptr<FunctionAST> Parser::parseFunctionBody() {
 	if (getCurrentToken().token_type != tok_fn)
 		parserError("Expected 'fn' keyword not available! Current Token -> " + getCurrentToken().name);
 
+	const SourceLocation loc = location();
 	getNextToken(); // skip 'fn'
 
 	if (getCurrentToken().token_type != tok_identifier)
 		parserError("Expected function name not available!");
 
 	auto proto = parsePrototype();
+	yielded = false;
+
+	// declaration -> fn test(a, b);
+	if (getCurrentToken().token_type == tok_semicolon) {
+		getNextToken(); // skip ';'
+		return located<FunctionAST>(loc, std::move(proto), nullptr);
+	}
 
 	if (getCurrentToken().token_type != tok_left_brace)
 		parserError("Expected '{' to start function body.");
 	getNextToken(); // skip '{'
 
 	auto body = parseBlock();
+	if (yielded)
+		proto->setGenerator();
 
 	if (getCurrentToken().token_type != tok_right_brace)
 		parserError("Expected '}' to end function body.");
 	getNextToken(); // skip '}'
 
-	return std::make_unique<FunctionAST>(std::move(proto), std::move(body));
+	return located<FunctionAST>(loc, std::move(proto), std::move(body));
 }
 
 ExprPtr Parser::parseIfElse() {
+	const SourceLocation loc = location();
 	getNextToken(); // skip 'if'
 
 	auto cond = parseExpression();
@@ -264,7 +613,7 @@ ExprPtr Parser::parseIfElse() {
 
 	auto elseExpr = parseElse();
 
-	return std::make_unique<ifExprAST>(std::move(cond), std::move(thenExpr), std::move(elseExpr));
+	return located<ifExprAST>(loc, std::move(cond), std::move(thenExpr), std::move(elseExpr));
 }
 
 // -> else { do_it_somethings } || else if { do_it_anything_else }
@@ -291,13 +640,14 @@ ExprPtr Parser::parseElse() {
 
 	}
 	// if "else" doesn't exist return empty BlockExpr!
-	return std::make_unique<BlockExprAST>(std::vector<ExprPtr>());
+	return located<BlockExprAST>(location(), std::vector<ExprPtr>());
 }
 
 // for now broken!!!
 // -> for x = 3, x < 50, 2 { Body }
 ExprPtr Parser::parseFor() {
 
+	const SourceLocation loc = location();
 	getNextToken(); // skip "for"
 
 	if (getCurrentToken().token_type != tok_identifier)
@@ -306,6 +656,8 @@ ExprPtr Parser::parseFor() {
 	// var shadowing
 	std::string varName = getCurrentToken().name;
 	getNextToken(); //  skip "identifier"
+	if (getCurrentToken().token_type == tok_in)
+		return parseForIn(varName, loc);
 	getNextToken(); //  skip "="
 
 	auto start = parseExpression();
@@ -340,5 +692,180 @@ ExprPtr Parser::parseFor() {
 		parserError("Expected '}' after for body");
 	getNextToken(); // skip '}'
 
-	return std::make_unique<forExprAST>(varName, std::move(start), std::move(end), std::move(step), std::move(body));
+	return located<forExprAST>(loc, varName, std::move(start), std::move(end), std::move(step), std::move(body));
+}
+
+// -> for x in gen(a, b) { Body }, "for x" is already read
+ExprPtr Parser::parseForIn(const std::string& varName, const SourceLocation& loc) {
+	getNextToken(); // skip "in"
+
+	if (getCurrentToken().token_type != tok_identifier)
+		parserError("Expected a generator call after 'in'");
+	std::string generator = getCurrentToken().name;
+	getNextToken(); // skip generator name
+
+	if (getCurrentToken().token_type != tok_left_paren)
+		parserError("Expected '(' after generator name");
+	auto args = parseCallArgs();
+
+	if (getCurrentToken().token_type != tok_left_brace)
+		parserError("Expected '{' after for");
+	getNextToken(); // skip '{'
+
+	auto body = parseBlock();
+	if (!body)
+		return nullptr;
+
+	if (getCurrentToken().token_type != tok_right_brace)
+		parserError("Expected '}' after for body");
+	getNextToken(); // skip '}'
+
+	return located<ForInExprAST>(loc, varName, generator, std::move(args), std::move(body));
+}
+
+// -> yield x, makes the function a generator
+ExprPtr Parser::parseYield() {
+	const SourceLocation loc = location();
+	getNextToken(); // skip "yield"
+	yielded = true;
+	return located<YieldExprAST>(loc, parseExpression());
+}
+
+// -> parfor x = 0, x < 100, 1 reduce(+) { Body }
+// the bound has to be "x < end" so the trip count is known before the loop starts
+ExprPtr Parser::parseParFor() {
+
+	const SourceLocation loc = location();
+	getNextToken(); // skip "parfor"
+
+	if (getCurrentToken().token_type != tok_identifier)
+		parserError("Expected identifier after 'parfor'");
+
+	std::string varName = getCurrentToken().name;
+	getNextToken(); //  skip "identifier"
+
+	if (getCurrentToken().token_type != tok_equals)
+		parserError("Expected '=' after parfor variable");
+	getNextToken(); //  skip "="
+
+	auto start = parseExpression();
+	if (!start)
+		return nullptr;
+
+	if (getCurrentToken().token_type != tok_comma)
+		parserError("Expected ',' after parfor start val");
+	getNextToken(); // skip ','
+
+	if (getCurrentToken().token_type != tok_identifier || getCurrentToken().name != varName)
+		parserError("Expected '" + varName + " < end' in parfor");
+	getNextToken(); // skip "identifier"
+
+	if (getCurrentToken().token_type != tok_lt)
+		parserError("Expected '<' in parfor bound");
+	getNextToken(); // skip '<'
+
+	auto end = parseExpression();
+	if (!end)
+		return nullptr;
+
+	ExprPtr step = nullptr;
+	if (getCurrentToken().token_type == tok_comma) {
+		getNextToken();
+		step = parseExpression();
+		if (!step)
+			return nullptr;
+	}
+
+	// reduce(+) | reduce(*) | reduce(min) | reduce(max)
+	ReduceOp op = reduce_none;
+	if (getCurrentToken().token_type == tok_reduce) {
+		getNextToken(); // skip "reduce"
+
+		if (getCurrentToken().token_type != tok_left_paren)
+			parserError("Expected '(' after 'reduce'");
+		getNextToken(); // skip '('
+
+		const auto& tok = getCurrentToken();
+		if (tok.token_type == tok_plus)
+			op = reduce_add;
+		else if (tok.token_type == tok_multiply)
+			op = reduce_mul;
+		else if (tok.token_type == tok_identifier && tok.name == "min")
+			op = reduce_min;
+		else if (tok.token_type == tok_identifier && tok.name == "max")
+			op = reduce_max;
+		else
+			parserError("Expected '+', '*', 'min' or 'max' in reduce");
+		getNextToken(); // skip operator
+
+		if (getCurrentToken().token_type != tok_right_paren)
+			parserError("Expected ')' after reduce operator");
+		getNextToken(); // skip ')'
+	}
+
+	if (getCurrentToken().token_type != tok_left_brace)
+		parserError("Expected '{' after parfor");
+	getNextToken(); // skip '{'
+
+	auto body = parseBlock();
+	if (!body)
+		return nullptr;
+
+	if (getCurrentToken().token_type != tok_right_brace)
+		parserError("Expected '}' after parfor body");
+	getNextToken(); // skip '}'
+
+	return located<ParForExprAST>(loc, varName, std::move(start), std::move(end), std::move(step), std::move(body), op);
+}
+
+// -> a = spawn fib(n - 1);  || spawn work(x)
+// target gets the result at the next "sync"
+ExprPtr Parser::parseSpawn(const std::string& target) {
+	const SourceLocation loc = location();
+	getNextToken(); // skip "spawn"
+
+	if (getCurrentToken().token_type != tok_identifier)
+		parserError("Expected function call after 'spawn'");
+
+	std::string callee = getCurrentToken().name;
+	getNextToken(); // skip function name
+
+	if (getCurrentToken().token_type != tok_left_paren)
+		parserError("Expected '(' after spawned function name");
+
+	auto args = parseCallArgs();
+
+	return located<SpawnExprAST>(loc, target, callee, std::move(args));
+}
+
+// -> sync
+ExprPtr Parser::parseSync() {
+	const SourceLocation loc = location();
+	getNextToken(); // skip "sync"
+	return located<SyncExprAST>(loc);
+}
+
+// Const binding -> "const n = f(10);", known at compile time
+ExprPtr Parser::parseConst() {
+	const SourceLocation loc = location();
+	getNextToken(); // skip "const"
+
+	if (getCurrentToken().token_type != tok_identifier)
+		parserError("Expected name after 'const'.");
+	std::string n = getCurrentToken().name;
+	getNextToken();
+
+	if (getCurrentToken().token_type != tok_equals)
+		parserError("Expected '=' after const name.");
+	getNextToken(); // skip "="
+
+	auto val = parseExpression();
+	if (!val)
+		return nullptr;
+
+	if (getCurrentToken().token_type != tok_semicolon)
+		parserError("Expected ';' after const binding.");
+	getNextToken(); // skip ";"
+
+	return located<AssignmentExprAST>(loc, n, std::move(val), true);
 }
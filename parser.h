@@ -10,6 +10,7 @@
 class Parser {
     std::vector<TokenStore>& tokens;
     size_t currentToken = 0; 
+    bool yielded = false;   // the function being parsed has a yield
 public:
     Parser(std::vector<TokenStore>& t) : tokens(t) {}
 
@@ -20,19 +21,45 @@ public:
     ExprPtr parsePrint();
     ExprPtr parseIfElse();
     ExprPtr parsePrimary();
-    ExprPtr parseFunctionCall(const std::string& callee);
+    ExprPtr parseFunctionCall(const std::string& callee, const SourceLocation& loc);
+    std::vector<ExprPtr> parseCallArgs();
     ExprPtr parseIdentifier();
+    ExprPtr parseVectorBuiltin(const std::string& name, const SourceLocation& loc);
+    bool isVectorBuiltin(const std::string& name);
     ExprPtr parseBinaryOp(int min_prec);
     ExprPtr parseExpression();
     ExprPtr parseBlock();
     ExprPtr parseAssignment();
     ExprPtr parseElse();
     ExprPtr parseFor();
+    ExprPtr parseForIn(const std::string& varName, const SourceLocation& loc);
+    ExprPtr parseYield();
+    ExprPtr parseParFor();
+    ExprPtr parseSpawn(const std::string& target);
+    ExprPtr parseSync();
+    ExprPtr parseConst();
+    ExprPtr parseNot();
+    ExprPtr parseMatch();
  //   ExprPtr parseWhile();
     std::unique_ptr<PrototypeAST> parsePrototype();
     std::unique_ptr<FunctionAST> parseFunction();
+    std::unique_ptr<FunctionAST> parseFunctionBody();
+    std::unique_ptr<FunctionAST> parseExtern();
+    NativeType parseNativeType();
+    Annotation parseAnnotation();
 
     bool isOperator(Token tok); 
     void parserError(const std::string& msg);
     int  op_precedence(const std::string& op);
+
+    // Location of the current token
+    SourceLocation location();
+
+    // AST node that starts at "loc"
+    template <typename T, typename... Args>
+    std::unique_ptr<T> located(const SourceLocation& loc, Args&&... args) {
+        auto node = std::make_unique<T>(std::forward<Args>(args)...);
+        node->setLocation(loc);
+        return node;
+    }
 };  
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include "purity.h"
+
+#include <stdexcept>
+#include <vector>
+
+// Worklists over the reversed call graph, each edge is visited once
+PurityTable analyzePurity(const std::map<std::string, EffectSummary>& summaries) {
+	PurityTable table;
+	std::map<std::string, std::vector<std::string>> callers;
+	std::vector<std::string> work;
+
+	// optimistic -> every function is pure until it or one of its callees
+	// turns out not to be
+	for (const auto& s : summaries) {
+		bool pure = !s.second.effects;
+		for (const auto& callee : s.second.callees) {
+			callers[callee].push_back(s.first);
+			if (!summaries.count(callee))
+				pure = false;
+		}
+
+		table[s.first].pure = pure;
+		table[s.first].generator = s.second.generator;
+		if (!pure)
+			work.push_back(s.first);
+	}
+
+	while (!work.empty()) {
+		const std::string name = std::move(work.back());
+		work.pop_back();
+
+		for (const auto& caller : callers[name]) {
+			Purity& p = table[caller];
+			if (p.pure) {
+				p.pure = false;
+				work.push_back(caller);
+			}
+		}
+	}
+
+	// pessimistic -> a function returns once all of its callees do, so a
+	// cycle (recursion) never gets there
+	std::map<std::string, size_t> pending;
+	for (const auto& s : summaries) {
+		if (!table[s.first].pure || s.second.loops)
+			continue;
+		pending[s.first] = s.second.callees.size();
+		if (s.second.callees.empty())
+			work.push_back(s.first);
+	}
+
+	while (!work.empty()) {
+		const std::string name = std::move(work.back());
+		work.pop_back();
+		table[name].willReturn = true;
+
+		for (const auto& caller : callers[name]) {
+			auto count = pending.find(caller);
+			if (count != pending.end() && --count->second == 0)
+				work.push_back(caller);
+		}
+	}
+
+	// printing -> a print in the body or a call of anything without a
+	// summary (other files, extern fn that aren't pure) reaches one
+	for (const auto& s : summaries) {
+		bool prints = s.second.prints;
+		for (const auto& callee : s.second.callees)
+			if (!summaries.count(callee))
+				prints = true;
+
+		table[s.first].prints = prints;
+		if (prints)
+			work.push_back(s.first);
+	}
+
+	while (!work.empty()) {
+		const std::string name = std::move(work.back());
+		work.pop_back();
+
+		for (const auto& caller : callers[name]) {
+			Purity& p = table[caller];
+			if (!p.prints) {
+				p.prints = true;
+				work.push_back(caller);
+			}
+		}
+	}
+
+	return table;
+}
+
+void checkMemo(const std::map<std::string, EffectSummary>& summaries, const PurityTable& table) {
+	for (const auto& s : summaries) {
+		auto purity = table.find(s.first);
+		if (s.second.memo && purity != table.end() && purity->second.prints)
+			throw std::runtime_error("[Purity] @memo function calls print: " + s.first);
+	}
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+
+// What a function body does by itself, calls are resolved by analyzePurity
+struct EffectSummary {
+    bool effects = false;   // print, spawn, sync, parfor, @memo table, yield
+    bool loops = false;     // for loops, may not terminate
+    bool generator = false; // yields, calls of it are "for x in f()" loops
+    bool prints = false;    // print in the body
+    bool memo = false;      // @memo, can't reach a print
+    std::set<std::string> callees;   // calls and spawns
+};
+
+struct Purity {
+    bool pure = false;         // no side effects, doesn't read memory
+    bool willReturn = false;   // pure, no loops and no recursion
+    bool generator = false;    // declared as returning a coroutine handle
+    bool prints = false;       // may print, directly or through any call
+};
+
+// name -> purity of every function defined in one module
+using PurityTable = std::map<std::string, Purity>;
+
+// Call graph fixed point over the defined functions. Calls to anything
+// else (declarations, other files) are treated as side effects.
+PurityTable analyzePurity(const std::map<std::string, EffectSummary>& summaries);
+
+// Throws for a @memo function that may print, a cache hit would skip it
+void checkMemo(const std::map<std::string, EffectSummary>& summaries, const PurityTable& table);
@@ -7,7 +7,7 @@ del %OUT%.exe
 dalg test.dalg %OUT%
 type %OUT%
 
-clang -O3 %OUT% -o %OUT%.exe
+clang++ -O3 %OUT% runtime.cpp -o %OUT%.exe
 
 %OUT%.exe
 
@@ -0,0 +1,644 @@
+#include "runtime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+namespace {
+
+	struct Task {
+		void (*fn)(void*);
+		void* arg;
+	};
+
+	// Owner pushes/pops at the back, thieves take from the front
+	struct Worker {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	// Index of the deque owned by this thread, pool threads are 1..n-1,
+	// every other thread shares deque 0
+	thread_local size_t t_workerId = 0;
+
+	class ThreadPool {
+		std::vector<std::unique_ptr<Worker>> workers;
+		std::vector<std::thread> threads;
+
+		std::atomic<bool>    stop{ false };
+		std::atomic<int64_t> pending{ 0 };
+		std::mutex              sleepLock;
+		std::condition_variable wake;
+		std::mutex              lifecycleLock;   // start / shutdown
+
+		ThreadPool() {
+			size_t count = std::thread::hardware_concurrency();
+			if (const char* env = std::getenv("DALG_NUM_THREADS"))
+				count = std::strtoul(env, nullptr, 10);
+			if (count == 0)
+				count = 1;
+
+			for (size_t i = 0; i < count; i++)
+				workers.push_back(std::make_unique<Worker>());
+
+			spawnThreads();
+		}
+
+		// worker 0 is the thread that waits for a task
+		void spawnThreads() {
+			for (size_t i = 1; i < workers.size(); i++)
+				threads.emplace_back([this, i]() { workerLoop(i); });
+		}
+
+		~ThreadPool() {
+			shutdown();
+		}
+
+		void workerLoop(size_t id) {
+			t_workerId = id;
+			while (!stop) {
+				if (runOne())
+					continue;
+
+				std::unique_lock<std::mutex> guard(sleepLock);
+				wake.wait(guard, [this]() { return stop || pending > 0; });
+			}
+		}
+
+		bool pop(size_t id, Task& task, bool steal) {
+			Worker& w = *workers[id];
+			std::lock_guard<std::mutex> guard(w.lock);
+			if (w.tasks.empty())
+				return false;
+
+			if (steal) {
+				task = w.tasks.front();
+				w.tasks.pop_front();
+			}
+			else {
+				task = w.tasks.back();
+				w.tasks.pop_back();
+			}
+			pending--;
+			return true;
+		}
+
+	public:
+		static ThreadPool& get() {
+			static ThreadPool pool;
+			return pool;
+		}
+
+		size_t size() const {
+			return workers.size();
+		}
+
+		// Joins the pool threads, the deques stay: tasks pushed later run on
+		// the thread that waits for them
+		void shutdown() {
+			std::lock_guard<std::mutex> lifecycle(lifecycleLock);
+			{
+				std::lock_guard<std::mutex> guard(sleepLock);
+				stop = true;
+			}
+			wake.notify_all();
+			for (auto& t : threads)
+				t.join();
+			threads.clear();
+		}
+
+		// Threads again after shutdown, a running pool stays as it is
+		void start() {
+			std::lock_guard<std::mutex> lifecycle(lifecycleLock);
+			if (!stop)
+				return;
+			stop = false;
+			spawnThreads();
+		}
+
+		void push(Task task) {
+			{
+				Worker& w = *workers[t_workerId];
+				std::lock_guard<std::mutex> guard(w.lock);
+				w.tasks.push_back(task);
+			}
+			pending++;
+			{
+				std::lock_guard<std::mutex> guard(sleepLock);
+			}
+			wake.notify_one();
+		}
+
+		// Own deque first, then steal from the others
+		bool runOne() {
+			Task task;
+			bool found = pop(t_workerId, task, false);
+
+			for (size_t i = 1; !found && i < workers.size(); i++)
+				found = pop((t_workerId + i) % workers.size(), task, true);
+
+			if (found)
+				task.fn(task.arg);
+			return found;
+		}
+
+		// The waiting thread keeps executing tasks, so nested loops can't deadlock
+		void waitFor(const std::atomic<int64_t>& remaining) {
+			while (remaining > 0)
+				if (!runOne())
+					std::this_thread::yield();
+		}
+	};
+
+	double identity(int32_t op) {
+		switch (op) {
+		case reduce_mul: return 1.0;
+		case reduce_min: return std::numeric_limits<double>::infinity();
+		case reduce_max: return -std::numeric_limits<double>::infinity();
+		default:         return 0.0;
+		}
+	}
+
+	double combine(int32_t op, double a, double b) {
+		switch (op) {
+		case reduce_add: return a + b;
+		case reduce_mul: return a * b;
+		case reduce_min: return b < a ? b : a;
+		case reduce_max: return b > a ? b : a;
+		default:         return 0.0;
+		}
+	}
+
+	struct Chunk {
+		dalg_chunk_fn         body;
+		void*                 env;
+		int64_t               begin, end;
+		double                result;
+		std::atomic<int64_t>* remaining;
+	};
+
+	void runChunk(void* arg) {
+		Chunk* chunk = static_cast<Chunk*>(arg);
+		chunk->result = chunk->body(chunk->env, chunk->begin, chunk->end);
+		(*chunk->remaining)--;
+	}
+
+	// Future of a spawned call, small argument lists are stored inline
+	struct SpawnTask {
+		dalg_task_fn         fn;
+		double               inlineArgs[4];
+		std::vector<double>  heapArgs;
+		const double*        args;
+		double               result;
+		std::atomic<int64_t> remaining{ 1 };
+	};
+
+	void runSpawn(void* arg) {
+		SpawnTask* task = static_cast<SpawnTask*>(arg);
+		task->result = task->fn(task->args);
+		task->remaining.store(0, std::memory_order_release);
+	}
+
+	struct MemoStats {
+		const char*    name;
+		const int64_t* counters;
+	};
+
+	std::mutex memoLock;
+
+	std::vector<MemoStats>& memoStats() {
+		static std::vector<MemoStats> stats;
+		return stats;
+	}
+
+	bool memoAtExit = false;
+
+#if defined(_M_X64) || defined(__x86_64__)
+	// { eax, ebx, ecx, edx } of cpuid
+	void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+#if defined(_MSC_VER)
+		int out[4];
+		__cpuidex(out, static_cast<int>(leaf), static_cast<int>(subleaf));
+		for (int i = 0; i < 4; i++)
+			regs[i] = static_cast<uint32_t>(out[i]);
+#else
+		__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	}
+
+	// Register state the OS saves on a context switch (XCR0)
+	uint64_t savedState() {
+#if defined(_MSC_VER)
+		return _xgetbv(0);
+#else
+		uint32_t low, high;
+		__asm__("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+		return low | static_cast<uint64_t>(high) << 32;
+#endif
+	}
+
+	bool allBits(uint32_t reg, uint32_t bits) {
+		return (reg & bits) == bits;
+	}
+
+	int32_t detectCPULevel() {
+		uint32_t basic[4], leaf1[4], leaf7[4] = {}, extended[4] = {};
+		cpuid(0, 0, basic);
+		cpuid(1, 0, leaf1);
+		if (basic[0] >= 7)
+			cpuid(7, 0, leaf7);
+		cpuid(0x80000000, 0, extended);
+		if (extended[0] >= 0x80000001)
+			cpuid(0x80000001, 0, extended);
+		else
+			extended[2] = 0;
+
+		// SSE3, SSSE3, CX16, SSE4.1, SSE4.2, POPCNT + LAHF
+		if (!allBits(leaf1[2], 1u << 0 | 1u << 9 | 1u << 13 | 1u << 19 | 1u << 20 | 1u << 23) || !allBits(extended[2], 1u << 0))
+			return 1;
+
+		// FMA, MOVBE, OSXSAVE, AVX, F16C + BMI1, AVX2, BMI2 + LZCNT, with XMM and YMM saved
+		const bool osxsave = allBits(leaf1[2], 1u << 27);
+		const uint64_t state = osxsave ? savedState() : 0;
+		if (!allBits(leaf1[2], 1u << 12 | 1u << 22 | 1u << 27 | 1u << 28 | 1u << 29) ||
+			!allBits(leaf7[1], 1u << 3 | 1u << 5 | 1u << 8) || !allBits(extended[2], 1u << 5) || (state & 0x6) != 0x6)
+			return 2;
+
+		// AVX512 F, DQ, CD, BW, VL with the opmask and ZMM state saved
+		if (!allBits(leaf7[1], 1u << 16 | 1u << 17 | 1u << 28 | 1u << 30 | 1u << 31) || (state & 0xe0) != 0xe0)
+			return 3;
+		return 4;
+	}
+#else
+	int32_t detectCPULevel() {
+		return 1;
+	}
+#endif
+
+	// rdtsc where available, steady_clock nanoseconds otherwise
+	inline int64_t profNow() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		return static_cast<int64_t>(__rdtsc());
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	struct ProfSlot {
+		int64_t calls     = 0;
+		int64_t inclusive = 0;   // outermost activations only, recursion isn't counted twice
+		int64_t exclusive = 0;
+		int32_t depth     = 0;
+	};
+
+	struct ProfFrame {
+		int32_t id;
+		int64_t start;
+		int64_t children;        // inclusive time of instrumented callees
+	};
+
+	struct ThreadProfile;
+
+	std::mutex profLock;
+	bool profAtExit = false;
+	std::chrono::steady_clock::time_point profClockStart;
+	int64_t profTickStart = 0;
+
+	std::vector<std::string>& profNames() {
+		static std::vector<std::string> names;
+		return names;
+	}
+
+	std::vector<ThreadProfile*>& profThreads() {
+		static std::vector<ThreadProfile*> threads;
+		return threads;
+	}
+
+	// slots of threads that already exited
+	std::vector<ProfSlot>& profRetired() {
+		static std::vector<ProfSlot> retired;
+		return retired;
+	}
+
+	// JIT functions replaced by their optimized version
+	struct TierEvent {
+		std::string name;
+		int64_t calls;
+		double  compileMs;
+	};
+
+	std::vector<TierEvent>& profTiers() {
+		static std::vector<TierEvent> tiers;
+		return tiers;
+	}
+
+	void addSlots(std::vector<ProfSlot>& total, const std::vector<ProfSlot>& slots) {
+		if (total.size() < slots.size())
+			total.resize(slots.size());
+		for (size_t i = 0; i < slots.size(); i++) {
+			total[i].calls     += slots[i].calls;
+			total[i].inclusive += slots[i].inclusive;
+			total[i].exclusive += slots[i].exclusive;
+		}
+	}
+
+	// Per thread, so counting never contends
+	struct ThreadProfile {
+		std::vector<ProfSlot>  slots;
+		std::vector<ProfFrame> stack = std::vector<ProfFrame>(64);
+		size_t depth = 0;
+
+		ThreadProfile() {
+			std::lock_guard<std::mutex> guard(profLock);
+			profThreads().push_back(this);
+		}
+
+		~ThreadProfile() {
+			std::lock_guard<std::mutex> guard(profLock);
+			addSlots(profRetired(), slots);
+			auto& threads = profThreads();
+			threads.erase(std::remove(threads.begin(), threads.end(), this), threads.end());
+		}
+	};
+
+	// plain pointer on the hot path, a thread_local with a destructor costs
+	// an init check on every access
+	thread_local ThreadProfile* t_profile = nullptr;
+
+	ThreadProfile* createThreadProfile() {
+		struct Owner {
+			ThreadProfile profile;
+			~Owner() { t_profile = nullptr; }
+		};
+		thread_local Owner owner;
+		t_profile = &owner.profile;
+		return t_profile;
+	}
+
+	// under profLock
+	void startProfile() {
+		if (profAtExit)
+			return;
+
+		profAtExit = true;
+		profClockStart = std::chrono::steady_clock::now();
+		profTickStart  = profNow();
+
+		// constructed first, so they outlive the reporter
+		profNames();
+		profThreads();
+		profRetired();
+		profTiers();
+		std::atexit(dalg_prof_report);
+	}
+
+	int32_t registerSite(dalg_prof_site* site) {
+		auto* id = reinterpret_cast<std::atomic<int32_t>*>(&site->id);
+
+		std::lock_guard<std::mutex> guard(profLock);
+		int32_t index = id->load(std::memory_order_relaxed);
+		if (index >= 0)
+			return index;
+
+		startProfile();
+
+		// one row per name, a recompiled function (JIT tier-up) has a site of its own
+		auto& names = profNames();
+		auto known = std::find(names.begin(), names.end(), site->name);
+		index = static_cast<int32_t>(known - names.begin());
+
+		// the name is copied, JIT'd code may be gone at exit
+		if (known == names.end())
+			names.push_back(site->name);
+		id->store(index, std::memory_order_release);
+		return index;
+	}
+
+}
+
+void dalg_init(void) {
+	ThreadPool::get().start();
+}
+
+void dalg_shutdown(void) {
+	ThreadPool::get().shutdown();
+	dalg_memo_report();
+}
+
+double dalg_parfor(dalg_chunk_fn body, void* env, int64_t count, int32_t op) {
+	if (count <= 0)
+		return identity(op);
+
+	ThreadPool& pool = ThreadPool::get();
+
+	// a few chunks per thread leaves room for stealing on uneven iterations
+	const int64_t chunks = std::min<int64_t>(count, pool.size() * 4);
+	if (chunks <= 1)
+		return body(env, 0, count);
+
+	std::vector<Chunk> parts(chunks);
+	std::atomic<int64_t> remaining{ chunks };
+
+	for (int64_t k = chunks - 1; k >= 0; k--) {
+		parts[k] = { body, env, count * k / chunks, count * (k + 1) / chunks, 0.0, &remaining };
+		pool.push({ runChunk, &parts[k] });
+	}
+
+	pool.waitFor(remaining);
+
+	// partial results are combined in order, so the result doesn't depend on scheduling
+	double result = identity(op);
+	for (const auto& part : parts)
+		result = combine(op, result, part.result);
+	return result;
+}
+
+void* dalg_spawn(dalg_task_fn fn, const double* args, int32_t nargs) {
+	SpawnTask* task = new SpawnTask;
+	task->fn = fn;
+
+	if (nargs <= 4) {
+		std::copy(args, args + nargs, task->inlineArgs);
+		task->args = task->inlineArgs;
+	}
+	else {
+		task->heapArgs.assign(args, args + nargs);
+		task->args = task->heapArgs.data();
+	}
+
+	ThreadPool::get().push({ runSpawn, task });
+	return task;
+}
+
+// Unstolen tasks sit at the back of our own deque, so the syncing thread
+// usually just runs the call itself
+void dalg_sync(void* future, double* result) {
+	if (!future)
+		return;
+
+	SpawnTask* task = static_cast<SpawnTask*>(future);
+	ThreadPool::get().waitFor(task->remaining);
+
+	if (result)
+		*result = task->result;
+	delete task;
+}
+
+void dalg_memo_register(const char* name, const int64_t* counters) {
+	std::lock_guard<std::mutex> guard(memoLock);
+
+	auto& stats = memoStats();
+	for (const auto& m : stats)
+		if (m.counters == counters)
+			return;
+
+	if (!memoAtExit) {
+		memoAtExit = true;
+		std::atexit(dalg_memo_report);
+	}
+	stats.push_back({ name, counters });
+}
+
+void dalg_memo_report(void) {
+	std::lock_guard<std::mutex> guard(memoLock);
+
+	for (const auto& m : memoStats()) {
+		const int64_t hits = m.counters[0], misses = m.counters[1];
+		const double rate = hits + misses ? 100.0 * hits / (hits + misses) : 0.0;
+		std::fprintf(stderr, "[memo] %s: %lld hits, %lld misses, %.1f%% hit rate\n",
+			m.name, static_cast<long long>(hits), static_cast<long long>(misses), rate);
+	}
+	memoStats().clear();
+}
+
+static_assert(sizeof(std::atomic<int32_t>) == sizeof(int32_t), "dalg_prof_site::id is used as an atomic");
+
+void dalg_prof_enter(dalg_prof_site* site) {
+	int32_t index = reinterpret_cast<std::atomic<int32_t>*>(&site->id)->load(std::memory_order_acquire);
+	if (index < 0)
+		index = registerSite(site);
+
+	ThreadProfile* profile = t_profile;
+	if (!profile)
+		profile = createThreadProfile();
+
+	// dalg_prof_report reads the slots of every thread under profLock, a
+	// resize moves them, new sites are rare so the lock stays off the hot path
+	if (profile->slots.size() <= static_cast<size_t>(index)) {
+		std::lock_guard<std::mutex> guard(profLock);
+		profile->slots.resize(index + 1);
+	}
+	if (profile->depth == profile->stack.size())
+		profile->stack.resize(profile->depth * 2);
+
+	ProfSlot& slot = profile->slots[index];
+	slot.calls++;
+	slot.depth++;
+	profile->stack[profile->depth++] = { index, profNow(), 0 };
+}
+
+void dalg_prof_exit(void) {
+	const int64_t now = profNow();
+	ThreadProfile* profile = t_profile;
+
+	const ProfFrame& frame = profile->stack[--profile->depth];
+	const int64_t elapsed = now - frame.start;
+
+	ProfSlot& slot = profile->slots[frame.id];
+	slot.exclusive += elapsed - frame.children;
+	if (--slot.depth == 0)
+		slot.inclusive += elapsed;
+
+	if (profile->depth > 0)
+		profile->stack[profile->depth - 1].children += elapsed;
+}
+
+void dalg_prof_tier(const char* name, int64_t calls, double compileMs) {
+	std::lock_guard<std::mutex> guard(profLock);
+	startProfile();
+	profTiers().push_back(TierEvent{ name, calls, compileMs });
+}
+
+void dalg_prof_report(void) {
+	std::lock_guard<std::mutex> guard(profLock);
+
+	std::vector<ProfSlot> total = profRetired();
+	for (const ThreadProfile* thread : profThreads())
+		addSlots(total, thread->slots);
+
+	const auto& names = profNames();
+	total.resize(names.size());
+
+	// ticks -> nanoseconds, measured over the whole run
+	const double elapsedNs = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - profClockStart).count());
+	const int64_t ticks = profNow() - profTickStart;
+	const double nsPerTick = ticks > 0 ? elapsedNs / ticks : 1.0;
+
+	std::vector<size_t> order(names.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return total[a].exclusive > total[b].exclusive; });
+
+	const char* format = std::getenv("DALG_PROFILE");
+	if (format && std::strcmp(format, "json") == 0) {
+		std::fprintf(stderr, "{\"functions\": [");
+		for (size_t i = 0; i < order.size(); i++) {
+			const ProfSlot& s = total[order[i]];
+			std::fprintf(stderr, "%s\n  {\"name\": \"%s\", \"calls\": %lld, \"inclusive_ns\": %.0f, \"exclusive_ns\": %.0f}",
+				i ? "," : "", names[order[i]].c_str(), static_cast<long long>(s.calls), s.inclusive * nsPerTick, s.exclusive * nsPerTick);
+		}
+		std::fprintf(stderr, "\n]");
+
+		const auto& tiers = profTiers();
+		if (!tiers.empty()) {
+			std::fprintf(stderr, ", \"tier_ups\": [");
+			for (size_t i = 0; i < tiers.size(); i++)
+				std::fprintf(stderr, "%s\n  {\"name\": \"%s\", \"calls\": %lld, \"compile_ms\": %.3f}",
+					i ? "," : "", tiers[i].name.c_str(), static_cast<long long>(tiers[i].calls), tiers[i].compileMs);
+			std::fprintf(stderr, "\n]");
+		}
+		std::fprintf(stderr, "}\n");
+		return;
+	}
+
+	std::fprintf(stderr, "[profile] %-24s %12s %14s %14s %12s\n", "function", "calls", "inclusive ms", "exclusive ms", "excl ns/call");
+	for (size_t i : order) {
+		const ProfSlot& s = total[i];
+		std::fprintf(stderr, "[profile] %-24s %12lld %14.3f %14.3f %12.1f\n", names[i].c_str(), static_cast<long long>(s.calls),
+			s.inclusive * nsPerTick / 1e6, s.exclusive * nsPerTick / 1e6, s.calls ? s.exclusive * nsPerTick / s.calls : 0.0);
+	}
+
+	for (const TierEvent& tier : profTiers())
+		std::fprintf(stderr, "[profile] tier-up %-16s after %lld calls, optimized in %.3f ms\n", tier.name.c_str(),
+			static_cast<long long>(tier.calls), tier.compileMs);
+}
+
+int32_t dalg_cpu_level(void) {
+	static const int32_t level = []() {
+		int32_t detected = detectCPULevel();
+		if (const char* cap = std::getenv("DALG_CPU_LEVEL"))
+			detected = std::max(1, std::min(detected, std::atoi(cap)));
+		return detected;
+	}();
+	return level;
+}
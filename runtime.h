@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+
+// dalg runtime -> linked with the generated code
+// clang++ -O3 output.ll runtime.cpp -o output.exe
+//
+// Thread count comes from DALG_NUM_THREADS, default is every core.
+// DALG_PROFILE=json switches the --instrument report to JSON.
+// DALG_CPU_LEVEL caps the x86-64 level @multiversion functions are picked for.
+
+enum ReduceOp : int32_t {
+    reduce_none,
+    reduce_add,        // reduce(+)
+    reduce_mul,        // reduce(*)
+    reduce_min,        // reduce(min)
+    reduce_max,        // reduce(max)
+};
+
+extern "C" {
+
+    // Starts the worker threads, otherwise the first parfor or spawn does.
+    // Also restarts them after dalg_shutdown. For programs linking a dalg
+    // library (--emit=staticlib).
+    void dalg_init(void);
+
+    // Joins the worker threads and prints the @memo counters. Later parfor
+    // and spawn calls still work, on the calling thread.
+    void dalg_shutdown(void);
+
+    // Runs iterations [begin, end) and returns their reduced value
+    typedef double (*dalg_chunk_fn)(void* env, int64_t begin, int64_t end);
+
+    // Splits [0, count) into chunks for the work-stealing pool
+    double dalg_parfor(dalg_chunk_fn body, void* env, int64_t count, int32_t op);
+
+    // Calls the spawned function with its argument array
+    typedef double (*dalg_task_fn)(const double* args);
+
+    // Queues fn(args) on the pool and returns its future, args are copied
+    void* dalg_spawn(dalg_task_fn fn, const double* args, int32_t nargs);
+
+    // Waits for a future (null is a no-op), stores its value and frees it
+    void dalg_sync(void* future, double* result);
+
+    // @memo counters { hits, misses } of a function (--instrument), printed at exit
+    void dalg_memo_register(const char* name, const int64_t* counters);
+
+    // Prints and forgets the registered counters, call it before the code
+    // holding them is unloaded (a JIT), otherwise it runs at exit
+    void dalg_memo_report(void);
+
+    // One function compiled with --instrument, the id is set on its first call
+    typedef struct dalg_prof_site {
+        const char* name;
+        int32_t     id;    // -1 until registered
+    } dalg_prof_site;
+
+    // Around every call of an instrumented function. Counts and times go to
+    // slots of the calling thread, exclusive time leaves out instrumented callees.
+    void dalg_prof_enter(dalg_prof_site* site);
+    void dalg_prof_exit(void);
+
+    // A JIT function was replaced by its optimized version after "calls"
+    // calls (--jit --instrument), listed after the table
+    void dalg_prof_tier(const char* name, int64_t calls, double compileMs);
+
+    // Table sorted by exclusive time on stderr (JSON with DALG_PROFILE=json),
+    // runs at exit once a site is registered
+    void dalg_prof_report(void);
+
+    // x86-64 level of the running CPU: 1 baseline, 2 (SSE4.2, POPCNT), 3 (AVX2,
+    // FMA, BMI2), 4 (AVX-512 F/BW/CD/DQ/VL), counting only registers the OS
+    // saves. 1 on other architectures.
+    int32_t dalg_cpu_level(void);
+
+}
@@ -0,0 +1,343 @@
+#include "server.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <llvm/Support/xxhash.h>
+
+#include "compiler.h"
+#include "dalg.h"
+#include "lrucache.h"
+#include "utility.h"
+
+#ifndef _WIN32
+
+namespace {
+
+	const size_t maxRequest = 64 << 20;
+
+	struct ServerStats {
+		std::atomic<long long> requests{ 0 };
+		std::atomic<long long> errors{ 0 };
+		std::atomic<long long> cacheHits{ 0 };
+		std::atomic<long long> totalMicros{ 0 };
+		std::atomic<long long> maxMicros{ 0 };
+	} stats;
+
+	// Blocking reads and writes of whole buffers, closes the socket
+	class Socket {
+		int fd;
+
+	public:
+		explicit Socket(int f) : fd(f) {}
+		~Socket() {
+			close(fd);
+		}
+
+		Socket(const Socket&) = delete;
+		Socket& operator=(const Socket&) = delete;
+
+		// headers are short, a byte at a time keeps the body unbuffered
+		bool readLine(std::string& line) {
+			line.clear();
+			char c = 0;
+			while (recv(fd, &c, 1, 0) == 1) {
+				if (c == '\n')
+					return true;
+				if (line.size() > 256)
+					return false;
+				line += c;
+			}
+			return false;
+		}
+
+		bool readExact(std::string& buffer, size_t size) {
+			buffer.resize(size);
+			size_t done = 0;
+			while (done < size) {
+				const ssize_t n = recv(fd, &buffer[done], size - done, 0);
+				if (n <= 0)
+					return false;
+				done += n;
+			}
+			return true;
+		}
+
+		bool writeAll(const std::string& data) {
+			size_t done = 0;
+			while (done < data.size()) {
+				const ssize_t n = send(fd, data.data() + done, data.size() - done, 0);
+				if (n <= 0)
+					return false;
+				done += n;
+			}
+			return true;
+		}
+	};
+
+	std::runtime_error systemError(const std::string& what) {
+		return std::runtime_error("[Server] " + what + ": " + std::strerror(errno));
+	}
+
+	sockaddr_un socketAddress(const std::string& path) {
+		sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("[Server] Socket path is too long: " + path);
+		std::strcpy(addr.sun_path, path.c_str());
+		return addr;
+	}
+
+	// Object emission machines, creating one costs more than a small compile
+	std::mutex machineLock;
+	std::vector<std::unique_ptr<llvm::TargetMachine>> machines;
+
+	class PooledMachine {
+		std::unique_ptr<llvm::TargetMachine> machine;
+
+	public:
+		PooledMachine() {
+			{
+				std::lock_guard<std::mutex> guard(machineLock);
+				if (!machines.empty()) {
+					machine = std::move(machines.back());
+					machines.pop_back();
+				}
+			}
+			if (!machine)
+				machine = createObjectMachine();
+		}
+
+		~PooledMachine() {
+			std::lock_guard<std::mutex> guard(machineLock);
+			machines.push_back(std::move(machine));
+		}
+
+		llvm::TargetMachine* get() const {
+			return machine.get();
+		}
+	};
+
+	// Compiled outputs by kind, -O and source text, the least recently used
+	// one goes when a new output doesn't fit
+	const size_t cacheCapacity = 256;
+	struct CachedOutput {
+		std::string key;
+		std::string output;
+	};
+	std::mutex cacheLock;
+	LruCache<CachedOutput> cache(cacheCapacity);
+
+	std::string compile(const std::string& kind, bool opt, const std::string& source) {
+		if (kind != "ll" && kind != "bc" && kind != "o")
+			throw std::runtime_error("[Server] Unknown output kind: " + kind);
+
+		const std::string key = kind + (opt ? "1" : "0") + source;
+		const uint64_t hash = llvm::xxHash64(key);
+		{
+			std::lock_guard<std::mutex> guard(cacheLock);
+			CachedOutput* cached = cache.find(hash);
+			if (cached && cached->key == key) {
+				stats.cacheHits++;
+				return cached->output;
+			}
+		}
+
+		// codegen state is thread_local, connections compile in parallel
+		compileSource(source, "dalg");
+		PooledMachine machine;
+		setTarget(machine.get());
+		if (opt)
+			optimize(machine.get());
+		else
+			lowerCoroutines();
+
+		std::string output;
+		if (kind == "o") {
+			llvm::SmallVector<char, 0> buffer;
+			llvm::raw_svector_ostream os(buffer);
+			emitObject(os, machine.get());
+			output.assign(buffer.begin(), buffer.end());
+		}
+		else {
+			llvm::raw_string_ostream os(output);
+			if (kind == "bc")
+				llvm::WriteBitcodeToFile(*g_Module, os);
+			else
+				g_Module->print(os, nullptr);
+			os.flush();
+		}
+		g_Module.reset();
+
+		std::lock_guard<std::mutex> guard(cacheLock);
+		cache.insert(hash, CachedOutput{ key, output });
+		return output;
+	}
+
+	// libdalg caches the compiled source, running it again only calls main
+	std::string run(const std::string& source) {
+		dalg::Session session;
+		session.compile(source);
+		const double result = session.lookup<double()>("main")();
+		std::fflush(stdout);
+
+		std::ostringstream out;
+		out.precision(17);
+		out << result;
+		return out.str();
+	}
+
+	std::string report() {
+		const long long requests = stats.requests;
+		std::ostringstream out;
+		out << "requests " << requests << "\n"
+			<< "errors " << stats.errors << "\n"
+			<< "compile cache hits " << stats.cacheHits << "\n"
+			<< "mean us " << (requests ? stats.totalMicros / requests : 0) << "\n"
+			<< "max us " << stats.maxMicros << "\n";
+		return out.str();
+	}
+
+	void handle(int fd) {
+		Socket socket(fd);
+
+		std::string header;
+		while (socket.readLine(header)) {
+			std::istringstream in(header);
+			std::string command, kind;
+			int opt = 0;
+			size_t length = 0;
+
+			in >> command;
+			if (command == "compile")
+				in >> kind >> opt >> length;
+			else if (command == "run")
+				in >> length;
+
+			std::string source;
+			if (!in || length > maxRequest || !socket.readExact(source, length))
+				return;
+
+			const auto start = std::chrono::steady_clock::now();
+			std::string payload;
+			bool ok = true;
+			try {
+				if (command == "compile")
+					payload = compile(kind, opt != 0, source);
+				else if (command == "run")
+					payload = run(source);
+				else if (command == "stats")
+					payload = report();
+				else
+					throw std::runtime_error("[Server] Unknown request: " + command);
+			}
+			catch (const std::exception& err) {
+				payload = err.what();
+				ok = false;
+			}
+
+			const long long micros = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - start).count();
+			stats.requests++;
+			stats.totalMicros += micros;
+			if (!ok)
+				stats.errors++;
+			long long seen = stats.maxMicros;
+			while (micros > seen && !stats.maxMicros.compare_exchange_weak(seen, micros)) {}
+
+			const std::string reply = std::string(ok ? "ok " : "error ") + std::to_string(micros) + " " +
+				std::to_string(payload.size()) + "\n" + payload;
+			if (!socket.writeAll(reply))
+				return;
+		}
+	}
+
+}
+
+void serve(const std::string& path) {
+	// a client that hangs up must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	const sockaddr_un addr = socketAddress(path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		throw systemError("socket");
+
+	unlink(path.c_str());
+	if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+		throw systemError("bind " + path);
+	if (listen(fd, 64) != 0)
+		throw systemError("listen");
+
+	// targets, the JIT and a pooled machine are set up before the first request
+	run("fn main() { 0 }");
+	PooledMachine();
+
+	std::cerr << "[Server] Listening on " << path << "\n";
+	while (true) {
+		const int client = accept(fd, nullptr, nullptr);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			throw systemError("accept");
+		}
+		std::thread(handle, client).detach();
+	}
+}
+
+ServerReply serverRequest(const std::string& path, const std::string& header, const std::string& body) {
+	signal(SIGPIPE, SIG_IGN);
+
+	const sockaddr_un addr = socketAddress(path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		throw systemError("socket");
+	Socket socket(fd);
+
+	if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+		throw systemError("connect " + path);
+	if (!socket.writeAll(header + "\n" + body))
+		throw systemError("send");
+
+	std::string status;
+	if (!socket.readLine(status))
+		throw std::runtime_error("[Server] Connection closed");
+
+	std::istringstream in(status);
+	std::string result;
+	size_t length = 0;
+	ServerReply reply;
+	in >> result >> reply.micros >> length;
+	if (!in || length > maxRequest || !socket.readExact(reply.payload, length))
+		throw std::runtime_error("[Server] Bad reply: " + status);
+
+	if (result != "ok")
+		throw std::runtime_error(reply.payload);
+	return reply;
+}
+
+#else
+
+void serve(const std::string& path) {
+	throw std::runtime_error("[Server] --serve needs Unix domain sockets");
+}
+
+ServerReply serverRequest(const std::string& path, const std::string& header, const std::string& body) {
+	throw std::runtime_error("[Server] --client needs Unix domain sockets");
+}
+
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+
+// dalg --serve PATH -> compile daemon on a Unix domain socket
+//
+// One process keeps LLVM initialized: target machines, the libdalg source
+// cache and compiled objects stay warm between requests. Every connection
+// gets its own thread and can send any number of requests:
+//
+//   compile <ll|bc|o> <0|1 -O> <length>\n<source>   -> the output file
+//   run <length>\n<source>                          -> what main() returned
+//   stats\n                                         -> request counts and latency
+//
+// and each is answered with "ok <us> <length>\n<payload>" or
+// "error <us> <length>\n<message>", <us> is the time spent in the server.
+// print() in run requests writes to the server's stdout.
+
+// Never returns unless the socket can't be set up
+void serve(const std::string& path);
+
+struct ServerReply {
+    std::string payload;
+    long long   micros = 0;   // server side latency
+};
+
+// One request on a new connection, error replies are thrown
+ServerReply serverRequest(const std::string& path, const std::string& header, const std::string& body = "");
@@ -0,0 +1,89 @@
+#include "splitcodegen.h"
+
+#include <atomic>
+#include <thread>
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Transforms/Utils/SplitModule.h>
+
+#include "archive.h"
+#include "utility.h"
+
+// One partition in a context of the calling (pool) thread -> object file
+static llvm::SmallVector<char, 0> compilePartition(const llvm::SmallVector<char, 0>& bitcode, bool opt, bool embedBitcode) {
+	g_Context = std::make_unique<llvm::LLVMContext>();
+
+	auto module = llvm::parseBitcodeFile(llvm::MemoryBufferRef(llvm::StringRef(bitcode.data(), bitcode.size()), "partition"), *g_Context);
+	if (!module)
+		throw std::runtime_error("[SplitCodegen] " + llvm::toString(module.takeError()));
+	g_Module = std::move(*module);
+
+	// target machines aren't thread safe
+	auto machine = createObjectMachine();
+	if (opt)
+		optimize(machine.get(), Pipeline::Finish);
+
+	// the partition as it came in, before the rest of O3, so LTO starts from pre-link IR
+	if (embedBitcode)
+		llvm::embedBitcodeInModule(*g_Module, llvm::MemoryBufferRef(llvm::StringRef(bitcode.data(), bitcode.size()), "partition"),
+			true, false, std::vector<uint8_t>());
+
+	llvm::SmallVector<char, 0> object;
+	llvm::raw_svector_ostream os(object);
+	emitObject(os, machine.get());
+
+	g_Module.reset();
+	g_Context.reset();
+	return object;
+}
+
+void emitPartitioned(const std::string& output, unsigned partitions, bool opt, bool embedBitcode) {
+	auto machine = createObjectMachine();
+	setTarget(machine.get());
+
+	if (opt)
+		optimize(machine.get(), Pipeline::Simplify);
+	else
+		lowerCoroutines();
+
+	// internal symbols stay in the partition of their users, nothing is
+	// renamed or exported; the partitions travel as bitcode between contexts
+	std::vector<llvm::SmallVector<char, 0>> bitcode;
+	llvm::SplitModule(*g_Module, std::max(1u, partitions), [&](std::unique_ptr<llvm::Module> part) {
+		bitcode.emplace_back();
+		llvm::raw_svector_ostream os(bitcode.back());
+		llvm::WriteBitcodeToFile(*part, os);
+	}, true);
+
+	std::vector<llvm::SmallVector<char, 0>> objects(bitcode.size());
+	std::vector<std::string> errors(bitcode.size());
+	std::atomic<size_t> next{ 0 };
+
+	auto worker = [&]() {
+		for (size_t i = next++; i < bitcode.size(); i = next++) {
+			try {
+				objects[i] = compilePartition(bitcode[i], opt, embedBitcode);
+			}
+			catch (const std::exception& err) {
+				errors[i] = err.what();
+			}
+			bitcode[i].clear();
+		}
+	};
+
+	// g_Module of this thread stays as it was
+	std::vector<std::thread> pool;
+	for (size_t t = 0; t < bitcode.size(); t++)
+		pool.emplace_back(worker);
+	for (auto& t : pool)
+		t.join();
+
+	for (const auto& err : errors)
+		if (!err.empty())
+			throw std::runtime_error(err);
+
+	ArchiveWriter archive(output);
+	for (const auto& object : objects)
+		archive.add(object.data(), object.size());
+	archive.finish();
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+
+// Parallel backend. g_Module (optimized with -O up to the inliner) is split
+// into "partitions" modules, each one gets the rest of O3 and machine code
+// generation on a thread and a context of its own. The objects go to the
+// archive "output", one member per partition. "embedBitcode" keeps the bitcode
+// of every partition in its object (.llvmbc section).
+void emitPartitioned(const std::string& output, unsigned partitions, bool opt, bool embedBitcode = false);
@@ -0,0 +1,130 @@
+#include "ssa.h"
+
+#include <vector>
+
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Constants.h>
+
+void SSABuilder::clear() {
+	currentDef.clear();
+	incompletePhis.clear();
+	sealed.clear();
+	phis.clear();
+	types.clear();
+}
+
+void SSABuilder::writeVariable(const std::string& name, llvm::BasicBlock* block, llvm::Value* value) {
+	currentDef[name][block] = value;
+	types.emplace(name, value->getType());
+}
+
+llvm::Value* SSABuilder::readVariable(const std::string& name, llvm::BasicBlock* block) {
+	auto defs = currentDef.find(name);
+	if (defs != currentDef.end()) {
+		auto def = defs->second.find(block);
+		if (def != defs->second.end() && def->second)
+			return def->second;
+	}
+	return readVariableRecursive(name, block);
+}
+
+llvm::Type* SSABuilder::variableType(const std::string& name) const {
+	auto type = types.find(name);
+	return type != types.end() ? type->second : nullptr;
+}
+
+void SSABuilder::sealBlock(llvm::BasicBlock* block) {
+	auto pending = incompletePhis.find(block);
+	if (pending != incompletePhis.end()) {
+		auto pendingPhis = std::move(pending->second);
+		incompletePhis.erase(pending);
+		for (const auto& phi : pendingPhis)
+			addPhiOperands(phi.first, phi.second);
+	}
+	sealed.insert(block);
+}
+
+llvm::Value* SSABuilder::readVariableRecursive(const std::string& name, llvm::BasicBlock* block) {
+	llvm::Value* value = nullptr;
+
+	if (!sealed.count(block)) {
+		// operands come at sealing
+		llvm::PHINode* phi = createPhi(name, block);
+		incompletePhis[block][name] = phi;
+		value = phi;
+	}
+	else if (llvm::BasicBlock* pred = block->getSinglePredecessor())
+		value = readVariable(name, pred);
+	else if (llvm::pred_empty(block))
+		value = zero(name, block->getContext());
+	else {
+		// the phi breaks cycles through loops
+		llvm::PHINode* phi = createPhi(name, block);
+		writeVariable(name, block, phi);
+		value = addPhiOperands(name, phi);
+	}
+
+	writeVariable(name, block, value);
+	return value;
+}
+
+llvm::Value* SSABuilder::addPhiOperands(const std::string& name, llvm::PHINode* phi) {
+	// operands are added at once, a half built phi never looks trivial
+	std::vector<std::pair<llvm::WeakTrackingVH, llvm::BasicBlock*>> incoming;
+	for (llvm::BasicBlock* pred : llvm::predecessors(phi->getParent()))
+		incoming.emplace_back(readVariable(name, pred), pred);
+
+	for (const auto& in : incoming)
+		phi->addIncoming(in.first, in.second);
+	return tryRemoveTrivialPhi(phi);
+}
+
+// phi(x, x, self...) -> x
+llvm::Value* SSABuilder::tryRemoveTrivialPhi(llvm::PHINode* phi) {
+	llvm::Value* same = nullptr;
+	for (llvm::Value* op : phi->incoming_values()) {
+		if (op == same || op == phi)
+			continue;
+		if (same)
+			return phi;
+		same = op;
+	}
+	if (!same)
+		same = llvm::Constant::getNullValue(phi->getType());
+
+	std::vector<llvm::WeakTrackingVH> users;
+	for (llvm::User* user : phi->users())
+		if (user != phi && llvm::isa<llvm::PHINode>(user))
+			users.push_back(user);
+
+	phi->replaceAllUsesWith(same);
+	phis.erase(phi);
+	phi->eraseFromParent();
+
+	// users may have become trivial too, "same" among them
+	llvm::WeakTrackingVH result(same);
+	for (auto& user : users)
+		if (auto* userPhi = llvm::dyn_cast_or_null<llvm::PHINode>(user))
+			if (phis.count(userPhi))
+				tryRemoveTrivialPhi(userPhi);
+
+	return result;
+}
+
+llvm::PHINode* SSABuilder::createPhi(const std::string& name, llvm::BasicBlock* block) {
+	llvm::Type* type = variableType(name);
+	if (!type)
+		type = llvm::Type::getDoubleTy(block->getContext());
+
+	llvm::PHINode* phi = block->empty()
+		? llvm::PHINode::Create(type, 0, name, block)
+		: llvm::PHINode::Create(type, 0, name, &block->front());
+	phis.insert(phi);
+	return phi;
+}
+
+// 0.0 in every lane
+llvm::Value* SSABuilder::zero(const std::string& name, llvm::LLVMContext& context) const {
+	llvm::Type* type = variableType(name);
+	return llvm::Constant::getNullValue(type ? type : llvm::Type::getDoubleTy(context));
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/ValueHandle.h>
+
+// On-the-fly SSA construction, Braun et al. "Simple and Efficient
+// Construction of SSA Form" (CC 2013). Variables are read and written per
+// block while the IR is generated; a block is sealed once all of its
+// predecessors are branched in, reads of an unsealed block get a phi that is
+// completed at sealing. Trivial phis are removed right away.
+class SSABuilder {
+    // values follow replaceAllUsesWith, so removing a phi updates them
+    std::map<std::string, std::map<llvm::BasicBlock*, llvm::WeakTrackingVH>> currentDef;
+    std::map<llvm::BasicBlock*, std::map<std::string, llvm::PHINode*>> incompletePhis;
+    std::set<llvm::BasicBlock*> sealed;
+    std::set<llvm::PHINode*> phis;   // made here, the only phis ever removed
+    std::map<std::string, llvm::Type*> types;   // of the first write, double or a vector
+
+public:
+    void clear();
+
+    void writeVariable(const std::string& name, llvm::BasicBlock* block, llvm::Value* value);
+
+    // 0.0 when the variable has no definition on some path
+    llvm::Value* readVariable(const std::string& name, llvm::BasicBlock* block);
+
+    // Type of the first write, null before it
+    llvm::Type* variableType(const std::string& name) const;
+
+    void sealBlock(llvm::BasicBlock* block);
+
+private:
+    llvm::Value* readVariableRecursive(const std::string& name, llvm::BasicBlock* block);
+    llvm::Value* addPhiOperands(const std::string& name, llvm::PHINode* phi);
+    llvm::Value* tryRemoveTrivialPhi(llvm::PHINode* phi);
+    llvm::PHINode* createPhi(const std::string& name, llvm::BasicBlock* block);
+    llvm::Value* zero(const std::string& name, llvm::LLVMContext& context) const;
+};
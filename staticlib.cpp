@@ -0,0 +1,91 @@
+#include "staticlib.h"
+
+#include <cctype>
+#include <fstream>
+
+#include <llvm/Support/Path.h>
+
+#include "splitcodegen.h"
+#include "utility.h"
+
+namespace {
+
+	std::string cType(const llvm::Type* type) {
+		if (type->isDoubleTy())
+			return "double";
+		if (type->isFloatTy())
+			return "float";
+		if (type->isVoidTy())
+			return "void";
+		if (type->isIntegerTy(64))
+			return "int64_t";
+		if (type->isIntegerTy(32))
+			return "int32_t";
+		if (type->isPointerTy())
+			return "double*";   // @batch columns
+		return "";
+	}
+
+	// double f(double a, double b); and void f_batch(const double* a, ..., double* out, int64_t n);
+	std::string declaration(const llvm::Function& func) {
+		std::string decl = cType(func.getReturnType()) + " " + func.getName().str() + "(";
+		for (const auto& arg : func.args()) {
+			if (arg.getArgNo())
+				decl += ", ";
+			if (arg.onlyReadsMemory())
+				decl += "const ";
+			decl += cType(arg.getType());
+			if (arg.hasName())
+				decl += " " + arg.getName().str();
+		}
+		return decl + (func.arg_empty() ? "void);" : ");");
+	}
+
+	void writeHeader(const std::string& path, const std::string& library) {
+		std::string guard = "DALG_" + llvm::sys::path::stem(path).str() + "_H";
+		for (auto& c : guard)
+			c = std::isalnum(static_cast<unsigned char>(c)) ? static_cast<char>(std::toupper(static_cast<unsigned char>(c))) : '_';
+
+		std::ofstream out(path);
+		if (!out)
+			throw std::runtime_error("[StaticLib] Can't write " + path);
+
+		out << "// Generated by dalg for " << library << ", link it with the dalg runtime (runtime.cpp)\n"
+			<< "#ifndef " << guard << "\n#define " << guard << "\n\n"
+			<< "#include <stdint.h>\n\n"
+			<< "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n"
+			<< "// Worker threads of parfor and spawn: dalg_init starts them before the first\n"
+			<< "// call (again after a shutdown), dalg_shutdown joins them and prints the\n"
+			<< "// @memo counters of --instrument\n"
+			<< "void dalg_init(void);\nvoid dalg_shutdown(void);\n\n";
+
+		// generators return a coroutine handle, C can't loop over it
+		for (const auto& func : *g_Module) {
+			if (func.isDeclaration() || !func.hasExternalLinkage() || func.getReturnType()->isPointerTy())
+				continue;
+			if (cType(func.getReturnType()).empty())
+				throw std::runtime_error("[StaticLib] No C type for the result of " + func.getName().str());
+			out << declaration(func) << "\n";
+		}
+
+		out << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n";
+		if (!out)
+			throw std::runtime_error("[StaticLib] Writing " + path + " failed");
+	}
+}
+
+void writeStaticLibrary(const std::string& output, bool opt, unsigned codegenThreads) {
+	if (!hasExtension(output, ".a"))
+		throw std::runtime_error("[StaticLib] --emit=staticlib writes an archive, use -o libname.a");
+
+	// the program linking the library has a main of its own
+	if (llvm::Function* main = g_Module->getFunction("main"))
+		if (!main->isDeclaration())
+			throw std::runtime_error("[StaticLib] A library can't define main");
+
+	llvm::SmallString<128> header(output);
+	llvm::sys::path::replace_extension(header, ".h");
+	writeHeader(header.str().str(), llvm::sys::path::filename(output).str());
+
+	emitPartitioned(output, codegenThreads, opt, true);
+}
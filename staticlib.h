@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+
+// --emit=staticlib. g_Module becomes the archive "output" (.a) through the
+// partitioned backend, every member carries the bitcode it was compiled from
+// in .llvmbc (like clang -fembed-bitcode) for link time optimization. A C/C++
+// header next to it ("libk.a" -> "libk.h") declares the exported functions,
+// their @batch wrappers and the runtime's dalg_init / dalg_shutdown.
+void writeStaticLibrary(const std::string& output, bool opt, unsigned codegenThreads);
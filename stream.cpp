@@ -0,0 +1,207 @@
+#include "stream.h"
+
+#include "consteval.h"
+#include "debuginfo.h"
+#include "utility.h"
+
+FunctionReader::FunctionReader(const std::string& filename, uint64_t start, int firstLine)
+	: file(filename, std::ios::binary), buffer(1 << 16), offset(start), line(firstLine) {
+	if (!file)
+		throw std::runtime_error("[Stream] Can't read " + filename);
+	if (start)
+		file.seekg(static_cast<std::streamoff>(start));
+}
+
+bool FunctionReader::get(char& c) {
+	if (position == size) {
+		file.read(buffer.data(), buffer.size());
+		size = static_cast<size_t>(file.gcount());
+		position = 0;
+		if (size == 0)
+			return false;
+	}
+
+	c = buffer[position++];
+	offset++;
+	if (c == '\n')
+		line++;
+	return true;
+}
+
+bool FunctionReader::next(SourceChunk& chunk) {
+	chunk.text.clear();
+	chunk.offset = offset;
+	chunk.line = line;
+
+	int depth = 0;
+	bool inString = false, inComment = false;
+	char c;
+	while (get(c)) {
+		chunk.text += c;
+
+		if (inComment) {
+			if (c == '\n')
+				inComment = false;
+			continue;
+		}
+		if (inString) {
+			if (c == '"')
+				inString = false;
+			continue;
+		}
+
+		if (c == '#')
+			inComment = true;
+		else if (c == '"')
+			inString = true;
+		else if (c == '{')
+			depth++;
+		else if (c == '}' && --depth <= 0)
+			return true;
+		else if (c == ';' && depth == 0)
+			return true;
+	}
+
+	// whatever follows the last function, usually blank
+	return !chunk.text.empty();
+}
+
+namespace {
+	// Where a body starts in the sources, to parse it again
+	struct BodyLocation {
+		size_t input;
+		uint64_t offset;
+		int line;
+	};
+
+	// The function of a chunk, null when there is nothing but comments
+	std::unique_ptr<FunctionAST> parseChunk(const SourceChunk& chunk) {
+		auto tokens = lexer(chunk.text, chunk.line);
+		if (tokens.empty())
+			return nullptr;
+
+		Parser parser(tokens);
+		auto func = parser.parseFunction();
+		if (!func)
+			throw std::runtime_error("Function parsing failed!");
+		if (parser.getCurrentToken().token_type != tok_eof)
+			parser.parserError("Expected the next function");
+		return func;
+	}
+}
+
+void compileStreaming(const std::vector<std::string>& inputs, const std::string& output, bool opt) {
+	PrototypeTable prototypes;
+	std::map<std::string, EffectSummary> summaries;
+	std::map<std::string, BodyLocation> bodies;
+
+	// first pass -> prototypes, summaries and where the bodies are
+	for (size_t i = 0; i < inputs.size(); i++) {
+		try {
+			FunctionReader reader(inputs[i]);
+			SourceChunk chunk;
+			while (reader.next(chunk)) {
+				auto func = parseChunk(chunk);
+				if (!func)
+					continue;
+
+				const std::string& name = func->getProto().getName();
+				prototypes[name] = func->getProto().info();
+				if (func->isDeclaration()) {
+					if (func->hasSummary())
+						summaries[name] = func->summarize();   // pure extern fn
+					continue;
+				}
+
+				if (!bodies.emplace(name, BodyLocation{ i, chunk.offset, chunk.line }).second)
+					throw std::runtime_error("[Stream] Redefinition of function: " + name);
+				summaries[name] = func->summarize();
+			}
+		}
+		catch (const std::exception& err) {
+			throw std::runtime_error(inputs[i] + ": " + err.what());
+		}
+	}
+
+	const PurityTable purity = analyzePurity(summaries);
+	checkMemo(summaries, purity);
+
+	// compile time evaluation parses the bodies it calls again, they are
+	// dropped once the calling function is folded
+	std::map<std::string, std::unique_ptr<FunctionAST>> loaded;
+	ConstEval eval([&](const std::string& name) -> const FunctionAST* {
+		auto cached = loaded.find(name);
+		if (cached != loaded.end())
+			return cached->second.get();
+
+		auto body = bodies.find(name);
+		if (body == bodies.end())
+			return nullptr;
+
+		FunctionReader reader(inputs[body->second.input], body->second.offset, body->second.line);
+		SourceChunk chunk;
+		reader.next(chunk);
+		return (loaded[name] = parseChunk(chunk)).get();
+	}, purity);
+
+	auto machine = createObjectMachine();
+	ArchiveWriter archive(output);
+
+	// second pass -> one module and one object per function
+	for (size_t i = 0; i < inputs.size(); i++) {
+		try {
+			FunctionReader reader(inputs[i]);
+			SourceChunk chunk;
+			while (reader.next(chunk)) {
+				auto func = parseChunk(chunk);
+				if (!func || func->isDeclaration())
+					continue;
+				const std::string name = func->getProto().getName();
+
+				func->foldConstants(eval);
+				loaded.clear();
+
+				initializeLLVM(name);
+				initializeDebugInfo(inputs[i]);
+				g_Module->setTargetTriple(machine->getTargetTriple().str());
+				g_Module->setDataLayout(machine->createDataLayout());
+
+				g_Prototypes = &prototypes;
+				g_Purity = &purity;
+				try {
+					func->codegen();
+				}
+				catch (...) {
+					g_Prototypes = nullptr;
+					g_Purity = nullptr;
+					throw;
+				}
+				g_Prototypes = nullptr;
+				g_Purity = nullptr;
+				finalizeDebugInfo();
+
+				std::string verifyOutput;
+				llvm::raw_string_ostream rso(verifyOutput);
+				if (llvm::verifyModule(*g_Module, &rso))
+					throw std::runtime_error("[Stream] " + name + " -> " + rso.str());
+
+				setTarget(machine.get());
+				if (opt)
+					optimize(machine.get());
+				else
+					lowerCoroutines();
+
+				llvm::SmallVector<char, 0> object;
+				llvm::raw_svector_ostream os(object);
+				emitObject(os, machine.get());
+				archive.add(object.data(), object.size());
+			}
+		}
+		catch (const std::exception& err) {
+			throw std::runtime_error(inputs[i] + ": " + err.what());
+		}
+	}
+
+	archive.finish();
+	initializeLLVM("dalg");
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "archive.h"
+
+// Streamed compilation for sources too big to hold in memory. The files are
+// read one top level function at a time and every function becomes an
+// object of its own in a static archive, so memory follows the largest
+// function instead of the input.
+
+// One top level function (or prototype) of a source, with the annotations
+// and comments before it
+struct SourceChunk {
+    std::string text;
+    uint64_t offset = 0;   // of the first character in the file
+    int line = 1;          // line of the first character
+};
+
+// Splits a source at the '}' or ';' that ends a function, skipping strings
+// and comments like the lexer does
+class FunctionReader {
+    std::ifstream file;
+    std::vector<char> buffer;
+    size_t position = 0, size = 0;
+    uint64_t offset;
+    int line;
+
+    bool get(char& c);
+
+public:
+    explicit FunctionReader(const std::string& filename, uint64_t offset = 0, int line = 1);
+
+    // False at the end of the file
+    bool next(SourceChunk& chunk);
+};
+
+// Every input -> "output" (.a), one object per function. A first pass over
+// the sources collects prototypes and effect summaries, so calls don't need
+// declarations and purity sees the whole program; "opt" runs O3 per function.
+void compileStreaming(const std::vector<std::string>& inputs, const std::string& output, bool opt);
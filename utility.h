@@ -1,15 +1,33 @@
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/IR/PassManager.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/Coroutines/CoroCleanup.h>
+#include <llvm/Transforms/Coroutines/CoroEarly.h>
+#include <llvm/Transforms/Coroutines/CoroSplit.h>
 
+#include "multiversion.h"
 #include "parser.h"
+#include "splitcodegen.h"
 
 #include <sstream>
 #include <fstream>
 
-// LLVM Optimizations
-void optimize() {
-    llvm::PassBuilder passBuilder;
+// Parts of the O3 pipeline, split code generation runs the simplification
+// (inlining) on the whole module and the rest on every partition
+enum class Pipeline { Full, Simplify, Finish };
+
+// LLVM Optimizations, the target machine (if any) lets the vectorizer see vector registers
+inline void optimize(llvm::TargetMachine* machine = nullptr, Pipeline pipeline = Pipeline::Full) {
+    llvm::PassBuilder passBuilder(machine);
 
     llvm::LoopAnalysisManager lam;
     llvm::FunctionAnalysisManager fam;
@@ -22,13 +40,53 @@ void optimize() {
     passBuilder.registerLoopAnalyses(lam);
     passBuilder.crossRegisterProxies(lam, fam, cgam, mam);
 
-    llvm::ModulePassManager mpm = passBuilder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O3);
+    llvm::ModulePassManager mpm;
+    switch (pipeline) {
+    case Pipeline::Full:
+        mpm = passBuilder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O3);
+        break;
+    case Pipeline::Simplify:
+        mpm = passBuilder.buildModuleSimplificationPipeline(llvm::OptimizationLevel::O3, llvm::ThinOrFullLTOPhase::None);
+        break;
+    case Pipeline::Finish:
+        mpm = passBuilder.buildModuleOptimizationPipeline(llvm::OptimizationLevel::O3);
+        break;
+    }
 
     mpm.run(*g_Module, mam);
 }
 
+// Generators without -O: only the coroutine passes, the code generator can't
+// lower llvm.coro.* itself
+inline void lowerCoroutines() {
+    bool coroutines = false;
+    for (const auto& func : *g_Module)
+        coroutines |= func.isDeclaration() && func.getName().startswith("llvm.coro.");
+    if (!coroutines)
+        return;
+
+    llvm::PassBuilder passBuilder;
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+
+    passBuilder.registerModuleAnalyses(mam);
+    passBuilder.registerCGSCCAnalyses(cgam);
+    passBuilder.registerFunctionAnalyses(fam);
+    passBuilder.registerLoopAnalyses(lam);
+    passBuilder.crossRegisterProxies(lam, fam, cgam, mam);
+
+    llvm::ModulePassManager mpm;
+    mpm.addPass(llvm::createModuleToFunctionPassAdaptor(llvm::CoroEarlyPass()));
+    mpm.addPass(llvm::createModuleToPostOrderCGSCCPassAdaptor(llvm::CoroSplitPass()));
+    mpm.addPass(llvm::createModuleToFunctionPassAdaptor(llvm::CoroCleanupPass()));
+    mpm.run(*g_Module, mam);
+}
+
 // Token Write
-void write(const std::vector<TokenStore>& tokens) {
+inline void write(const std::vector<TokenStore>& tokens) {
     for (const auto& i : tokens) {
         std::cout << i.name << " -> ";
         switch (i.token_type) {
@@ -65,6 +123,19 @@ void write(const std::vector<TokenStore>& tokens) {
         case tok_not:           std::cout << "!"; break;
         case tok_for:           std::cout << "for"; break;
         case tok_while:         std::cout << "while"; break;
+        case tok_parfor:        std::cout << "parfor"; break;
+        case tok_reduce:        std::cout << "reduce"; break;
+        case tok_spawn:         std::cout << "spawn"; break;
+        case tok_sync:          std::cout << "sync"; break;
+        case tok_annotation:    std::cout << "annotation"; break;
+        case tok_const:         std::cout << "const"; break;
+        case tok_match:         std::cout << "match"; break;
+        case tok_arrow:         std::cout << "=>"; break;
+        case tok_yield:         std::cout << "yield"; break;
+        case tok_in:            std::cout << "in"; break;
+        case tok_extern:        std::cout << "extern"; break;
+        case tok_colon:         std::cout << "colon"; break;
+        case tok_thin_arrow:    std::cout << "thin_arrow"; break;
         }
         std::cout << "\n";
     }
@@ -72,7 +143,7 @@ void write(const std::vector<TokenStore>& tokens) {
 }
 
 
-std::string readFile(const std::string& filename) {
+inline std::string readFile(const std::string& filename) {
 
     std::ifstream file(filename);
     std::string temp;
@@ -89,7 +160,99 @@ std::string readFile(const std::string& filename) {
     return oss.str();
 }
 
-void write2File(const std::string& filename, bool opt = false) {
+inline bool hasExtension(const std::string& filename, const std::string& ext) {
+    return filename.size() >= ext.size() &&
+        filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+// --march=native|<cpu> -> CPU name and features for "target", native is the host
+// CPU with every feature it has. Throws on a CPU the target doesn't know.
+inline void selectCPU(const llvm::Target* target, const std::string& triple, const std::string& march,
+    std::string& cpu, std::string& features) {
+    cpu = march;
+    features.clear();
+    if (march == "native") {
+        cpu = llvm::sys::getHostCPUName().str();
+        llvm::StringMap<bool> host;
+        llvm::SubtargetFeatures list;
+        if (llvm::sys::getHostCPUFeatures(host))
+            for (const auto& feature : host)
+                list.AddFeature(feature.first(), feature.second);
+        features = list.getString();
+    }
+
+    std::unique_ptr<llvm::MCSubtargetInfo> info(target->createMCSubtargetInfo(triple, "", ""));
+    if (cpu != "generic" && !info->isCPUStringValid(cpu))
+        throw std::runtime_error("[Target] Unknown CPU for --march: " + march);
+}
+
+// Target machine of emitObject for the host target, generic CPU unless --march says otherwise
+inline std::unique_ptr<llvm::TargetMachine> createObjectMachine() {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    const std::string triple = llvm::sys::getDefaultTargetTriple();
+    std::string error;
+    const llvm::Target* target = llvm::TargetRegistry::lookupTarget(triple, error);
+    if (!target)
+        throw std::runtime_error("[emitObject] " + error);
+
+    std::string cpu, features;
+    selectCPU(target, triple, g_Options.march.empty() ? "generic" : g_Options.march, cpu, features);
+
+    llvm::TargetOptions options;
+    return std::unique_ptr<llvm::TargetMachine>(
+        target->createTargetMachine(triple, cpu, features, options, llvm::Reloc::PIC_));
+}
+
+// Triple, data layout and CPU of "machine" for g_Module, before optimizing it.
+// @multiversion functions get their versions, every other definition gets the
+// CPU as attributes, so .ll / .bc outputs keep --march.
+inline void setTarget(llvm::TargetMachine* machine) {
+    g_Module->setTargetTriple(machine->getTargetTriple().str());
+    g_Module->setDataLayout(machine->createDataLayout());
+    emitMultiversions(machine->getTargetTriple());
+
+    const std::string cpu = machine->getTargetCPU().str();
+    const std::string features = machine->getTargetFeatureString().str();
+    for (auto& func : *g_Module) {
+        if (func.isDeclaration() || func.hasFnAttribute("target-cpu"))
+            continue;
+        func.addFnAttr("target-cpu", cpu);
+        if (!features.empty())
+            func.addFnAttr("target-features", features);
+    }
+}
+
+// Native object emission for the host target, "machine" from createObjectMachine
+// lets callers keep one around
+inline void emitObject(llvm::raw_pwrite_stream& stream, llvm::TargetMachine* machine = nullptr) {
+    std::unique_ptr<llvm::TargetMachine> own;
+    if (!machine) {
+        own = createObjectMachine();
+        machine = own.get();
+    }
+
+    g_Module->setTargetTriple(machine->getTargetTriple().str());
+    g_Module->setDataLayout(machine->createDataLayout());
+
+    llvm::legacy::PassManager pm;
+    if (machine->addPassesToEmitFile(pm, stream, nullptr, llvm::CGFT_ObjectFile))
+        throw std::runtime_error("[emitObject] Target can't emit an object file");
+
+    pm.run(*g_Module);
+}
+
+// output.ll -> LLVM IR, output.bc -> bitcode, output.o / output.obj -> object file,
+// output.a -> archive of "codegenThreads" partitions generated in parallel
+inline void write2File(const std::string& filename, bool opt = false, unsigned codegenThreads = 1) {
+
+    if (hasExtension(filename, ".a")) {
+        emitPartitioned(filename, codegenThreads, opt);
+        return;
+    }
+    if (codegenThreads > 1)
+        throw std::runtime_error("[write2File] --codegen-threads needs an archive output (.a), partitions can't be merged into one object");
 
     std::error_code error;
     llvm::raw_fd_ostream filestream(filename , error);
@@ -99,10 +262,19 @@ void write2File(const std::string& filename, bool opt = false) {
         return;
     }
 
+    auto machine = createObjectMachine();
+    setTarget(machine.get());
     if (opt)
-        optimize();
+        optimize(machine.get());
+    else
+        lowerCoroutines();
 
-    g_Module->print(filestream, nullptr);
+    if (hasExtension(filename, ".o") || hasExtension(filename, ".obj"))
+        emitObject(filestream, machine.get());
+    else if (hasExtension(filename, ".bc"))
+        llvm::WriteBitcodeToFile(*g_Module, filestream);
+    else
+        g_Module->print(filestream, nullptr);
 
     filestream.close();
 }
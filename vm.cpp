@@ -0,0 +1,361 @@
+#include "vm.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "runtime.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define DALG_COMPUTED_GOTO 1
+#endif
+
+namespace {
+
+	// Registers of every frame of a thread. Never moved, dalg_sync writes spawn
+	// results into it, and untouched pages cost nothing.
+	const size_t stackSlots = size_t(1) << 22;
+
+	struct RegisterStack {
+		std::unique_ptr<double[]> slots;
+		size_t top = 0;
+	};
+
+	thread_local RegisterStack registerStack;
+
+	// zeroed registers, like the entry block slots of codegen
+	double* pushFrame(RegisterStack& stack, const BytecodeFunction& func) {
+		if (!stack.slots)
+			stack.slots.reset(new double[stackSlots]);
+		if (stackSlots - stack.top < func.registers)
+			throw std::runtime_error("[VM] Stack overflow in function: " + func.name);
+
+		double* regs = stack.slots.get() + stack.top;
+		std::fill(regs, regs + func.registers, 0.0);
+		stack.top += func.registers;
+		return regs;
+	}
+
+	// caller of the running function
+	struct Frame {
+		const BytecodeFunction* func;
+		const Instr* pc;
+		double* regs;
+		uint16_t dst;
+		const double* memoArgs;   // arguments of a @memo call, stored on return
+	};
+
+	const unsigned memoProbes = 4;
+
+	// murmur3 fmix64 per argument, like the generated wrapper
+	uint64_t memoHome(const MemoTable& table, const double* args, size_t nargs) {
+		uint64_t hash = 0x9E3779B97F4A7C15ULL;
+		for (size_t i = 0; i < nargs; i++) {
+			uint64_t key;
+			std::memcpy(&key, &args[i], sizeof(key));
+			hash ^= key;
+			hash ^= hash >> 33;
+			hash *= 0xFF51AFD7ED558CCDULL;
+			hash ^= hash >> 33;
+			hash *= 0xC4CEB9FE1A85EC53ULL;
+			hash ^= hash >> 33;
+		}
+		return hash & (table.capacity - 1);
+	}
+
+	bool memoSame(const MemoTable& table, uint64_t slot, const double* args, size_t nargs) {
+		return std::memcmp(&table.keys[slot * nargs], args, nargs * sizeof(double)) == 0;
+	}
+
+	bool memoFind(MemoTable& table, const double* args, size_t nargs, double& out) {
+		const uint64_t home = memoHome(table, args, nargs);
+		const unsigned probes = static_cast<unsigned>(std::min<uint64_t>(memoProbes, table.capacity));
+
+		std::lock_guard<std::mutex> guard(table.lock);
+		for (unsigned p = 0; p < probes; p++) {
+			const uint64_t slot = (home + p) & (table.capacity - 1);
+			// an empty slot ends the window
+			if (!table.full[slot])
+				return false;
+			if (memoSame(table, slot, args, nargs)) {
+				out = table.values[slot];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// first empty or equal slot of the window, else the home slot unless "keep"
+	void memoStore(MemoTable& table, const double* args, size_t nargs, double value) {
+		const uint64_t home = memoHome(table, args, nargs);
+		const unsigned probes = static_cast<unsigned>(std::min<uint64_t>(memoProbes, table.capacity));
+
+		std::lock_guard<std::mutex> guard(table.lock);
+		bool found = !table.keep;
+		uint64_t target = home;
+		for (unsigned p = 0; p < probes; p++) {
+			const uint64_t slot = (home + p) & (table.capacity - 1);
+			if (!table.full[slot] || memoSame(table, slot, args, nargs)) {
+				found = true;
+				target = slot;
+				break;
+			}
+		}
+		if (!found)
+			return;
+
+		if (nargs)
+			std::memcpy(&table.keys[target * nargs], args, nargs * sizeof(double));
+		table.values[target] = value;
+		table.full[target] = 1;
+	}
+
+	// futures live in registers as pointer bits, null is 0.0
+	double pointerBits(void* ptr) {
+		const uint64_t bits = reinterpret_cast<uintptr_t>(ptr);
+		double value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	void* bitsPointer(double value) {
+		uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return reinterpret_cast<void*>(static_cast<uintptr_t>(bits));
+	}
+
+	// args -> [module, function, arguments...]
+	double spawnedCall(const double* args) {
+		const auto* module = static_cast<const BytecodeModule*>(bitsPointer(args[0]));
+		return runBytecode(*module, static_cast<uint16_t>(args[1]), args + 2);
+	}
+
+	void* spawn(const BytecodeModule& module, uint16_t function, const double* args) {
+		const uint16_t params = module.functions[function].params;
+		std::vector<double> task(params + 2);
+		task[0] = pointerBits(const_cast<BytecodeModule*>(&module));
+		task[1] = function;
+		std::copy(args, args + params, task.begin() + 2);
+
+		// dalg_spawn keeps a copy
+		return dalg_spawn(spawnedCall, task.data(), static_cast<int32_t>(task.size()));
+	}
+
+	struct ChunkEnv {
+		const BytecodeModule* module;
+		uint16_t function;
+		const double* values;   // captured variables, start, step
+		size_t count;
+	};
+
+	double parforChunk(void* env, int64_t begin, int64_t end) {
+		const auto* chunk = static_cast<const ChunkEnv*>(env);
+		std::vector<double> args(chunk->values, chunk->values + chunk->count);
+		args.push_back(static_cast<double>(begin));
+		args.push_back(static_cast<double>(end));
+		return runBytecode(*chunk->module, chunk->function, args.data());
+	}
+
+	// env -> [count, captured variables..., start, step], count is >= 0 or NaN
+	double parfor(const BytecodeModule& module, uint16_t function, const double* env) {
+		const BytecodeFunction& chunk = module.functions[function];
+		const double step = env[chunk.params - 2];
+		int64_t count = env[0] > 0 ? (env[0] < 9.2e18 ? static_cast<int64_t>(env[0]) : INT64_MAX) : 0;
+
+		// a step that isn't a finite number > 0 runs nothing, like codegen
+		if (!(step > 0.0) || !std::isfinite(step))
+			count = 0;
+
+		ChunkEnv chunkEnv{ &module, function, env + 1, static_cast<size_t>(chunk.params - 2) };
+		return dalg_parfor(parforChunk, &chunkEnv, count, chunk.reduce);
+	}
+
+	bool isTrue(double value) {
+		return value < 0.0 || value > 0.0;
+	}
+
+}
+
+double runBytecode(const BytecodeModule& module, uint16_t function, const double* args) {
+	RegisterStack& stack = registerStack;
+
+	// the frames of this call, also when it throws
+	struct Restore {
+		RegisterStack& stack;
+		size_t top;
+		~Restore() {
+			stack.top = top;
+		}
+	} restore{ stack, stack.top };
+
+	const BytecodeFunction* func = &module.functions[function];
+	double cached;
+	if (func->memo && memoFind(*func->memo, args, func->params, cached))
+		return cached;
+
+	double* regs = pushFrame(stack, *func);
+	std::copy(args, args + func->params, regs);
+
+	const Instr* code = func->code.data();
+	const double* K = func->constants.data();
+	const Instr* pc = code;
+	const Instr* ins = nullptr;
+	std::vector<Frame> frames;
+
+#ifdef DALG_COMPUTED_GOTO
+	static void* const labels[] = {
+#define DALG_OPCODE_LABEL(name) &&op_##name,
+		DALG_OPCODES(DALG_OPCODE_LABEL)
+#undef DALG_OPCODE_LABEL
+	};
+#define OPCODE(name) op_##name:
+#define NEXT() do { ins = pc++; goto *labels[static_cast<uint8_t>(ins->op)]; } while (0)
+	NEXT();
+#else
+#define OPCODE(name) case Opcode::name:
+#define NEXT() break
+	for (;;) {
+		ins = pc++;
+		switch (ins->op) {
+#endif
+
+	OPCODE(LoadK)
+		regs[ins->a] = K[ins->b];
+		NEXT();
+	OPCODE(Move)
+		regs[ins->a] = regs[ins->b];
+		NEXT();
+
+	OPCODE(Add)
+		regs[ins->a] = regs[ins->b] + regs[ins->c];
+		NEXT();
+	OPCODE(Sub)
+		regs[ins->a] = regs[ins->b] - regs[ins->c];
+		NEXT();
+	OPCODE(Mul)
+		regs[ins->a] = regs[ins->b] * regs[ins->c];
+		NEXT();
+	OPCODE(Div)
+		regs[ins->a] = regs[ins->b] / regs[ins->c];
+		NEXT();
+
+	// ordered, false when either side is NaN
+	OPCODE(Lt)
+		regs[ins->a] = regs[ins->b] < regs[ins->c] ? 1.0 : 0.0;
+		NEXT();
+	OPCODE(Gt)
+		regs[ins->a] = regs[ins->b] > regs[ins->c] ? 1.0 : 0.0;
+		NEXT();
+	OPCODE(Le)
+		regs[ins->a] = regs[ins->b] <= regs[ins->c] ? 1.0 : 0.0;
+		NEXT();
+	OPCODE(Ge)
+		regs[ins->a] = regs[ins->b] >= regs[ins->c] ? 1.0 : 0.0;
+		NEXT();
+	OPCODE(Eq)
+		regs[ins->a] = regs[ins->b] == regs[ins->c] ? 1.0 : 0.0;
+		NEXT();
+	OPCODE(Ne)
+		regs[ins->a] = regs[ins->b] < regs[ins->c] || regs[ins->b] > regs[ins->c] ? 1.0 : 0.0;
+		NEXT();
+
+	OPCODE(Min)
+		regs[ins->a] = std::fmin(regs[ins->b], regs[ins->c]);
+		NEXT();
+	OPCODE(Max)
+		regs[ins->a] = std::fmax(regs[ins->b], regs[ins->c]);
+		NEXT();
+	OPCODE(Ceil)
+		regs[ins->a] = std::ceil(regs[ins->b]);
+		NEXT();
+	OPCODE(Positive)
+		regs[ins->a] = regs[ins->b] > 0.0 ? regs[ins->b] : 0.0;
+		NEXT();
+	OPCODE(Bool)
+		regs[ins->a] = isTrue(regs[ins->b]) ? 1.0 : 0.0;
+		NEXT();
+	OPCODE(Not)
+		regs[ins->a] = isTrue(regs[ins->b]) ? 0.0 : 1.0;
+		NEXT();
+
+	OPCODE(Jump)
+		pc = code + jumpTarget(*ins);
+		NEXT();
+	OPCODE(JumpIfFalse)
+		if (!isTrue(regs[ins->a]))
+			pc = code + jumpTarget(*ins);
+		NEXT();
+	OPCODE(JumpIfTrue)
+		if (isTrue(regs[ins->a]))
+			pc = code + jumpTarget(*ins);
+		NEXT();
+
+	OPCODE(Call) {
+		const BytecodeFunction* callee = &module.functions[ins->b];
+		const double* callArgs = regs + ins->c;
+		if (callee->memo && memoFind(*callee->memo, callArgs, callee->params, regs[ins->a]))
+			NEXT();
+
+		double* calleeRegs = pushFrame(stack, *callee);
+		std::copy(callArgs, callArgs + callee->params, calleeRegs);
+		frames.push_back(Frame{ func, pc, regs, ins->a, callee->memo ? callArgs : nullptr });
+
+		func = callee;
+		code = func->code.data();
+		K = func->constants.data();
+		pc = code;
+		regs = calleeRegs;
+		NEXT();
+	}
+	OPCODE(Ret) {
+		const double value = regs[ins->a];
+		if (frames.empty()) {
+			if (func->memo)
+				memoStore(*func->memo, args, func->params, value);
+			return value;
+		}
+
+		stack.top = regs - stack.slots.get();
+		const Frame caller = frames.back();
+		frames.pop_back();
+		if (caller.memoArgs)
+			memoStore(*func->memo, caller.memoArgs, func->params, value);
+
+		func = caller.func;
+		code = func->code.data();
+		K = func->constants.data();
+		pc = caller.pc;
+		regs = caller.regs;
+		regs[caller.dst] = value;
+		NEXT();
+	}
+
+	OPCODE(PrintNum)
+		std::printf("%f\n", regs[ins->b]);
+		regs[ins->a] = 0.0;
+		NEXT();
+	OPCODE(PrintStr)
+		std::printf("%s\n", module.strings[ins->b].c_str());
+		regs[ins->a] = 0.0;
+		NEXT();
+
+	OPCODE(Spawn)
+		regs[ins->a] = pointerBits(spawn(module, ins->b, regs + ins->c));
+		NEXT();
+	OPCODE(Sync)
+		dalg_sync(bitsPointer(regs[ins->a]), ins->b == noRegister ? nullptr : regs + ins->b);
+		regs[ins->a] = 0.0;
+		NEXT();
+	OPCODE(ParFor)
+		regs[ins->a] = parfor(module, ins->b, regs + ins->c);
+		NEXT();
+
+#ifndef DALG_COMPUTED_GOTO
+		}
+	}
+#endif
+#undef OPCODE
+#undef NEXT
+}
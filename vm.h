@@ -0,0 +1,11 @@
+#pragma once
+
+#include "bytecode.h"
+
+// Interpreter for bytecode.h, one dispatch per instruction (computed goto
+// with GCC and clang, a switch elsewhere). Calls don't recurse in C++, the
+// frames of a thread share one register stack. spawn, sync and parfor use
+// the runtime thread pool like compiled code, so their results match it.
+
+// Runs functions[function] on the calling thread, "args" holds its params
+double runBytecode(const BytecodeModule& module, uint16_t function, const double* args);